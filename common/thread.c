@@ -53,6 +53,16 @@ void thread_join(thread_t thread)
 #endif
 }
 
+void thread_detach(thread_t thread)
+{
+	/* let the thread release its resources when it ends */
+#ifdef WIN32
+	CloseHandle(thread);
+#else
+	pthread_detach(thread);
+#endif
+}
+
 void mutex_init(mutex_t* mutex)
 {
 #ifdef WIN32
@@ -89,6 +99,49 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifndef WIN32
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
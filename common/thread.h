@@ -26,19 +26,23 @@
 #include <windows.h>
 typedef HANDLE thread_t;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
 } thread_once_t;
 #define THREAD_ONCE_INIT {0, 0}
 #define THREAD_ID GetCurrentThreadId()
+typedef DWORD thread_id_t;
 #else
 #include <pthread.h>
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
+typedef pthread_t thread_id_t;
 #endif
 
 typedef void* (*thread_func_t)(void* data);
@@ -46,12 +50,19 @@ typedef void* (*thread_func_t)(void* data);
 int thread_new(thread_t* thread, thread_func_t thread_func, void* data);
 void thread_free(thread_t thread);
 void thread_join(thread_t thread);
+void thread_detach(thread_t thread);
 
 void mutex_init(mutex_t* mutex);
 void mutex_destroy(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_signal(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
 #endif
@@ -61,6 +61,7 @@
 #include "userpref.h"
 #include "debug.h"
 #include "utils.h"
+#include "thread.h"
 
 #ifndef HAVE_OPENSSL
 const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
@@ -93,6 +94,23 @@ const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
 
 static char *__config_dir = NULL;
 
+struct pair_record_cache_entry {
+	char *udid;
+	plist_t pair_record;
+	struct pair_record_cache_entry *next;
+};
+
+static struct pair_record_cache_entry *pair_record_cache = NULL;
+static uint64_t pair_record_cache_hits = 0;
+static uint64_t pair_record_cache_misses = 0;
+static mutex_t pair_record_cache_mutex;
+static thread_once_t pair_record_cache_once = THREAD_ONCE_INIT;
+
+static void pair_record_cache_init(void)
+{
+	mutex_init(&pair_record_cache_mutex);
+}
+
 #ifdef WIN32
 static char *userpref_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, long *items_written)
 {
@@ -298,6 +316,68 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	return USERPREF_E_SUCCESS;
 }
 
+/**
+ * Looks up a cached pair record. Must be called with the cache mutex held.
+ */
+static struct pair_record_cache_entry *pair_record_cache_find(const char *udid)
+{
+	struct pair_record_cache_entry *entry;
+	for (entry = pair_record_cache; entry; entry = entry->next) {
+		if (!strcmp(entry->udid, udid))
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Removes the cached pair record for a device so that the next call to
+ * userpref_read_pair_record() reads it from usbmuxd again.
+ *
+ * @param udid The device UDID, or NULL to remove all cached pair records.
+ */
+void userpref_pair_record_cache_invalidate(const char *udid)
+{
+	struct pair_record_cache_entry **prev;
+	struct pair_record_cache_entry *entry;
+
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	prev = &pair_record_cache;
+	while (*prev) {
+		entry = *prev;
+		if (!udid || !strcmp(entry->udid, udid)) {
+			*prev = entry->next;
+			debug_info("removing cached pair record for udid %s", entry->udid);
+			plist_free(entry->pair_record);
+			free(entry->udid);
+			free(entry);
+		} else {
+			prev = &entry->next;
+		}
+	}
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Retrieves the number of userpref_read_pair_record() calls that were
+ * answered from the pair record cache and the number that were not.
+ *
+ * @param hits Set to the number of cache hits. Can be NULL.
+ * @param misses Set to the number of cache misses. Can be NULL.
+ */
+void userpref_pair_record_cache_get_stats(uint64_t *hits, uint64_t *misses)
+{
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	if (hits)
+		*hits = pair_record_cache_hits;
+	if (misses)
+		*misses = pair_record_cache_misses;
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
 /**
  * Save a pair record for a device.
  *
@@ -318,6 +398,8 @@ userpref_error_t userpref_save_pair_record(const char *udid, plist_t pair_record
 
 	free(record_data);
 
+	userpref_pair_record_cache_invalidate(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -334,6 +416,24 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 {
 	char* record_data = NULL;
 	uint32_t record_size = 0;
+	struct pair_record_cache_entry *entry;
+
+	if (!udid || !pair_record)
+		return USERPREF_E_INVALID_ARG;
+
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+
+	mutex_lock(&pair_record_cache_mutex);
+	entry = pair_record_cache_find(udid);
+	if (entry) {
+		pair_record_cache_hits++;
+		*pair_record = plist_copy(entry->pair_record);
+		mutex_unlock(&pair_record_cache_mutex);
+		debug_info("using cached pair record for udid %s", udid);
+		return USERPREF_E_SUCCESS;
+	}
+	pair_record_cache_misses++;
+	mutex_unlock(&pair_record_cache_mutex);
 
 	int res = usbmuxd_read_pair_record(udid, &record_data, &record_size);
 
@@ -353,6 +453,20 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 
 	free(record_data);
 
+	if (res == 0 && *pair_record) {
+		mutex_lock(&pair_record_cache_mutex);
+		if (!pair_record_cache_find(udid)) {
+			entry = (struct pair_record_cache_entry*)malloc(sizeof(struct pair_record_cache_entry));
+			if (entry) {
+				entry->udid = strdup(udid);
+				entry->pair_record = plist_copy(*pair_record);
+				entry->next = pair_record_cache;
+				pair_record_cache = entry;
+			}
+		}
+		mutex_unlock(&pair_record_cache_mutex);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -367,6 +481,8 @@ userpref_error_t userpref_delete_pair_record(const char *udid)
 {
 	int res = usbmuxd_delete_pair_record(udid);
 
+	userpref_pair_record_cache_invalidate(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -66,6 +66,8 @@ int userpref_read_system_buid(char **system_buid);
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record);
 userpref_error_t userpref_save_pair_record(const char *udid, plist_t pair_record);
 userpref_error_t userpref_delete_pair_record(const char *udid);
+void userpref_pair_record_cache_invalidate(const char *udid);
+void userpref_pair_record_cache_get_stats(uint64_t *hits, uint64_t *misses);
 
 userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key);
 #ifdef HAVE_OPENSSL
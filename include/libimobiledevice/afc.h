@@ -92,6 +92,49 @@ typedef enum {
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+/** Receives the data read by afc_file_read_pipelined() in file order.
+ *  Return 0 to continue reading or a non-zero value to stop. */
+typedef int (*afc_file_read_cb_t)(const char *data, uint32_t length, void *user_data);
+
+/** Type of an entry visited by afc_tree_copy() */
+typedef enum {
+	AFC_TREE_ENTRY_UNKNOWN   = 0, /**< type not known */
+	AFC_TREE_ENTRY_FILE      = 1, /**< regular file, copied to the local tree */
+	AFC_TREE_ENTRY_DIRECTORY = 2, /**< directory, created in the local tree */
+	AFC_TREE_ENTRY_LINK      = 3, /**< symbolic link, not copied */
+	AFC_TREE_ENTRY_OTHER     = 4  /**< any other type, not copied */
+} afc_tree_entry_type_t;
+
+/** Describes an entry visited by afc_tree_copy() */
+typedef struct {
+	const char *device_path; /**< path of the entry on the device */
+	const char *local_path;  /**< path of the entry in the local tree */
+	const char *link_target; /**< target of a symbolic link, or NULL */
+	afc_tree_entry_type_t type; /**< type of the entry */
+	uint64_t size;           /**< size of the entry in bytes */
+	uint64_t mtime;          /**< modification time in nanoseconds since the epoch */
+	afc_error_t error;       /**< AFC_E_SUCCESS if the entry was handled, an AFC_E_* error value otherwise */
+} afc_tree_entry_t;
+
+/** Describes an entry returned by afc_read_directory_batched() */
+typedef struct {
+	const char *name;        /**< name of the entry */
+	const char *link_target; /**< target of a symbolic link, or NULL */
+	afc_tree_entry_type_t type; /**< type of the entry, AFC_TREE_ENTRY_UNKNOWN without file information */
+	uint64_t size;           /**< size of the entry in bytes */
+	uint64_t mtime;          /**< modification time in nanoseconds since the epoch */
+	afc_error_t error;       /**< result of querying the file information */
+} afc_dir_entry_t;
+
+/** Receives a batch of entries read by afc_read_directory_batched(). The
+ *  entries are only valid during the call.
+ *  Return 0 to continue reading or a non-zero value to stop. */
+typedef int (*afc_dir_read_cb_t)(const afc_dir_entry_t *entries, uint32_t count, void *user_data);
+
+/** Called by afc_tree_copy() for each entry once it has been handled.
+ *  Return 0 to continue or a non-zero value to stop the copy. */
+typedef int (*afc_tree_copy_cb_t)(const afc_tree_entry_t *entry, void *user_data);
+
 /* Interface */
 
 /**
@@ -121,6 +164,26 @@ afc_error_t afc_client_new(idevice_t device, lockdownd_service_descriptor_t serv
  */
 afc_error_t afc_client_start_service(idevice_t device, afc_client_t* client, const char* label);
 
+/**
+ * Starts several AFC services on the specified device and connects to each
+ * of them, e.g. to spread a transfer across multiple connections with
+ * afc_download_file() or afc_upload_file().
+ *
+ * @param device The device to connect to.
+ * @param clients Array that will be filled with newly allocated afc_client_t
+ *        handles upon successful return. Each must be freed using
+ *        afc_client_free() after use.
+ * @param num_clients The number of connections to establish. Will be set to
+ *        the number of connections actually established, which can be less
+ *        if the device refused further connections.
+ * @param label The label to use for communication. Usually the program name.
+ *        Pass NULL to disable sending the label in requests to lockdownd.
+ *
+ * @return AFC_E_SUCCESS if at least one connection was established, or an
+ *         AFC_E_* error code otherwise.
+ */
+afc_error_t afc_client_start_service_multiple(idevice_t device, afc_client_t *clients, uint32_t *num_clients, const char* label);
+
 /**
  * Frees up an AFC client. If the connection was created by the client itself,
  * the connection will be closed.
@@ -156,6 +219,28 @@ afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
  */
 afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information);
 
+/**
+ * Reads a directory in batches of entries, optionally together with the
+ * file information of each entry.
+ *
+ * On iOS 6 and later the directory is read incrementally with a directory
+ * enumerator, otherwise with a single request. File information for a batch
+ * is requested with several requests in flight. The entries of a batch and
+ * their strings are allocated from a shared arena instead of individually.
+ *
+ * @param client The client to read the directory with.
+ * @param path The directory to read.
+ * @param with_info Set to 1 to also query the file information of each
+ *        entry, or 0 to only return the names.
+ * @param batch_cb Callback function that receives the entries in batches.
+ *        The client can be used from within the callback.
+ * @param user_data Application-specific data passed to the callback.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         stopped the listing, or an AFC_E_* error value.
+ */
+afc_error_t afc_read_directory_batched(afc_client_t client, const char *path, int with_info, afc_dir_read_cb_t batch_cb, void *user_data);
+
 /**
  * Gets information about a specific file.
  *
@@ -216,6 +301,23 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
  */
 afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read);
 
+/**
+ * Reads a file from its current position until the end of the file while
+ * keeping multiple read requests outstanding, so that the latency of each
+ * request overlaps with the transfer of the previous ones.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param sink_cb Callback function that receives the read data in order.
+ * @param user_data Application-specific data passed to the callback.
+ * @param depth The number of read requests to keep outstanding, or 0 to use
+ *        a reasonable default.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         stopped the transfer, or an AFC_E_* error value.
+ */
+afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, afc_file_read_cb_t sink_cb, void *user_data, uint32_t depth);
+
 /**
  * Writes a given number of bytes to a file.
  *
@@ -359,6 +461,78 @@ afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
  */
 afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value);
 
+/**
+ * Gets the hash of a file as calculated by the device.
+ *
+ * @param client The client to use.
+ * @param path The file to hash.
+ * @param hash Will be set to a newly allocated buffer holding the hash
+ *        upon successful return. Free with free().
+ * @param hash_length Will be set to the length of the hash in bytes, which
+ *        is 20 for the SHA-1 hashes calculated by the device.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_length);
+
+/**
+ * Gets the hash of a range of a file as calculated by the device.
+ *
+ * @param client The client to use.
+ * @param path The file to hash.
+ * @param offset The offset of the range in the file.
+ * @param length The number of bytes in the range.
+ * @param hash Will be set to a newly allocated buffer holding the hash
+ *        upon successful return. Free with free().
+ * @param hash_length Will be set to the length of the hash in bytes.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_hash_range(afc_client_t client, const char *path, uint64_t offset, uint64_t length, char **hash, uint32_t *hash_length);
+
+/**
+ * Updates a local copy of a device file, transferring only the parts that
+ * differ.
+ *
+ * The part both files have in common is compared block by block using
+ * hashes calculated by the device, and only changed blocks are read. Data
+ * beyond the end of the local file is always read, and the local file is
+ * truncated if it is larger. The whole file is read if the device cannot
+ * hash ranges. The modification time of the file is preserved.
+ *
+ * @param client The client to use.
+ * @param device_path The file on the device.
+ * @param local_path The local copy to update. It is created if it does
+ *        not exist.
+ * @param bytes_transferred Will be set to the number of bytes read from the
+ *        device. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_IS_DIR if device_path is a
+ *         directory, or an AFC_E_* error value.
+ */
+afc_error_t afc_sync_file(afc_client_t client, const char *device_path, const char *local_path, uint64_t *bytes_transferred);
+
+/**
+ * Updates a device file from a local file, writing only the parts that
+ * differ.
+ *
+ * The device file is hashed in blocks and compared against the local file.
+ * Only changed blocks and data beyond the end of the device file are
+ * written, using FileRefWriteWithOffset where supported, and the device
+ * file is truncated if it is larger than the local file. A missing device
+ * file is uploaded as a whole.
+ *
+ * @param client The client to use.
+ * @param local_path The local file to upload.
+ * @param device_path The file on the device to update.
+ * @param bytes_transferred Will be set to the number of bytes written to
+ *        the device. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_IS_DIR if device_path is a
+ *         directory, or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_file_delta(afc_client_t client, const char *local_path, const char *device_path, uint64_t *bytes_transferred);
+
 /**
  * Frees up a char dictionary as returned by some AFC functions.
  *
@@ -368,6 +542,71 @@ afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char *
  */
 afc_error_t afc_dictionary_free(char **dictionary);
 
+/**
+ * Copies a file or a directory tree from the device to the local filesystem.
+ *
+ * The work is spread across all given connections: directories are listed
+ * with their file information requested in a pipelined fashion, and files
+ * are read in large chunks with several read requests in flight. The
+ * modification times of the copied files and of the directories created by
+ * the copy are preserved.
+ *
+ * The callback is invoked for every entry below device_path once it has been
+ * handled, with a directory only being reported after all of its contents.
+ * It is called from the worker threads, but never concurrently. It must not
+ * use the given clients, as the workers keep using them until the copy has
+ * finished.
+ *
+ * @param clients Array of AFC clients connected to the same service.
+ * @param num_clients The number of clients in the array.
+ * @param device_path The file or directory on the device to copy.
+ * @param local_path The local path to copy device_path to. Missing
+ *        directories are created, existing files are overwritten.
+ * @param entry_cb Callback function that is called for each entry, or NULL.
+ * @param user_data Application-specific data passed to the callback.
+ *
+ * @return AFC_E_SUCCESS if device_path was copied, AFC_E_OP_INTERRUPTED if
+ *         the callback stopped the copy, or an AFC_E_* error value. Errors
+ *         of the entries below device_path are only reported through the
+ *         callback.
+ */
+afc_error_t afc_tree_copy(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path, afc_tree_copy_cb_t entry_cb, void *user_data);
+
+/**
+ * Copies a single file from the device to the local filesystem, splitting it
+ * into ranges that are read concurrently over all given connections.
+ *
+ * Ranges are read with FileRefReadWithOffset requests on iOS 7 and later,
+ * falling back to a seek followed by sequential reads on older devices. The
+ * modification time of the file is preserved.
+ *
+ * @param clients Array of AFC clients connected to the same service.
+ * @param num_clients The number of clients in the array.
+ * @param device_path The file on the device to copy.
+ * @param local_path The local file to create or overwrite.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OBJECT_IS_DIR if device_path is a
+ *         directory, or an AFC_E_* error value.
+ */
+afc_error_t afc_download_file(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path);
+
+/**
+ * Copies a single local file to the device, splitting it into ranges that
+ * are written concurrently over all given connections.
+ *
+ * Ranges are written with FileRefWriteWithOffset requests on iOS 7 and
+ * later, falling back to a seek followed by sequential writes on older
+ * devices.
+ *
+ * @param clients Array of AFC clients connected to the same service.
+ * @param num_clients The number of clients in the array.
+ * @param local_path The local file to copy.
+ * @param device_path The file on the device to create or overwrite.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_upload_file(afc_client_t *clients, uint32_t num_clients, const char *local_path, const char *device_path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,7 +42,9 @@ typedef enum {
 	IDEVICE_E_NO_DEVICE       = -3,
 	IDEVICE_E_NOT_ENOUGH_DATA = -4,
 	IDEVICE_E_BAD_HEADER      = -5,
-	IDEVICE_E_SSL_ERROR       = -6
+	IDEVICE_E_SSL_ERROR       = -6,
+	IDEVICE_E_WANT_READ       = -7,
+	IDEVICE_E_WANT_WRITE      = -8
 } idevice_error_t;
 
 typedef struct idevice_private idevice_private;
@@ -66,10 +68,32 @@ typedef struct {
 	int conn_type; /**< The connection type. Currently only 1 for usbmuxd. */
 } idevice_event_t;
 
+/** Describes one buffer of a scatter/gather send operation. */
+typedef struct {
+	const char *data; /**< Pointer to the data to send. */
+	uint32_t length; /**< Number of bytes to send from data. */
+} idevice_iovec_t;
+
+typedef struct idevice_loop_private idevice_loop_private;
+typedef idevice_loop_private *idevice_loop_t; /**< The event loop handle. */
+
+/** Events a connection can be watched for with an event loop. */
+enum idevice_loop_event {
+	IDEVICE_LOOP_READ  = 1 << 0, /**< The connection is readable. */
+	IDEVICE_LOOP_WRITE = 1 << 1, /**< The connection is writable. */
+	IDEVICE_LOOP_HUP   = 1 << 2  /**< The connection was closed or failed. Always reported. */
+};
+
+/** Callback to notify that a connection watched by an event loop is ready. */
+typedef void (*idevice_loop_cb_t) (idevice_connection_t connection, int events, void *user_data);
+
 /* event callback function prototype */
 /** Callback to notifiy if a device was added or removed. */
 typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_data);
 
+typedef struct idevice_subscription_context_private idevice_subscription_context_private;
+typedef idevice_subscription_context_private *idevice_subscription_context_t; /**< The event subscription handle. */
+
 /* functions */
 
 /**
@@ -79,6 +103,19 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
  */
 void idevice_set_debug_level(int level);
 
+/**
+ * Enable or disable caching of SSL credentials and sessions.
+ *
+ * When enabled (the default), the certificates and keys imported from the
+ * pair record of a device are kept in memory per device udid and reused for
+ * further SSL connections to the same device, which also try to resume the
+ * previously established SSL session. Disabling the cache discards all
+ * cached credentials and sessions.
+ *
+ * @param enabled Set to 0 to disable or 1 to enable the cache.
+ */
+void idevice_set_ssl_cache(int enabled);
+
 /**
  * Register a callback function that will be called when device add/remove
  * events occur.
@@ -99,6 +136,41 @@ idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_
  */
 idevice_error_t idevice_event_unsubscribe(void);
 
+/**
+ * Subscribe to device add/remove events. Any number of subscriptions with
+ * their own callback and user data can be active at the same time.
+ *
+ * The callback is invoked with IDEVICE_DEVICE_ADD events for all devices
+ * that are already attached before this function returns. Callbacks of
+ * all subscriptions are invoked one after the other, never concurrently.
+ * They may subscribe or unsubscribe themselves.
+ *
+ * While at least one subscription is active, idevice_get_device_list() and
+ * idevice_new() are answered from an internal device table indexed by udid
+ * instead of querying usbmuxd. idevice_new() still asks usbmuxd for devices
+ * missing in the table.
+ *
+ * @param context Pointer that will be set to the handle of the new
+ *   subscription. Pass it to idevice_events_unsubscribe_ex() to end it.
+ * @param callback Callback function to call.
+ * @param user_data Application-specific data passed as parameter
+ *   to the callback function.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occured.
+ */
+idevice_error_t idevice_events_subscribe_ex(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data);
+
+/**
+ * End a subscription created with idevice_events_subscribe_ex(). The
+ * callback of the subscription is not invoked anymore once this function
+ * returns.
+ *
+ * @param context The subscription handle.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occured.
+ */
+idevice_error_t idevice_events_unsubscribe_ex(idevice_subscription_context_t context);
+
 /* discovery (synchronous) */
 
 /**
@@ -121,6 +193,22 @@ idevice_error_t idevice_get_device_list(char ***devices, int *count);
  */
 idevice_error_t idevice_device_list_free(char **devices);
 
+/**
+ * Get statistics of the in-process pair record cache.
+ *
+ * Pair records read from usbmuxd are cached per device udid until they are
+ * saved or deleted, or until the device is detached.
+ *
+ * @param hits Set to the number of pair record reads answered from the
+ *   cache. Can be NULL.
+ * @param misses Set to the number of pair record reads that had to query
+ *   usbmuxd. Can be NULL.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG when both
+ *   hits and misses are NULL.
+ */
+idevice_error_t idevice_get_pair_record_cache_stats(uint64_t *hits, uint64_t *misses);
+
 /* device structure creation and destruction */
 
 /**
@@ -185,6 +273,43 @@ idevice_error_t idevice_disconnect(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
 
+/**
+ * Send data from multiple buffers to a device via the given connection.
+ * The buffers are sent in order as if they were one contiguous buffer, but
+ * with as few writes (or SSL records) as possible.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send.
+ * @param iovcnt Number of elements in the iov array.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the total number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes);
+
+/**
+ * Send the contents of a file to a device via the given connection.
+ * Without SSL the data is passed to the connection with sendfile() where
+ * available, otherwise it is read into a large buffer and sent from there.
+ * The connection should be in blocking mode. sendfile() waits until a
+ * non-blocking socket can take more data, but the buffered path sends with
+ * idevice_connection_send() and returns early once it sends less.
+ *
+ * @param connection The connection to send data over.
+ * @param fd File descriptor of the file to send from. Its file offset is
+ *   not changed, except on Windows where the file is read after seeking
+ *   to the data.
+ * @param offset Offset in the file to start sending from.
+ * @param length Number of bytes to send.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the number of bytes actually sent. This is less than length if
+ *   the end of the file has been reached.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes);
+
 /**
  * Receive data from a device via the given connection.
  * This function will return after the given timeout even if no data has been
@@ -239,6 +364,165 @@ idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection);
 
+/* non-blocking communication */
+
+/**
+ * Gets the file descriptor of the socket underlying the given connection,
+ * e.g. to watch it with poll() or an external event loop.
+ *
+ * @note Data might already be buffered by the SSL layer while the socket
+ *   itself is not readable, so a readable connection should be read until
+ *   idevice_connection_receive_nonblock() returns IDEVICE_E_WANT_READ.
+ *
+ * @param connection The connection to get the file descriptor for.
+ * @param fd Pointer to an int that will be set to the file descriptor.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
+
+/**
+ * Switches the given connection to non-blocking or back to blocking mode.
+ *
+ * @note While in non-blocking mode, only the non-blocking send and receive
+ *   functions may be used with the connection. SSL has to be enabled before
+ *   switching to non-blocking mode.
+ *
+ * @param connection The connection to change.
+ * @param nonblocking Set to 1 to enable or 0 to disable non-blocking mode.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_set_nonblocking(idevice_connection_t connection, int nonblocking);
+
+/**
+ * Send data to a device via the given connection without blocking.
+ *
+ * @note If IDEVICE_E_WANT_READ or IDEVICE_E_WANT_WRITE is returned on an
+ *   SSL enabled connection, the call has to be repeated with the same data
+ *   once the connection becomes readable or writable respectively.
+ *
+ * @param connection The connection to send data over. Must be in
+ *   non-blocking mode.
+ * @param data Buffer with data to send.
+ * @param len Size of the buffer to send.
+ * @param sent_bytes Pointer to an uint32_t that will be filled with the
+ *   number of bytes actually sent, which can be less than len.
+ *
+ * @return IDEVICE_E_SUCCESS if data was sent, IDEVICE_E_WANT_WRITE or
+ *   IDEVICE_E_WANT_READ if the connection has to become writable or readable
+ *   before data can be sent, or another error code on failure.
+ */
+idevice_error_t idevice_connection_send_nonblock(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
+
+/**
+ * Receive data from a device via the given connection without blocking.
+ *
+ * @param connection The connection to receive data from. Must be in
+ *   non-blocking mode.
+ * @param data Buffer that will be filled with the received data.
+ *   This buffer has to be large enough to hold len bytes.
+ * @param len Buffer size or maximum number of bytes to receive.
+ * @param recv_bytes Number of bytes actually received.
+ *
+ * @return IDEVICE_E_SUCCESS if data was received, IDEVICE_E_WANT_READ or
+ *   IDEVICE_E_WANT_WRITE if the connection has to become readable or
+ *   writable before data can be received, or another error code on failure
+ *   or if the connection was closed.
+ */
+idevice_error_t idevice_connection_receive_nonblock(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes);
+
+/* event loop */
+
+/**
+ * Creates a new event loop that multiplexes any number of connections in a
+ * single thread. Only available on systems with epoll support.
+ *
+ * @param loop Pointer that will be set to the new event loop.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if event loops
+ *   are not supported on this system, otherwise an error code.
+ */
+idevice_error_t idevice_loop_new(idevice_loop_t *loop);
+
+/**
+ * Frees an event loop. Connections added to the loop are not closed.
+ *
+ * @param loop The event loop to free.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_free(idevice_loop_t loop);
+
+/**
+ * Adds a connection to an event loop and switches it to non-blocking mode.
+ * The connection has to be removed from the loop before it is closed.
+ *
+ * @param loop The event loop.
+ * @param connection The connection to watch.
+ * @param events A combination of IDEVICE_LOOP_READ and IDEVICE_LOOP_WRITE.
+ * @param callback Function to call when the connection is ready. It may
+ *   add, modify or remove connections of the loop, including its own.
+ * @param user_data Application-specific data passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_add(idevice_loop_t loop, idevice_connection_t connection, int events, idevice_loop_cb_t callback, void *user_data);
+
+/**
+ * Changes the events a connection is watched for.
+ *
+ * @param loop The event loop.
+ * @param connection A connection previously added to the loop.
+ * @param events A combination of IDEVICE_LOOP_READ and IDEVICE_LOOP_WRITE.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_modify(idevice_loop_t loop, idevice_connection_t connection, int events);
+
+/**
+ * Removes a connection from an event loop. The connection stays in
+ * non-blocking mode.
+ *
+ * @param loop The event loop.
+ * @param connection A connection previously added to the loop.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_remove(idevice_loop_t loop, idevice_connection_t connection);
+
+/**
+ * Waits for events on the connections of an event loop and invokes the
+ * callbacks of all connections that are ready.
+ *
+ * @param loop The event loop.
+ * @param timeout Maximum time to wait in milliseconds, or -1 to wait
+ *   until an event occurs.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_run_once(idevice_loop_t loop, int timeout);
+
+/**
+ * Runs an event loop until idevice_loop_stop() is called or no connections
+ * are left in the loop.
+ *
+ * @param loop The event loop.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_run(idevice_loop_t loop);
+
+/**
+ * Makes idevice_loop_run() return after the current iteration. Has to be
+ * called from a callback of the loop.
+ *
+ * @param loop The event loop.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_loop_stop(idevice_loop_t loop);
+
 /* misc */
 
 /**
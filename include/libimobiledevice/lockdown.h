@@ -118,6 +118,20 @@ typedef struct lockdownd_service_descriptor *lockdownd_service_descriptor_t;
  */
 lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *client, const char *label);
 
+/**
+ * Enable or disable pooling of lockdownd sessions.
+ *
+ * When enabled (the default), the *_client_start_service() functions of all
+ * services keep the lockdownd client with its running session for a few
+ * seconds after starting a service and reuse it to start further services
+ * on the same device, instead of performing a new handshake every time.
+ * The pooled sessions of a device are closed when its last idevice_t handle
+ * is freed. Disabling the pool closes all pooled sessions.
+ *
+ * @param enabled Set to 0 to disable or 1 to enable the pool.
+ */
+void lockdownd_set_client_pool(int enabled);
+
 /**
  * Creates a new lockdownd client for the device and starts initial handshake.
  * The handshake consists out of query_type, validate_pair, pair and
@@ -171,6 +185,30 @@ lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type);
  */
 lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value);
 
+/**
+ * Retrieves multiple preference values in one go. All GetValue requests are
+ * sent before the first reply is read, so the whole batch only costs a
+ * single round trip to the device.
+ *
+ * @param client An initialized lockdownd client.
+ * @param domains Array of count domains to query on, with NULL entries for
+ *    the global domain. Pass NULL to query all keys in the global domain.
+ * @param keys Array of count key names, with NULL entries to query for all
+ *    keys of the respective domain.
+ * @param count Number of domain/key pairs to query.
+ * @param out Will be set to a PLIST_ARRAY with one PLIST_DICT per queried
+ *    pair, in request order. Each dict contains the queried "Domain" and
+ *    "Key" plus either the retrieved "Value" or an "Error" string describing
+ *    why the value could not be retrieved. Must be freed with plist_free().
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client,
+ *    keys or out is NULL or count is 0, or an error code if communicating
+ *    with the device failed. Errors for individual keys are reported in out
+ *    and do not fail the call. If sending a request failed, out contains the
+ *    replies of the requests sent before and the send error is returned.
+ */
+lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *out);
+
 /**
  * Sets a preferences value using a plist and optional by domain and/or key name.
  *
@@ -142,6 +142,45 @@ mobilebackup2_error_t mobilebackup2_receive_message(mobilebackup2_client_t clien
  */
 mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, const char *data, uint32_t length, uint32_t *bytes);
 
+/**
+ * Send binary data from multiple buffers to the device, as if they were one
+ * contiguous buffer.
+ *
+ * @note This function returns MOBILEBACKUP2_E_SUCCESS even if less than the
+ *     requested length has been sent. The fourth parameter is required and
+ *     must be checked to ensure if the whole data has been sent.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of elements in the iov array
+ * @param bytes Total number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *bytes);
+
+/**
+ * Send the contents of a file to the device as binary data. Without SSL
+ * the data does not need to be copied through user space.
+ *
+ * @note This function returns MOBILEBACKUP2_E_SUCCESS even if less than the
+ *     requested length has been sent. The fifth parameter is required and
+ *     must be checked to ensure if the whole data has been sent.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param fd File descriptor of the file to send from
+ * @param offset Offset in the file to start sending from
+ * @param length Number of bytes to send
+ * @param bytes Number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+mobilebackup2_error_t mobilebackup2_send_raw_file(mobilebackup2_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *bytes);
+
 /**
  * Receive binary from the device.
  *
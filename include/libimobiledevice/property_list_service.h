@@ -38,6 +38,7 @@ typedef enum {
 	PROPERTY_LIST_SERVICE_E_MUX_ERROR       = -3,
 	PROPERTY_LIST_SERVICE_E_SSL_ERROR       = -4,
 	PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT = -5,
+	PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA = -6,
 	PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR   = -256
 } property_list_service_error_t;
 
@@ -137,6 +138,43 @@ property_list_service_error_t property_list_service_receive_plist_with_timeout(p
  */
 property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist);
 
+/**
+ * Receives a plist using the given property list service client without
+ * blocking. The connection of the client has to be in non-blocking mode,
+ * see idevice_connection_set_nonblocking() and idevice_loop_add().
+ *
+ * Partially received packets are kept by the client, so this function can
+ * be called whenever the connection becomes readable until it returns
+ * PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA.
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist pointer to a plist_t that will point to the received plist
+ *      upon successful return
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when no complete plist has
+ *      been received yet, PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or
+ *      plist is NULL, PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received
+ *      data cannot be converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR
+ *      or PROPERTY_LIST_SERVICE_E_SSL_ERROR when a communication error occurs,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error
+ *      occurs.
+ */
+property_list_service_error_t property_list_service_receive_plist_nonblock(property_list_service_client_t client, plist_t *plist);
+
+/**
+ * Sets the maximum size of a plist packet the given client accepts. Larger
+ * packets are rejected with PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR.
+ *
+ * @param client The property list service client.
+ * @param max_size Maximum packet size in bytes, or 0 to use the default of
+ *      64 MiB.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success, or
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_set_max_size(property_list_service_client_t client, uint32_t max_size);
+
 /**
  * Enable SSL for the given property list service client.
  *
@@ -162,6 +200,20 @@ property_list_service_error_t property_list_service_enable_ssl(property_list_ser
  */
 property_list_service_error_t property_list_service_disable_ssl(property_list_service_client_t client);
 
+/**
+ * Gets the connection of the given property list service client, e.g. to
+ * add it to an idevice_loop_t for non-blocking communication.
+ *
+ * @param client The connected property list service client.
+ * @param connection Pointer that will be set to the connection. The
+ *     connection is owned by the client and must not be freed.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success, or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG if client, its connection or
+ *     connection is NULL.
+ */
+property_list_service_error_t property_list_service_get_connection(property_list_service_client_t client, idevice_connection_t *connection);
+
 #ifdef __cplusplus
 }
 #endif
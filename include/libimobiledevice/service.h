@@ -105,6 +105,38 @@ service_error_t service_client_free(service_client_t client);
  */
 service_error_t service_send(service_client_t client, const char *data, uint32_t size, uint32_t *sent);
 
+/**
+ * Sends data from multiple buffers using the given service client, as if they
+ * were one contiguous buffer.
+ *
+ * @param client The service client to use for sending.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of elements in the iov array
+ * @param sent Total number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent);
+
+/**
+ * Sends the contents of a file using the given service client.
+ *
+ * @param client The service client to use for sending.
+ * @param fd File descriptor of the file to send from
+ * @param offset Offset in the file to start sending from
+ * @param length Number of bytes to send
+ * @param sent Number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_send_file(service_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *sent);
+
 /**
  * Receives data using the given service client with specified timeout.
  *
@@ -162,6 +194,20 @@ service_error_t service_enable_ssl(service_client_t client);
  */
 service_error_t service_disable_ssl(service_client_t client);
 
+/**
+ * Gets the connection of the given service client, e.g. to add it to an
+ * idevice_loop_t for non-blocking communication.
+ *
+ * @param client The connected service client.
+ * @param connection Pointer that will be set to the connection. The
+ *     connection is owned by the service client and must not be freed.
+ *
+ * @return SERVICE_E_SUCCESS on success, or
+ *     SERVICE_E_INVALID_ARG if client, client->connection or connection
+ *     is NULL.
+ */
+service_error_t service_get_connection(service_client_t client, idevice_connection_t *connection);
+
 #ifdef __cplusplus
 }
 #endif
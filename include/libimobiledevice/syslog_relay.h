@@ -38,15 +38,49 @@ typedef enum {
 	SYSLOG_RELAY_E_INVALID_ARG   = -1,
 	SYSLOG_RELAY_E_MUX_ERROR     = -2,
 	SYSLOG_RELAY_E_SSL_ERROR     = -3,
+	SYSLOG_RELAY_E_PARSE_ERROR   = -4,
 	SYSLOG_RELAY_E_UNKNOWN_ERROR = -256
 } syslog_relay_error_t;
 
+/** Severity levels of syslog messages */
+typedef enum {
+	SYSLOG_RELAY_LEVEL_UNKNOWN   = 0,
+	SYSLOG_RELAY_LEVEL_DEBUG     = 1,
+	SYSLOG_RELAY_LEVEL_INFO      = 2,
+	SYSLOG_RELAY_LEVEL_NOTICE    = 3,
+	SYSLOG_RELAY_LEVEL_WARNING   = 4,
+	SYSLOG_RELAY_LEVEL_ERROR     = 5,
+	SYSLOG_RELAY_LEVEL_CRITICAL  = 6,
+	SYSLOG_RELAY_LEVEL_ALERT     = 7,
+	SYSLOG_RELAY_LEVEL_EMERGENCY = 8
+} syslog_relay_level_t;
+
+/** Refers to a part of a syslog line. The data is not NUL terminated. */
+typedef struct {
+	const char *data; /**< Pointer to the start of the part in the line. */
+	uint32_t length; /**< Length of the part, 0 if not present. */
+} syslog_relay_field_t;
+
+/** A syslog line split into its parts. */
+typedef struct {
+	syslog_relay_field_t timestamp; /**< Time of the message, e.g. "Oct 15 12:34:56". */
+	syslog_relay_field_t device_name; /**< Name of the device. */
+	syslog_relay_field_t process; /**< Name of the sending process. */
+	syslog_relay_field_t image; /**< Library or plugin that sent the message, if given. */
+	int pid; /**< Process id of the sender or -1 if not given. */
+	syslog_relay_level_t level; /**< Severity of the message. */
+	syslog_relay_field_t message; /**< The message itself. */
+} syslog_relay_record_t;
+
 typedef struct syslog_relay_client_private syslog_relay_client_private;
 typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client handle. */
 
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/** Receives blocks of syslog data received from the device. */
+typedef void (*syslog_relay_receive_raw_cb_t)(const char *data, uint32_t length, void *user_data);
+
 /* Interface */
 
 /**
@@ -106,6 +140,29 @@ syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client);
  */
 syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device using a callback that receives
+ * the data in blocks instead of single characters.
+ *
+ * The syslog is read in chunks of up to 64 KiB. The NUL bytes separating
+ * the messages are removed and each block passed to the callback ends with
+ * a complete line, unless a single line exceeds the buffer size or the
+ * connection was closed in the middle of a line.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive blocks of the syslog. The data is not
+ *      NUL terminated and only valid during the callback.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_raw_cb_t callback, void* user_data);
+
 /**
  * Stops capturing the syslog of the device.
  *
@@ -120,6 +177,47 @@ syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, sy
  */
 syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client);
 
+/* Parsing */
+
+/**
+ * Splits a syslog line as received from the device into its parts without
+ * copying any data.
+ *
+ * Lines are expected in the format
+ * "Oct 15 12:34:56 DeviceName process(image)[pid] <Level>: message",
+ * where the image and level parts are optional.
+ *
+ * @param line The line to parse. A trailing newline is ignored.
+ * @param length Length of the line.
+ * @param record Pointer to a record that will be filled with the parts
+ *      of the line. The fields point into line.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when line or record is NULL, or
+ *      SYSLOG_RELAY_E_PARSE_ERROR when the line does not start with a
+ *      syslog header, e.g. because it continues a multi-line message.
+ *      In that case only the message field is set, to the whole line.
+ */
+syslog_relay_error_t syslog_relay_parse_line(const char *line, uint32_t length, syslog_relay_record_t *record);
+
+/**
+ * Gets the name of a syslog severity level as used by the device.
+ *
+ * @param level The level.
+ *
+ * @return The name of the level, e.g. "Notice", or "Unknown".
+ */
+const char *syslog_relay_level_to_string(syslog_relay_level_t level);
+
+/**
+ * Gets a syslog severity level by its name, ignoring case.
+ *
+ * @param name The name of the level, e.g. "notice".
+ *
+ * @return The matching level or SYSLOG_RELAY_LEVEL_UNKNOWN.
+ */
+syslog_relay_level_t syslog_relay_level_from_string(const char *name);
+
 /* Receiving */
 
 /**
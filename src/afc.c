@@ -28,12 +28,39 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include "afc.h"
 #include "idevice.h"
 #include "common/debug.h"
 #include "endianness.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef WIN32
+#define afc_lseek _lseeki64
+#define afc_ftruncate _chsize_s
+#else
+#define afc_lseek lseek
+#define afc_ftruncate ftruncate
+#endif
+
 /**
  * Locks an AFC client, done for thread safety stuff
  *
@@ -152,6 +179,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
  */
 static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, const char *data, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
 {
+	idevice_iovec_t iov[3];
+	uint32_t iovcnt = 0;
 	uint32_t sent = 0;
 
 	if (!client || !client->parent || !client->afc_packet)
@@ -173,52 +202,51 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 
 	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket));
 
-	/* send AFC packet header */
+	/* send AFC packet header, data and payload with a single write */
 	AFCPacket_to_LE(client->afc_packet);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket), &sent);
-	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket)) {
-		return AFC_E_SUCCESS;
-	}
-
-	/* send AFC packet data (if there's data to send) */
-	sent = 0;
+	iov[iovcnt].data = (const char*)client->afc_packet;
+	iov[iovcnt].length = sizeof(AFCPacket);
+	iovcnt++;
 	if (data_length > 0) {
 		debug_info("packet data follows");
 		debug_buffer(data, data_length);
-		service_send(client->parent, data, data_length, &sent);
-	}
-	*bytes_sent += sent;
-	if (sent < data_length) {
-		return AFC_E_SUCCESS;
+		iov[iovcnt].data = data;
+		iov[iovcnt].length = data_length;
+		iovcnt++;
 	}
-
-	sent = 0;
 	if (payload_length > 0) {
 		debug_info("packet payload follows");
 		debug_buffer(payload, payload_length);
-		service_send(client->parent, payload, payload_length, &sent);
-	}
-	*bytes_sent += sent;
-	if (sent < payload_length) {
-		return AFC_E_SUCCESS;
+		iov[iovcnt].data = payload;
+		iov[iovcnt].length = payload_length;
+		iovcnt++;
 	}
+	service_sendv(client->parent, iov, iovcnt, &sent);
+	AFCPacket_from_LE(client->afc_packet);
+	*bytes_sent = sent;
 
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives the reply to a specific AFC packet through an AFC client and sets
+ * a variable to the received data.
+ *
+ * If a destination buffer is given and the reply is an AFC_OP_DATA packet
+ * that fits into it, the packet contents are received directly into the
+ * destination buffer and bytes will be set to NULL. Otherwise a buffer is
+ * allocated for the packet contents and returned in bytes.
  *
  * @param client The client to receive data on.
+ * @param packet_num The packet number the reply is expected to carry.
+ * @param dest Optional buffer to receive data replies into, or NULL.
+ * @param dest_size The size of the dest buffer.
  * @param bytes The char* to point to the newly-received data.
  * @param bytes_recv How much data was received.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_data_for_packet(afc_client_t client, uint64_t packet_num, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -226,6 +254,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	uint32_t current_count = 0;
 	uint64_t param1 = -1;
 	char* dump_here = NULL;
+	char* buf = NULL;
 
 	if (bytes_recv) {
 		*bytes_recv = 0;
@@ -251,9 +280,9 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header.packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
@@ -277,9 +306,19 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
 	this_len = (uint32_t)header.this_length - sizeof(AFCPacket);
 
-	dump_here = (char*)malloc(entire_len);
+	if (dest && (header.operation == AFC_OP_DATA) && (entire_len <= dest_size)) {
+		/* receive data replies straight into the caller's buffer */
+		buf = dest;
+	} else {
+		dump_here = (char*)malloc(entire_len);
+		if (!dump_here) {
+			debug_info("out of memory when allocating %d bytes", entire_len);
+			return AFC_E_NO_MEM;
+		}
+		buf = dump_here;
+	}
 	if (this_len > 0) {
-		service_receive(client->parent, dump_here, this_len, bytes_recv);
+		service_receive(client->parent, buf, this_len, bytes_recv);
 		if (*bytes_recv <= 0) {
 			free(dump_here);
 			debug_info("Did not get packet contents!");
@@ -295,7 +334,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 	if (entire_len > this_len) {
 		while (current_count < entire_len) {
-			service_receive(client->parent, dump_here+current_count, entire_len - current_count, bytes_recv);
+			service_receive(client->parent, buf+current_count, entire_len - current_count, bytes_recv);
 			if (*bytes_recv <= 0) {
 				debug_info("Error receiving data (recv returned %d)", *bytes_recv);
 				break;
@@ -308,12 +347,12 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	if (current_count >= sizeof(uint64_t)) {
-		param1 = le64toh(*(uint64_t*)(dump_here));
+		param1 = le64toh(*(uint64_t*)(buf));
 	}
 
 	debug_info("packet data size = %i", current_count);
 	debug_info("packet data follows");
-	debug_buffer(dump_here, current_count);
+	debug_buffer(buf, current_count);
 
 	/* check operation types */
 	if (header.operation == AFC_OP_STATUS) {
@@ -335,6 +374,9 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	} else if (header.operation == AFC_OP_FILE_TELL_RES) {
 		/* tell response */
 		debug_info("got a tell response, position=%lld", param1);
+	} else if (header.operation == AFC_OP_DIR_OPEN_RESULT) {
+		/* directory enumerator handle response */
+		debug_info("got a directory handle response, handle=%lld", param1);
 	} else {
 		/* unknown operation code received */
 		free(dump_here);
@@ -358,6 +400,37 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Receives data through an AFC client and sets a variable to the received data.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_data_for_packet(client, client->afc_packet->packet_num, NULL, 0, bytes, bytes_recv);
+}
+
+/**
+ * Receives data through an AFC client into the given buffer if possible.
+ *
+ * @param client The client to receive data on.
+ * @param dest The buffer to receive data replies into.
+ * @param dest_size The size of the dest buffer.
+ * @param bytes Set to a newly allocated buffer holding the received data if
+ *        the reply could not be received into dest, NULL otherwise.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data_to_buffer(afc_client_t client, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_data_for_packet(client, client->afc_packet->packet_num, dest, dest_size, bytes, bytes_recv);
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -686,8 +759,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the data */
-	ret = afc_receive_data(client, &input, &bytes_loc);
+	/* Receive the data, directly into the caller's buffer if it fits */
+	ret = afc_receive_data_to_buffer(client, data, length, &input, &bytes_loc);
 	debug_info("afc_receive_data returned error: %d", ret);
 	debug_info("bytes returned: %i", bytes_loc);
 	if (ret != AFC_E_SUCCESS) {
@@ -701,7 +774,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 		/* FIXME: check that's actually a success */
 		return ret;
 	} else {
-		if (input) {
+		if (!input) {
+			current_count += bytes_loc;
+		} else {
 			debug_info("%d", bytes_loc);
 			memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
 			free(input);
@@ -714,6 +789,135 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 	return ret;
 }
 
+/**
+ * Checks if an error returned while receiving a reply means that the replies
+ * to requests still in flight can no longer be matched to them.
+ */
+static int afc_error_breaks_stream(afc_error_t error)
+{
+	return (error == AFC_E_MUX_ERROR || error == AFC_E_OP_HEADER_INVALID || error == AFC_E_NOT_ENOUGH_DATA);
+}
+
+/**
+ * Reads a file until its end with up to depth read requests of chunk_size
+ * bytes outstanding, receiving the replies into the given buffer.
+ *
+ * @param client The AFC client to read through.
+ * @param handle File handle of a previously opened file.
+ * @param chunk Buffer of chunk_size bytes to receive the replies into.
+ * @param chunk_size The number of bytes to request with each read.
+ * @param sink_cb Callback function that receives the read data in order.
+ * @param user_data Application-specific data passed to the callback.
+ * @param depth The number of read requests to keep outstanding.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         stopped the transfer, or an AFC_E_* error value.
+ */
+static afc_error_t afc_file_read_pipelined_to_buffer(afc_client_t client, uint64_t handle, char *chunk, uint32_t chunk_size, afc_file_read_cb_t sink_cb, void *user_data, uint32_t depth)
+{
+	char *input = NULL;
+	uint32_t bytes_loc = 0;
+	uint32_t in_flight = 0;
+	uint64_t next_packet_num = 0;
+	int eof = 0;
+	int stop = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t rret = AFC_E_SUCCESS;
+
+	afc_lock(client);
+
+	struct {
+		uint64_t handle;
+		uint64_t size;
+	} readinfo;
+	readinfo.handle = handle;
+	readinfo.size = htole64(chunk_size);
+
+	/* replies arrive in the order the requests were sent */
+	next_packet_num = client->afc_packet->packet_num + 1;
+
+	while (1) {
+		/* keep up to depth read requests outstanding */
+		while (!eof && !stop && in_flight < depth) {
+			ret = afc_dispatch_packet(client, AFC_OP_FILE_READ, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes_loc);
+			if (ret != AFC_E_SUCCESS || bytes_loc < sizeof(AFCPacket) + sizeof(readinfo)) {
+				debug_info("could not send read request");
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				stop = 1;
+				break;
+			}
+			in_flight++;
+		}
+
+		if (in_flight == 0) {
+			break;
+		}
+
+		/* receive the oldest outstanding reply */
+		rret = afc_receive_data_for_packet(client, next_packet_num, chunk, chunk_size, &input, &bytes_loc);
+		next_packet_num++;
+		in_flight--;
+
+		if (rret != AFC_E_SUCCESS) {
+			free(input);
+			input = NULL;
+			if (!stop) {
+				ret = rret;
+				stop = 1;
+			}
+			if (afc_error_breaks_stream(rret)) {
+				/* the stream is out of sync, remaining replies are lost */
+				break;
+			}
+			continue;
+		}
+
+		/* a short read means end of file, later replies will be empty */
+		eof = (bytes_loc < chunk_size);
+
+		if (!stop && bytes_loc > 0) {
+			if (sink_cb((input) ? input : chunk, bytes_loc, user_data) != 0) {
+				debug_info("read interrupted by callback");
+				ret = AFC_E_OP_INTERRUPTED;
+				stop = 1;
+			}
+		}
+		free(input);
+		input = NULL;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, afc_file_read_cb_t sink_cb, void *user_data, uint32_t depth)
+{
+	char *chunk = NULL;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0 || !sink_cb)
+		return AFC_E_INVALID_ARG;
+
+	if (depth == 0) {
+		depth = AFC_READ_PIPELINE_DEFAULT_DEPTH;
+	} else if (depth > AFC_READ_PIPELINE_MAX_DEPTH) {
+		depth = AFC_READ_PIPELINE_MAX_DEPTH;
+	}
+	debug_info("called with pipeline depth %d", depth);
+
+	/* all replies are received into one reusable buffer */
+	chunk = (char*)malloc(AFC_READ_PIPELINE_CHUNK_SIZE);
+	if (!chunk)
+		return AFC_E_NO_MEM;
+
+	ret = afc_file_read_pipelined_to_buffer(client, handle, chunk, AFC_READ_PIPELINE_CHUNK_SIZE, sink_cb, user_data, depth);
+
+	free(chunk);
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
 {
 	uint32_t current_count = 0;
@@ -1036,3 +1240,1851 @@ LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 
 	return AFC_E_SUCCESS;
 }
+
+/** A node of the tree being copied by afc_tree_copy(). */
+struct afc_tree_node {
+	struct afc_tree_node *parent;
+	struct afc_tree_node *next;
+	char *device_path;
+	char *local_path;
+	char *link_target;
+	afc_tree_entry_type_t type;
+	uint64_t size;
+	uint64_t mtime;
+	uint32_t pending;
+	int created;
+	afc_error_t error;
+};
+
+/** The state shared by the workers of afc_tree_copy(). */
+struct afc_tree_copy {
+	mutex_t mutex;
+	cond_t cond;
+	struct afc_tree_node *head;
+	struct afc_tree_node *tail;
+	int done;
+	int abort;
+	afc_error_t error;
+	mutex_t cb_mutex;
+	afc_tree_copy_cb_t entry_cb;
+	void *user_data;
+};
+
+/** A worker of afc_tree_copy() with its own AFC connection. */
+struct afc_tree_worker {
+	struct afc_tree_copy *copy;
+	afc_client_t client;
+	thread_t thread;
+};
+
+/** The local file a tree copy worker writes the read data to. */
+struct afc_tree_file_sink {
+	FILE *f;
+	uint64_t written;
+	int failed;
+};
+
+static char *afc_tree_build_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	int need_slash = (dir_len > 0 && dir[dir_len-1] != '/');
+	char *path = (char*)malloc(dir_len + need_slash + name_len + 1);
+
+	if (!path)
+		return NULL;
+	memcpy(path, dir, dir_len);
+	if (need_slash)
+		path[dir_len++] = '/';
+	memcpy(path + dir_len, name, name_len + 1);
+
+	return path;
+}
+
+static struct afc_tree_node *afc_tree_node_new(struct afc_tree_node *parent, char *device_path, char *local_path)
+{
+	struct afc_tree_node *node = NULL;
+
+	if (device_path && local_path) {
+		node = (struct afc_tree_node*)calloc(1, sizeof(struct afc_tree_node));
+	}
+	if (!node) {
+		free(device_path);
+		free(local_path);
+		return NULL;
+	}
+	node->parent = parent;
+	node->device_path = device_path;
+	node->local_path = local_path;
+	node->type = AFC_TREE_ENTRY_OTHER;
+	node->pending = 1;
+	node->error = AFC_E_SUCCESS;
+
+	return node;
+}
+
+static void afc_tree_node_free(struct afc_tree_node *node)
+{
+	if (!node)
+		return;
+	free(node->device_path);
+	free(node->local_path);
+	free(node->link_target);
+	free(node);
+}
+
+/**
+ * Fills in the type, size, modification time and link target of a node from
+ * the key/value list returned by a GetFileInfo request.
+ */
+static void afc_tree_node_set_info(struct afc_tree_node *node, char **info)
+{
+	int i;
+
+	node->type = AFC_TREE_ENTRY_OTHER;
+	for (i = 0; info && info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_size")) {
+			node->size = strtoull(info[i+1], NULL, 10);
+		} else if (!strcmp(info[i], "st_mtime")) {
+			node->mtime = strtoull(info[i+1], NULL, 10);
+		} else if (!strcmp(info[i], "st_ifmt")) {
+			if (!strcmp(info[i+1], "S_IFREG")) {
+				node->type = AFC_TREE_ENTRY_FILE;
+			} else if (!strcmp(info[i+1], "S_IFDIR")) {
+				node->type = AFC_TREE_ENTRY_DIRECTORY;
+			} else if (!strcmp(info[i+1], "S_IFLNK")) {
+				node->type = AFC_TREE_ENTRY_LINK;
+			}
+		} else if (!strcmp(info[i], "LinkTarget")) {
+			free(node->link_target);
+			node->link_target = strdup(info[i+1]);
+		}
+	}
+}
+
+static void afc_tree_set_local_mtime(const char *path, uint64_t mtime)
+{
+	struct utimbuf times;
+
+	if (mtime == 0)
+		return;
+	times.actime = (time_t)(mtime / 1000000000);
+	times.modtime = (time_t)(mtime / 1000000000);
+	if (utime(path, &times) < 0) {
+		debug_info("could not set modification time of %s: %s", path, strerror(errno));
+	}
+}
+
+static void afc_tree_copy_push(struct afc_tree_copy *copy, struct afc_tree_node *node)
+{
+	node->next = NULL;
+	if (copy->tail) {
+		copy->tail->next = node;
+	} else {
+		copy->head = node;
+	}
+	copy->tail = node;
+	cond_signal(&copy->cond);
+}
+
+/**
+ * Drops one pending reference of a node. Once nothing is pending anymore the
+ * node is finished: directories get their modification time restored after
+ * all of their children have been written, the entry is reported to the
+ * callback and the reference the node holds on its parent is dropped.
+ */
+static void afc_tree_node_release(struct afc_tree_copy *copy, struct afc_tree_node *node)
+{
+	while (node) {
+		struct afc_tree_node *parent = node->parent;
+		int finished = 0;
+
+		mutex_lock(&copy->mutex);
+		finished = (--node->pending == 0);
+		mutex_unlock(&copy->mutex);
+		if (!finished)
+			break;
+
+		if (node->error == AFC_E_SUCCESS && node->type == AFC_TREE_ENTRY_DIRECTORY && node->created) {
+			afc_tree_set_local_mtime(node->local_path, node->mtime);
+		}
+
+		if (parent) {
+			if (copy->entry_cb) {
+				afc_tree_entry_t entry;
+				entry.device_path = node->device_path;
+				entry.local_path = node->local_path;
+				entry.link_target = node->link_target;
+				entry.type = node->type;
+				entry.size = node->size;
+				entry.mtime = node->mtime;
+				entry.error = node->error;
+
+				mutex_lock(&copy->cb_mutex);
+				if (!copy->abort && copy->entry_cb(&entry, copy->user_data) != 0) {
+					debug_info("tree copy interrupted by callback");
+					mutex_lock(&copy->mutex);
+					copy->abort = 1;
+					mutex_unlock(&copy->mutex);
+				}
+				mutex_unlock(&copy->cb_mutex);
+			}
+		} else {
+			/* the whole tree has been processed */
+			mutex_lock(&copy->mutex);
+			copy->error = node->error;
+			copy->done = 1;
+			cond_broadcast(&copy->cond);
+			mutex_unlock(&copy->mutex);
+		}
+
+		afc_tree_node_free(node);
+		node = parent;
+	}
+}
+
+static int afc_tree_file_sink_cb(const char *data, uint32_t length, void *user_data)
+{
+	struct afc_tree_file_sink *sink = (struct afc_tree_file_sink*)user_data;
+
+	if (fwrite(data, 1, length, sink->f) != length) {
+		sink->failed = 1;
+		return 1;
+	}
+	sink->written += length;
+
+	return 0;
+}
+
+static void afc_tree_copy_file(struct afc_tree_worker *worker, struct afc_tree_node *node, char *chunk)
+{
+	struct afc_tree_file_sink sink;
+	uint64_t handle = 0;
+	uint64_t depth = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	ret = afc_file_open(worker->client, node->device_path, AFC_FOPEN_RDONLY, &handle);
+	if (ret != AFC_E_SUCCESS) {
+		node->error = ret;
+		return;
+	}
+
+	sink.f = fopen(node->local_path, "wb");
+	sink.written = 0;
+	sink.failed = 0;
+	if (!sink.f) {
+		debug_info("could not open local file %s: %s", node->local_path, strerror(errno));
+		afc_file_close(worker->client, handle);
+		node->error = AFC_E_WRITE_ERROR;
+		return;
+	}
+
+	/* do not request far beyond the end of small files */
+	depth = node->size / AFC_TREE_COPY_CHUNK_SIZE + 1;
+	if (depth > AFC_TREE_COPY_READ_DEPTH)
+		depth = AFC_TREE_COPY_READ_DEPTH;
+
+	ret = afc_file_read_pipelined_to_buffer(worker->client, handle, chunk, AFC_TREE_COPY_CHUNK_SIZE, afc_tree_file_sink_cb, &sink, (uint32_t)depth);
+	afc_file_close(worker->client, handle);
+	if (fclose(sink.f) != 0) {
+		sink.failed = 1;
+	}
+
+	if (sink.failed) {
+		ret = AFC_E_WRITE_ERROR;
+	} else if (ret == AFC_E_SUCCESS && sink.written != node->size) {
+		debug_info("size mismatch for %s (%llu != %llu)", node->device_path, (unsigned long long)sink.written, (unsigned long long)node->size);
+		ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+	node->error = ret;
+
+	if (ret == AFC_E_SUCCESS) {
+		afc_tree_set_local_mtime(node->local_path, node->mtime);
+	}
+}
+
+/** A directory being listed by a tree copy worker. */
+struct afc_tree_listing {
+	struct afc_tree_copy *copy;
+	struct afc_tree_node *dir;
+};
+
+/**
+ * Turns a batch of directory entries into child nodes, queueing directories
+ * and files for the workers and finishing all other entries right away.
+ */
+static int afc_tree_copy_batch_cb(const afc_dir_entry_t *entries, uint32_t count, void *user_data)
+{
+	struct afc_tree_listing *listing = (struct afc_tree_listing*)user_data;
+	struct afc_tree_copy *copy = listing->copy;
+	struct afc_tree_node *dir = listing->dir;
+	struct afc_tree_node *child = NULL;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		child = afc_tree_node_new(dir, afc_tree_build_path(dir->device_path, entries[i].name), afc_tree_build_path(dir->local_path, entries[i].name));
+		if (!child) {
+			dir->error = AFC_E_NO_MEM;
+			return 1;
+		}
+		child->type = entries[i].type;
+		child->size = entries[i].size;
+		child->mtime = entries[i].mtime;
+		child->error = entries[i].error;
+		if (entries[i].link_target) {
+			child->link_target = strdup(entries[i].link_target);
+		}
+
+		mutex_lock(&copy->mutex);
+		dir->pending++;
+		if (child->error == AFC_E_SUCCESS && (child->type == AFC_TREE_ENTRY_DIRECTORY || child->type == AFC_TREE_ENTRY_FILE)) {
+			afc_tree_copy_push(copy, child);
+			child = NULL;
+		}
+		mutex_unlock(&copy->mutex);
+
+		if (child) {
+			afc_tree_node_release(copy, child);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Creates a local directory, and with parents set also any missing parent
+ * directories.
+ *
+ * @return 1 if path was created, 0 if it already existed, or -1 on error.
+ */
+static int afc_tree_make_directory(char *path, int parents)
+{
+	char *p = NULL;
+
+	if (parents && *path) {
+		for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+			*p = '\0';
+#ifdef WIN32
+			if (mkdir(path) < 0 && errno != EEXIST) {
+#else
+			if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+#endif
+				*p = '/';
+				return -1;
+			}
+			*p = '/';
+		}
+	}
+
+#ifdef WIN32
+	if (mkdir(path) < 0) {
+#else
+	if (mkdir(path, 0755) < 0) {
+#endif
+		return (errno == EEXIST) ? 0 : -1;
+	}
+
+	return 1;
+}
+
+static void afc_tree_copy_directory(struct afc_tree_worker *worker, struct afc_tree_node *dir)
+{
+	struct afc_tree_listing listing;
+	afc_error_t ret = AFC_E_SUCCESS;
+	int res;
+
+	/* the parents of the tree's root might be missing as well */
+	res = afc_tree_make_directory(dir->local_path, (dir->parent == NULL));
+	if (res < 0) {
+		debug_info("could not create local directory %s: %s", dir->local_path, strerror(errno));
+		dir->error = AFC_E_WRITE_ERROR;
+		return;
+	}
+	/* only directories created by the copy get the device's time */
+	dir->created = res;
+
+	/* children are handed to the other workers while the listing continues */
+	listing.copy = worker->copy;
+	listing.dir = dir;
+	ret = afc_read_directory_batched(worker->client, dir->device_path, 1, afc_tree_copy_batch_cb, &listing);
+	if (ret != AFC_E_SUCCESS && dir->error == AFC_E_SUCCESS) {
+		dir->error = ret;
+	}
+}
+
+static void *afc_tree_copy_worker(void *arg)
+{
+	struct afc_tree_worker *worker = (struct afc_tree_worker*)arg;
+	struct afc_tree_copy *copy = worker->copy;
+	struct afc_tree_node *node = NULL;
+	char *chunk = NULL;
+	int abort = 0;
+
+	chunk = (char*)malloc(AFC_TREE_COPY_CHUNK_SIZE);
+
+	while (1) {
+		mutex_lock(&copy->mutex);
+		while (!copy->head && !copy->done) {
+			cond_wait(&copy->cond, &copy->mutex);
+		}
+		node = copy->head;
+		if (node) {
+			copy->head = node->next;
+			if (!copy->head)
+				copy->tail = NULL;
+		}
+		abort = copy->abort;
+		mutex_unlock(&copy->mutex);
+
+		if (!node)
+			break;
+
+		if (abort) {
+			node->error = AFC_E_OP_INTERRUPTED;
+		} else if (node->type == AFC_TREE_ENTRY_DIRECTORY) {
+			afc_tree_copy_directory(worker, node);
+		} else if (!chunk) {
+			node->error = AFC_E_NO_MEM;
+		} else {
+			afc_tree_copy_file(worker, node, chunk);
+		}
+		afc_tree_node_release(copy, node);
+	}
+
+	free(chunk);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_tree_copy(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path, afc_tree_copy_cb_t entry_cb, void *user_data)
+{
+	struct afc_tree_copy copy;
+	struct afc_tree_worker workers[AFC_TREE_COPY_MAX_CLIENTS];
+	struct afc_tree_node *root = NULL;
+	char **info = NULL;
+	uint32_t num_threads = 0;
+	uint32_t i;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!clients || num_clients == 0 || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+
+	if (num_clients > AFC_TREE_COPY_MAX_CLIENTS)
+		num_clients = AFC_TREE_COPY_MAX_CLIENTS;
+	for (i = 0; i < num_clients; i++) {
+		if (!clients[i] || !clients[i]->afc_packet || !clients[i]->parent)
+			return AFC_E_INVALID_ARG;
+	}
+
+	root = afc_tree_node_new(NULL, strdup(device_path), strdup(local_path));
+	if (!root)
+		return AFC_E_NO_MEM;
+
+	ret = afc_get_file_info(clients[0], device_path, &info);
+	if (ret != AFC_E_SUCCESS) {
+		if (info)
+			afc_dictionary_free(info);
+		afc_tree_node_free(root);
+		return ret;
+	}
+	afc_tree_node_set_info(root, info);
+	afc_dictionary_free(info);
+
+	if (root->type != AFC_TREE_ENTRY_DIRECTORY && root->type != AFC_TREE_ENTRY_FILE) {
+		afc_tree_node_free(root);
+		return AFC_E_OP_NOT_SUPPORTED;
+	}
+
+	memset(&copy, '\0', sizeof(copy));
+	mutex_init(&copy.mutex);
+	cond_init(&copy.cond);
+	mutex_init(&copy.cb_mutex);
+	copy.entry_cb = entry_cb;
+	copy.user_data = user_data;
+
+	mutex_lock(&copy.mutex);
+	afc_tree_copy_push(&copy, root);
+	mutex_unlock(&copy.mutex);
+
+	/* every further connection gets its own thread, the first one is
+	 * served by the calling thread */
+	for (i = 0; i < num_clients; i++) {
+		workers[i].copy = &copy;
+		workers[i].client = clients[i];
+	}
+	for (i = 1; i < num_clients; i++) {
+		if (thread_new(&workers[i].thread, afc_tree_copy_worker, &workers[i]) != 0) {
+			debug_info("could not start worker thread, continuing with %d connections", num_threads+1);
+			break;
+		}
+		num_threads++;
+	}
+	afc_tree_copy_worker(&workers[0]);
+	for (i = 1; i <= num_threads; i++) {
+		thread_join(workers[i].thread);
+		thread_free(workers[i].thread);
+	}
+
+	ret = (copy.abort) ? AFC_E_OP_INTERRUPTED : copy.error;
+
+	mutex_destroy(&copy.cb_mutex);
+	cond_destroy(&copy.cond);
+	mutex_destroy(&copy.mutex);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_start_service_multiple(idevice_t device, afc_client_t *clients, uint32_t *num_clients, const char* label)
+{
+	afc_error_t err = AFC_E_SUCCESS;
+	uint32_t i;
+
+	if (!device || !clients || !num_clients || *num_clients == 0)
+		return AFC_E_INVALID_ARG;
+
+	for (i = 0; i < *num_clients; i++) {
+		clients[i] = NULL;
+		err = afc_client_start_service(device, &clients[i], label);
+		if (err != AFC_E_SUCCESS) {
+			debug_info("could only start %d of %d connections (%d)", i, *num_clients, err);
+			break;
+		}
+	}
+	if (i == 0)
+		return err;
+
+	*num_clients = i;
+
+	return AFC_E_SUCCESS;
+}
+
+/** The state shared by the workers of a striped file transfer. */
+struct afc_stripe_transfer {
+	mutex_t mutex;
+	const char *device_path;
+	const char *local_path;
+	uint64_t size;
+	uint64_t next_offset;
+	int upload;
+	int use_offset_ops;
+	afc_error_t error;
+};
+
+/** A worker of a striped file transfer with its own AFC connection. */
+struct afc_stripe_worker {
+	struct afc_stripe_transfer *xfer;
+	afc_client_t client;
+	thread_t thread;
+};
+
+static int afc_stripe_unsupported(afc_error_t error)
+{
+	return (error == AFC_E_OP_NOT_SUPPORTED || error == AFC_E_UNKNOWN_PACKET_TYPE);
+}
+
+static void afc_stripe_set_error(struct afc_stripe_transfer *xfer, afc_error_t error)
+{
+	mutex_lock(&xfer->mutex);
+	if (xfer->error == AFC_E_SUCCESS)
+		xfer->error = error;
+	mutex_unlock(&xfer->mutex);
+}
+
+/**
+ * Reads a range of a device file into the local file, keeping up to
+ * AFC_STRIPE_DEPTH read requests outstanding. Uses FileRefReadWithOffset if
+ * use_offset_op is set, or a seek followed by sequential reads otherwise.
+ *
+ * The device may answer a request with less data than asked for. The data
+ * up to there is kept and the replies to the requests still in flight are
+ * discarded, so the caller has to continue at the returned offset.
+ *
+ * @param done Set to the number of bytes from the start of the range that
+ *        have been written to the local file.
+ */
+static afc_error_t afc_stripe_read_part(afc_client_t client, uint64_t handle, int fd, char *chunk, uint64_t offset, uint64_t length, int use_offset_op, uint64_t *done)
+{
+	char *input = NULL;
+	uint32_t bytes_loc = 0;
+	uint32_t in_flight = 0;
+	uint64_t requested = 0;
+	uint64_t received = 0;
+	uint64_t expected = 0;
+	uint64_t next_packet_num = 0;
+	int stop = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t rret = AFC_E_SUCCESS;
+
+	*done = 0;
+
+	if (afc_lseek(fd, offset, SEEK_SET) < 0)
+		return AFC_E_WRITE_ERROR;
+
+	if (!use_offset_op) {
+		ret = afc_file_seek(client, handle, (int64_t)offset, SEEK_SET);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+	}
+
+	afc_lock(client);
+
+	next_packet_num = client->afc_packet->packet_num + 1;
+
+	while (1) {
+		while (!stop && in_flight < AFC_STRIPE_DEPTH && requested < length) {
+			uint64_t size = length - requested;
+			if (size > AFC_STRIPE_CHUNK_SIZE)
+				size = AFC_STRIPE_CHUNK_SIZE;
+			if (use_offset_op) {
+				struct {
+					uint64_t handle;
+					uint64_t offset;
+					uint64_t size;
+				} readinfo;
+				readinfo.handle = handle;
+				readinfo.offset = htole64(offset + requested);
+				readinfo.size = htole64(size);
+				afc_dispatch_packet(client, AFC_OP_FILE_READ_OFFSET, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes_loc);
+				if (bytes_loc < sizeof(AFCPacket) + sizeof(readinfo)) {
+					ret = AFC_E_NOT_ENOUGH_DATA;
+				}
+			} else {
+				struct {
+					uint64_t handle;
+					uint64_t size;
+				} readinfo;
+				readinfo.handle = handle;
+				readinfo.size = htole64(size);
+				afc_dispatch_packet(client, AFC_OP_FILE_READ, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes_loc);
+				if (bytes_loc < sizeof(AFCPacket) + sizeof(readinfo)) {
+					ret = AFC_E_NOT_ENOUGH_DATA;
+				}
+			}
+			if (ret != AFC_E_SUCCESS) {
+				debug_info("could not send read request");
+				stop = 1;
+				break;
+			}
+			requested += size;
+			in_flight++;
+		}
+
+		if (in_flight == 0) {
+			break;
+		}
+
+		/* all requests but the last one are for a full chunk */
+		expected = length - received;
+		if (expected > AFC_STRIPE_CHUNK_SIZE)
+			expected = AFC_STRIPE_CHUNK_SIZE;
+
+		rret = afc_receive_data_for_packet(client, next_packet_num, chunk, AFC_STRIPE_CHUNK_SIZE, &input, &bytes_loc);
+		next_packet_num++;
+		in_flight--;
+
+		if (rret != AFC_E_SUCCESS) {
+			free(input);
+			input = NULL;
+			if (!stop || (afc_error_breaks_stream(rret) && ret == AFC_E_SUCCESS)) {
+				ret = rret;
+				stop = 1;
+			}
+			if (afc_error_breaks_stream(rret)) {
+				break;
+			}
+			continue;
+		}
+
+		if (!stop) {
+			const char *data = (input) ? input : chunk;
+			uint32_t written = 0;
+			while (written < bytes_loc) {
+				int res = write(fd, data + written, bytes_loc - written);
+				if (res <= 0) {
+					debug_info("could not write to local file: %s", strerror(errno));
+					ret = AFC_E_WRITE_ERROR;
+					stop = 1;
+					break;
+				}
+				written += res;
+			}
+			received += written;
+			if (!stop && bytes_loc < expected) {
+				/* the replies still in flight don't follow this data */
+				debug_info("short read at offset %llu (%d != %llu)", (unsigned long long)(offset + received - bytes_loc), bytes_loc, (unsigned long long)expected);
+				stop = 1;
+			}
+		}
+		free(input);
+		input = NULL;
+	}
+
+	afc_unlock(client);
+
+	*done = received;
+
+	return ret;
+}
+
+/**
+ * Reads a range of a device file into the local file, continuing after
+ * short replies until the whole range has been read.
+ */
+static afc_error_t afc_stripe_read_range(afc_client_t client, uint64_t handle, int fd, char *chunk, uint64_t offset, uint64_t length, int use_offset_op)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	while (length > 0) {
+		uint64_t done = 0;
+		ret = afc_stripe_read_part(client, handle, fd, chunk, offset, length, use_offset_op, &done);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+		if (done == 0) {
+			/* the file ended early, it was truncated during the transfer */
+			debug_info("no data at offset %llu", (unsigned long long)offset);
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+		offset += done;
+		length -= done;
+	}
+
+	return ret;
+}
+
+/**
+ * Writes a range of the local file to a device file, keeping up to
+ * AFC_STRIPE_DEPTH write requests outstanding. Uses FileRefWriteWithOffset if
+ * use_offset_op is set, or a seek followed by sequential writes otherwise.
+ */
+static afc_error_t afc_stripe_write_range(afc_client_t client, uint64_t handle, int fd, char *chunk, uint64_t offset, uint64_t length, int use_offset_op)
+{
+	uint32_t bytes_loc = 0;
+	uint32_t in_flight = 0;
+	uint64_t sent = 0;
+	uint64_t next_packet_num = 0;
+	int stop = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t rret = AFC_E_SUCCESS;
+
+	if (afc_lseek(fd, offset, SEEK_SET) < 0)
+		return AFC_E_READ_ERROR;
+
+	if (!use_offset_op) {
+		ret = afc_file_seek(client, handle, (int64_t)offset, SEEK_SET);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+	}
+
+	afc_lock(client);
+
+	next_packet_num = client->afc_packet->packet_num + 1;
+
+	while (1) {
+		/* the chunk is sent before it is refilled, so one buffer suffices */
+		while (!stop && in_flight < AFC_STRIPE_DEPTH && sent < length) {
+			uint32_t size = (length - sent > AFC_STRIPE_CHUNK_SIZE) ? AFC_STRIPE_CHUNK_SIZE : (uint32_t)(length - sent);
+			uint32_t done = 0;
+			while (done < size) {
+				int res = read(fd, chunk + done, size - done);
+				if (res <= 0) {
+					debug_info("could not read from local file: %s", (res < 0) ? strerror(errno) : "end of file");
+					ret = AFC_E_READ_ERROR;
+					stop = 1;
+					break;
+				}
+				done += res;
+			}
+			if (stop)
+				break;
+
+			if (use_offset_op) {
+				struct {
+					uint64_t handle;
+					uint64_t offset;
+				} writeinfo;
+				writeinfo.handle = handle;
+				writeinfo.offset = htole64(offset + sent);
+				afc_dispatch_packet(client, AFC_OP_FILE_WRITE_OFFSET, (const char*)&writeinfo, sizeof(writeinfo), chunk, size, &bytes_loc);
+				if (bytes_loc < sizeof(AFCPacket) + sizeof(writeinfo) + size) {
+					ret = AFC_E_NOT_ENOUGH_DATA;
+				}
+			} else {
+				afc_dispatch_packet(client, AFC_OP_FILE_WRITE, (const char*)&handle, 8, chunk, size, &bytes_loc);
+				if (bytes_loc < sizeof(AFCPacket) + 8 + size) {
+					ret = AFC_E_NOT_ENOUGH_DATA;
+				}
+			}
+			if (ret != AFC_E_SUCCESS) {
+				debug_info("could not send write request");
+				stop = 1;
+				break;
+			}
+			sent += size;
+			in_flight++;
+		}
+
+		if (in_flight == 0) {
+			break;
+		}
+
+		rret = afc_receive_data_for_packet(client, next_packet_num, NULL, 0, NULL, &bytes_loc);
+		next_packet_num++;
+		in_flight--;
+
+		if (rret != AFC_E_SUCCESS) {
+			if (!stop) {
+				ret = rret;
+				stop = 1;
+			}
+			if (afc_error_breaks_stream(rret)) {
+				break;
+			}
+		}
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+static void *afc_stripe_worker_run(void *arg)
+{
+	struct afc_stripe_worker *worker = (struct afc_stripe_worker*)arg;
+	struct afc_stripe_transfer *xfer = worker->xfer;
+	char *chunk = NULL;
+	uint64_t handle = 0;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	int use_offset_op = 0;
+	int fd = -1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	chunk = (char*)malloc(AFC_STRIPE_CHUNK_SIZE);
+	if (!chunk) {
+		afc_stripe_set_error(xfer, AFC_E_NO_MEM);
+		return NULL;
+	}
+
+	/* file handles are bound to a connection, so every worker opens its own */
+	ret = afc_file_open(worker->client, xfer->device_path, (xfer->upload) ? AFC_FOPEN_RW : AFC_FOPEN_RDONLY, &handle);
+	if (ret != AFC_E_SUCCESS) {
+		afc_stripe_set_error(xfer, ret);
+		free(chunk);
+		return NULL;
+	}
+	fd = open(xfer->local_path, ((xfer->upload) ? O_RDONLY : O_WRONLY) | O_BINARY);
+	if (fd < 0) {
+		debug_info("could not open local file %s: %s", xfer->local_path, strerror(errno));
+		afc_stripe_set_error(xfer, (xfer->upload) ? AFC_E_READ_ERROR : AFC_E_WRITE_ERROR);
+		afc_file_close(worker->client, handle);
+		free(chunk);
+		return NULL;
+	}
+
+	while (1) {
+		mutex_lock(&xfer->mutex);
+		if (xfer->error != AFC_E_SUCCESS || xfer->next_offset >= xfer->size) {
+			mutex_unlock(&xfer->mutex);
+			break;
+		}
+		offset = xfer->next_offset;
+		length = xfer->size - offset;
+		if (length > AFC_STRIPE_SIZE)
+			length = AFC_STRIPE_SIZE;
+		xfer->next_offset += length;
+		use_offset_op = xfer->use_offset_ops;
+		mutex_unlock(&xfer->mutex);
+
+		if (xfer->upload) {
+			ret = afc_stripe_write_range(worker->client, handle, fd, chunk, offset, length, use_offset_op);
+		} else {
+			ret = afc_stripe_read_range(worker->client, handle, fd, chunk, offset, length, use_offset_op);
+		}
+		if (use_offset_op && afc_stripe_unsupported(ret)) {
+			/* devices before iOS 7 only know seek and sequential I/O */
+			debug_info("offset operations not supported, falling back to seek");
+			mutex_lock(&xfer->mutex);
+			xfer->use_offset_ops = 0;
+			mutex_unlock(&xfer->mutex);
+			if (xfer->upload) {
+				ret = afc_stripe_write_range(worker->client, handle, fd, chunk, offset, length, 0);
+			} else {
+				ret = afc_stripe_read_range(worker->client, handle, fd, chunk, offset, length, 0);
+			}
+		}
+		if (ret != AFC_E_SUCCESS) {
+			afc_stripe_set_error(xfer, ret);
+			break;
+		}
+	}
+
+	close(fd);
+	afc_file_close(worker->client, handle);
+	free(chunk);
+
+	return NULL;
+}
+
+/**
+ * Runs a striped transfer with one worker per client, the first one being
+ * served by the calling thread.
+ */
+static afc_error_t afc_stripe_transfer_run(struct afc_stripe_transfer *xfer, afc_client_t *clients, uint32_t num_clients)
+{
+	struct afc_stripe_worker workers[AFC_STRIPE_MAX_CLIENTS];
+	uint64_t stripes = (xfer->size + AFC_STRIPE_SIZE - 1) / AFC_STRIPE_SIZE;
+	uint32_t num_threads = 0;
+	uint32_t i;
+
+	if (num_clients > AFC_STRIPE_MAX_CLIENTS)
+		num_clients = AFC_STRIPE_MAX_CLIENTS;
+	if (num_clients > stripes)
+		num_clients = (stripes > 0) ? (uint32_t)stripes : 1;
+
+	mutex_init(&xfer->mutex);
+	xfer->next_offset = 0;
+	xfer->use_offset_ops = 1;
+	xfer->error = AFC_E_SUCCESS;
+
+	for (i = 0; i < num_clients; i++) {
+		workers[i].xfer = xfer;
+		workers[i].client = clients[i];
+	}
+	for (i = 1; i < num_clients; i++) {
+		if (thread_new(&workers[i].thread, afc_stripe_worker_run, &workers[i]) != 0) {
+			debug_info("could not start worker thread, continuing with %d connections", num_threads+1);
+			break;
+		}
+		num_threads++;
+	}
+	afc_stripe_worker_run(&workers[0]);
+	for (i = 1; i <= num_threads; i++) {
+		thread_join(workers[i].thread);
+		thread_free(workers[i].thread);
+	}
+
+	mutex_destroy(&xfer->mutex);
+
+	return xfer->error;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_download_file(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path)
+{
+	struct afc_stripe_transfer xfer;
+	struct afc_tree_node node;
+	char **info = NULL;
+	uint32_t i;
+	int fd = -1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!clients || num_clients == 0 || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < num_clients; i++) {
+		if (!clients[i] || !clients[i]->afc_packet || !clients[i]->parent)
+			return AFC_E_INVALID_ARG;
+	}
+
+	ret = afc_get_file_info(clients[0], device_path, &info);
+	if (ret != AFC_E_SUCCESS) {
+		if (info)
+			afc_dictionary_free(info);
+		return ret;
+	}
+	memset(&node, '\0', sizeof(node));
+	afc_tree_node_set_info(&node, info);
+	afc_dictionary_free(info);
+	free(node.link_target);
+	if (node.type == AFC_TREE_ENTRY_DIRECTORY)
+		return AFC_E_OBJECT_IS_DIR;
+	if (node.type != AFC_TREE_ENTRY_FILE)
+		return AFC_E_OP_NOT_SUPPORTED;
+
+	fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0) {
+		debug_info("could not create local file %s: %s", local_path, strerror(errno));
+		return AFC_E_WRITE_ERROR;
+	}
+	close(fd);
+
+	memset(&xfer, '\0', sizeof(xfer));
+	xfer.device_path = device_path;
+	xfer.local_path = local_path;
+	xfer.size = node.size;
+	xfer.upload = 0;
+
+	ret = afc_stripe_transfer_run(&xfer, clients, num_clients);
+	if (ret == AFC_E_SUCCESS) {
+		afc_tree_set_local_mtime(local_path, node.mtime);
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_file(afc_client_t *clients, uint32_t num_clients, const char *local_path, const char *device_path)
+{
+	struct afc_stripe_transfer xfer;
+	struct stat st;
+	uint64_t handle = 0;
+	uint32_t i;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!clients || num_clients == 0 || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < num_clients; i++) {
+		if (!clients[i] || !clients[i]->afc_packet || !clients[i]->parent)
+			return AFC_E_INVALID_ARG;
+	}
+
+	if (stat(local_path, &st) != 0) {
+		debug_info("could not stat local file %s: %s", local_path, strerror(errno));
+		return AFC_E_OBJECT_NOT_FOUND;
+	}
+	if (!S_ISREG(st.st_mode))
+		return AFC_E_INVALID_ARG;
+
+	/* create the device file with its final size so the workers can write
+	 * their ranges in any order */
+	ret = afc_file_open(clients[0], device_path, AFC_FOPEN_WRONLY, &handle);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+	ret = afc_file_truncate(clients[0], handle, (uint64_t)st.st_size);
+	afc_file_close(clients[0], handle);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	memset(&xfer, '\0', sizeof(xfer));
+	xfer.device_path = device_path;
+	xfer.local_path = local_path;
+	xfer.size = (uint64_t)st.st_size;
+	xfer.upload = 1;
+
+	return afc_stripe_transfer_run(&xfer, clients, num_clients);
+}
+
+/** A block of memory entries and replies are allocated from. */
+struct afc_arena_block {
+	struct afc_arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+/** Allocates memory from large blocks that are all released at once. */
+struct afc_arena {
+	struct afc_arena_block *head;
+};
+
+/**
+ * Makes sure at least size bytes are available in the current block of an
+ * arena without allocating them.
+ *
+ * @return A pointer to the available memory, or NULL if out of memory.
+ */
+static char *afc_arena_reserve(struct afc_arena *arena, size_t size, size_t *available)
+{
+	struct afc_arena_block *block = arena->head;
+
+	if (!block || block->size - block->used < size) {
+		size_t block_size = (size > AFC_ARENA_BLOCK_SIZE) ? size : AFC_ARENA_BLOCK_SIZE;
+		block = (struct afc_arena_block*)malloc(sizeof(struct afc_arena_block) + block_size);
+		if (!block)
+			return NULL;
+		block->next = arena->head;
+		block->size = block_size;
+		block->used = 0;
+		arena->head = block;
+	}
+	if (available)
+		*available = block->size - block->used;
+
+	return (char*)(block + 1) + block->used;
+}
+
+/**
+ * Marks size bytes of the memory returned by afc_arena_reserve() as used.
+ */
+static void afc_arena_commit(struct afc_arena *arena, size_t size)
+{
+	struct afc_arena_block *block = arena->head;
+
+	/* keep the next allocation aligned */
+	size = (size + 7) & ~(size_t)7;
+	if (size > block->size - block->used)
+		size = block->size - block->used;
+	block->used += size;
+}
+
+static void *afc_arena_alloc(struct afc_arena *arena, size_t size)
+{
+	char *p = afc_arena_reserve(arena, size, NULL);
+
+	if (p)
+		afc_arena_commit(arena, size);
+
+	return p;
+}
+
+/**
+ * Releases all allocations of an arena, keeping its oldest block for reuse.
+ */
+static void afc_arena_reset(struct afc_arena *arena)
+{
+	while (arena->head && arena->head->next) {
+		struct afc_arena_block *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
+	}
+	if (arena->head)
+		arena->head->used = 0;
+}
+
+static void afc_arena_free(struct afc_arena *arena)
+{
+	afc_arena_reset(arena);
+	free(arena->head);
+	arena->head = NULL;
+}
+
+/**
+ * Receives the reply to a packet into memory allocated from an arena.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_arena_receive(afc_client_t client, uint64_t packet_num, struct afc_arena *arena, char **data, uint32_t *length)
+{
+	char *dest = NULL;
+	char *input = NULL;
+	size_t available = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	*data = NULL;
+	*length = 0;
+
+	dest = afc_arena_reserve(arena, AFC_ARENA_MIN_RECEIVE, &available);
+	if (!dest)
+		return AFC_E_NO_MEM;
+	if (available > UINT32_MAX)
+		available = UINT32_MAX;
+
+	ret = afc_receive_data_for_packet(client, packet_num, dest, (uint32_t)available, &input, length);
+	if (ret != AFC_E_SUCCESS) {
+		free(input);
+		*length = 0;
+		return ret;
+	}
+
+	if (!input) {
+		afc_arena_commit(arena, *length);
+		*data = dest;
+	} else {
+		/* the reply did not fit, move it into a block of its own */
+		*data = (char*)afc_arena_alloc(arena, *length);
+		if (*data) {
+			memcpy(*data, input, *length);
+		} else {
+			ret = AFC_E_NO_MEM;
+		}
+		free(input);
+	}
+
+	return ret;
+}
+
+/**
+ * Sends a request and receives its reply into memory allocated from an
+ * arena, holding the client lock for the round trip only.
+ */
+static afc_error_t afc_arena_request(afc_client_t client, uint64_t operation, const char *request, uint32_t request_length, struct afc_arena *arena, char **data, uint32_t *length)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	afc_lock(client);
+	afc_dispatch_packet(client, operation, request, request_length, NULL, 0, &bytes);
+	if (bytes < sizeof(AFCPacket) + request_length) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	ret = afc_arena_receive(client, client->afc_packet->packet_num, arena, data, length);
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Fills in the file information of a directory entry from the key/value
+ * pairs of a GetFileInfo reply. Strings point into the reply buffer.
+ */
+static void afc_dir_entry_set_info(afc_dir_entry_t *entry, char *info, uint32_t length)
+{
+	char *p = info;
+	char *end = info + length;
+
+	entry->type = AFC_TREE_ENTRY_OTHER;
+	while (p < end) {
+		char *key = p;
+		char *key_end = (char*)memchr(key, '\0', end - key);
+		char *value = NULL;
+		if (!key_end)
+			break;
+		value = key_end + 1;
+		p = (value < end) ? (char*)memchr(value, '\0', end - value) : NULL;
+		if (!p)
+			break;
+		p++;
+
+		if (!strcmp(key, "st_size")) {
+			entry->size = strtoull(value, NULL, 10);
+		} else if (!strcmp(key, "st_mtime")) {
+			entry->mtime = strtoull(value, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			if (!strcmp(value, "S_IFREG")) {
+				entry->type = AFC_TREE_ENTRY_FILE;
+			} else if (!strcmp(value, "S_IFDIR")) {
+				entry->type = AFC_TREE_ENTRY_DIRECTORY;
+			} else if (!strcmp(value, "S_IFLNK")) {
+				entry->type = AFC_TREE_ENTRY_LINK;
+			}
+		} else if (!strcmp(key, "LinkTarget")) {
+			entry->link_target = value;
+		}
+	}
+}
+
+/**
+ * Queries the file information of a batch of directory entries, keeping up
+ * to AFC_TREE_COPY_STAT_DEPTH requests outstanding. Paths and replies are
+ * allocated from the arena.
+ */
+static afc_error_t afc_dir_entries_get_info(afc_client_t client, const char *path, afc_dir_entry_t *entries, uint32_t count, struct afc_arena *arena)
+{
+	size_t path_len = strlen(path);
+	int need_slash = (path_len > 0 && path[path_len-1] != '/');
+	char *data = NULL;
+	uint32_t bytes = 0;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint64_t next_packet_num = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	afc_lock(client);
+
+	next_packet_num = client->afc_packet->packet_num + 1;
+
+	while (received < count) {
+		/* after an error only the replies still outstanding are collected */
+		while (ret == AFC_E_SUCCESS && sent < count && sent - received < AFC_TREE_COPY_STAT_DEPTH) {
+			size_t name_len = strlen(entries[sent].name);
+			char *entry_path = (char*)afc_arena_alloc(arena, path_len + need_slash + name_len + 1);
+			if (!entry_path) {
+				ret = AFC_E_NO_MEM;
+				break;
+			}
+			memcpy(entry_path, path, path_len);
+			if (need_slash)
+				entry_path[path_len] = '/';
+			memcpy(entry_path + path_len + need_slash, entries[sent].name, name_len + 1);
+
+			afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, entry_path, path_len + need_slash + name_len + 1, NULL, 0, &bytes);
+			if (bytes < sizeof(AFCPacket)) {
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			sent++;
+		}
+		if (received == sent) {
+			break;
+		}
+
+		entries[received].error = afc_arena_receive(client, next_packet_num, arena, &data, &bytes);
+		next_packet_num++;
+		if (entries[received].error == AFC_E_SUCCESS) {
+			afc_dir_entry_set_info(&entries[received], data, bytes);
+		} else if (afc_error_breaks_stream(entries[received].error)) {
+			/* the stream is out of sync, remaining replies are lost */
+			ret = entries[received].error;
+			received++;
+			break;
+		}
+		received++;
+	}
+	for (; received < count; received++) {
+		entries[received].error = (ret != AFC_E_SUCCESS) ? ret : AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Hands the names of a listing reply to the callback in batches of up to
+ * AFC_DIR_BATCH_SIZE entries.
+ */
+static afc_error_t afc_dir_deliver_names(afc_client_t client, const char *path, char *names, uint32_t length, int with_info, afc_dir_read_cb_t batch_cb, void *user_data, struct afc_arena *arena)
+{
+	char *p = names;
+	char *end = names + length;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	while (p < end) {
+		afc_dir_entry_t *entries = (afc_dir_entry_t*)afc_arena_alloc(arena, AFC_DIR_BATCH_SIZE * sizeof(afc_dir_entry_t));
+		uint32_t count = 0;
+
+		if (!entries)
+			return AFC_E_NO_MEM;
+
+		while (p < end && count < AFC_DIR_BATCH_SIZE) {
+			char *name = p;
+			char *name_end = (char*)memchr(name, '\0', end - name);
+			if (!name_end) {
+				/* ignore an unterminated trailing name */
+				p = end;
+				break;
+			}
+			p = name_end + 1;
+			if (name == name_end || !strcmp(name, ".") || !strcmp(name, "..")) {
+				continue;
+			}
+			memset(&entries[count], '\0', sizeof(afc_dir_entry_t));
+			entries[count].name = name;
+			entries[count].type = AFC_TREE_ENTRY_UNKNOWN;
+			entries[count].error = AFC_E_SUCCESS;
+			count++;
+		}
+		if (count == 0)
+			continue;
+
+		if (with_info) {
+			ret = afc_dir_entries_get_info(client, path, entries, count, arena);
+			if (ret == AFC_E_NO_MEM)
+				return ret;
+		}
+
+		if (batch_cb(entries, count, user_data) != 0) {
+			debug_info("directory listing interrupted by callback");
+			return AFC_E_OP_INTERRUPTED;
+		}
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory_batched(afc_client_t client, const char *path, int with_info, afc_dir_read_cb_t batch_cb, void *user_data)
+{
+	struct afc_arena arena;
+	char *data = NULL;
+	uint32_t bytes = 0;
+	uint64_t handle = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !path || !batch_cb)
+		return AFC_E_INVALID_ARG;
+
+	arena.head = NULL;
+
+	/* open a directory enumerator (iOS 6+) */
+	ret = afc_arena_request(client, AFC_OP_DIR_OPEN, path, strlen(path)+1, &arena, &data, &bytes);
+	if (ret == AFC_E_SUCCESS && bytes >= sizeof(uint64_t)) {
+		memcpy(&handle, data, sizeof(uint64_t));
+	} else if (ret == AFC_E_SUCCESS || ret == AFC_E_OP_NOT_SUPPORTED || ret == AFC_E_UNKNOWN_PACKET_TYPE) {
+		debug_info("directory enumerators not supported, reading the whole directory");
+		handle = 0;
+	} else {
+		afc_arena_free(&arena);
+		return ret;
+	}
+
+	if (handle) {
+		while (ret == AFC_E_SUCCESS) {
+			afc_arena_reset(&arena);
+			ret = afc_arena_request(client, AFC_OP_DIR_READ, (const char*)&handle, sizeof(handle), &arena, &data, &bytes);
+			if (ret == AFC_E_END_OF_DATA || (ret == AFC_E_SUCCESS && bytes == 0)) {
+				ret = AFC_E_SUCCESS;
+				break;
+			}
+			if (ret == AFC_E_SUCCESS) {
+				ret = afc_dir_deliver_names(client, path, data, bytes, with_info, batch_cb, user_data, &arena);
+			}
+		}
+		afc_arena_reset(&arena);
+		afc_arena_request(client, AFC_OP_DIR_CLOSE, (const char*)&handle, sizeof(handle), &arena, &data, &bytes);
+	} else {
+		afc_arena_reset(&arena);
+		ret = afc_arena_request(client, AFC_OP_READ_DIR, path, strlen(path)+1, &arena, &data, &bytes);
+		if (ret == AFC_E_SUCCESS) {
+			ret = afc_dir_deliver_names(client, path, data, bytes, with_info, batch_cb, user_data, &arena);
+		}
+	}
+
+	afc_arena_free(&arena);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_length)
+{
+	char *data = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !client->afc_packet || !client->parent || !path || !hash || !hash_length)
+		return AFC_E_INVALID_ARG;
+
+	*hash = NULL;
+	*hash_length = 0;
+
+	afc_lock(client);
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_HASH, path, strlen(path)+1, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, &data, &bytes);
+	if (ret == AFC_E_SUCCESS && data && bytes > 0) {
+		*hash = data;
+		*hash_length = bytes;
+	} else {
+		free(data);
+		if (ret == AFC_E_SUCCESS)
+			ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Builds a GetFileHashWithRange request for the given path. The range is
+ * filled in with afc_hash_range_request_set().
+ */
+static char *afc_hash_range_request_new(const char *path, uint32_t *length)
+{
+	size_t path_len = strlen(path);
+	char *request = (char*)malloc(16 + path_len + 1);
+
+	if (!request)
+		return NULL;
+	memset(request, '\0', 16);
+	memcpy(request + 16, path, path_len + 1);
+	*length = 16 + path_len + 1;
+
+	return request;
+}
+
+static void afc_hash_range_request_set(char *request, uint64_t offset, uint64_t length)
+{
+	uint64_t offset_loc = htole64(offset);
+	uint64_t length_loc = htole64(length);
+
+	memcpy(request, &offset_loc, 8);
+	memcpy(request + 8, &length_loc, 8);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash_range(afc_client_t client, const char *path, uint64_t offset, uint64_t length, char **hash, uint32_t *hash_length)
+{
+	char *request = NULL;
+	char *data = NULL;
+	uint32_t request_length = 0;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !client->afc_packet || !client->parent || !path || !hash || !hash_length)
+		return AFC_E_INVALID_ARG;
+
+	*hash = NULL;
+	*hash_length = 0;
+
+	request = afc_hash_range_request_new(path, &request_length);
+	if (!request)
+		return AFC_E_NO_MEM;
+	afc_hash_range_request_set(request, offset, length);
+
+	afc_lock(client);
+
+	/* Send command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_HASH_RANGE, request, request_length, NULL, 0, &bytes);
+	free(request);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, &data, &bytes);
+	if (ret == AFC_E_SUCCESS && data && bytes > 0) {
+		*hash = data;
+		*hash_length = bytes;
+	} else {
+		free(data);
+		if (ret == AFC_E_SUCCESS)
+			ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Hashes local data with the algorithm the device used for a hash of the
+ * given length.
+ *
+ * @return 0 on success, or -1 if the hash length matches no known algorithm.
+ */
+static int afc_hash_local_data(const char *data, size_t length, uint32_t hash_length, unsigned char *hash)
+{
+	if (hash_length == 20) {
+#ifdef HAVE_OPENSSL
+		SHA1((const unsigned char*)data, length, hash);
+#else
+		gcry_md_hash_buffer(GCRY_MD_SHA1, hash, data, length);
+#endif
+	} else if (hash_length == 32) {
+#ifdef HAVE_OPENSSL
+		SHA256((const unsigned char*)data, length, hash);
+#else
+		gcry_md_hash_buffer(GCRY_MD_SHA256, hash, data, length);
+#endif
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/** The device side hashes of the blocks of a file. */
+struct afc_block_hashes {
+	char **hashes;
+	uint32_t *lengths;
+	uint64_t count;
+};
+
+/**
+ * Requests the hashes of all blocks in the first length bytes of a device
+ * file, keeping up to AFC_SYNC_HASH_DEPTH requests outstanding. The hashes
+ * are allocated from the arena.
+ */
+static afc_error_t afc_get_block_hashes(afc_client_t client, const char *path, uint64_t length, uint64_t block_size, struct afc_block_hashes *blocks, struct afc_arena *arena)
+{
+	char *request = NULL;
+	uint32_t request_length = 0;
+	uint32_t bytes = 0;
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t next_packet_num = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t rret = AFC_E_SUCCESS;
+
+	blocks->count = (length + block_size - 1) / block_size;
+	blocks->hashes = (char**)afc_arena_alloc(arena, (blocks->count + 1) * sizeof(char*));
+	blocks->lengths = (uint32_t*)afc_arena_alloc(arena, (blocks->count + 1) * sizeof(uint32_t));
+	request = afc_hash_range_request_new(path, &request_length);
+	if (!blocks->hashes || !blocks->lengths || !request) {
+		free(request);
+		return AFC_E_NO_MEM;
+	}
+
+	afc_lock(client);
+
+	next_packet_num = client->afc_packet->packet_num + 1;
+
+	while (received < blocks->count) {
+		while (ret == AFC_E_SUCCESS && sent < blocks->count && sent - received < AFC_SYNC_HASH_DEPTH) {
+			uint64_t offset = sent * block_size;
+			afc_hash_range_request_set(request, offset, (length - offset > block_size) ? block_size : length - offset);
+			afc_dispatch_packet(client, AFC_OP_GET_FILE_HASH_RANGE, request, request_length, NULL, 0, &bytes);
+			if (bytes < sizeof(AFCPacket) + request_length) {
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			sent++;
+		}
+		if (received == sent) {
+			break;
+		}
+
+		rret = afc_arena_receive(client, next_packet_num, arena, &blocks->hashes[received], &blocks->lengths[received]);
+		next_packet_num++;
+		received++;
+		if (rret != AFC_E_SUCCESS) {
+			if (ret == AFC_E_SUCCESS)
+				ret = rret;
+			if (afc_error_breaks_stream(rret)) {
+				break;
+			}
+		}
+	}
+
+	afc_unlock(client);
+
+	free(request);
+
+	return ret;
+}
+
+/**
+ * Transfers a range between a device file and the local file in the given
+ * direction, using offset requests where the device supports them.
+ */
+static afc_error_t afc_delta_transfer_range(afc_client_t client, uint64_t handle, int fd, char *chunk, uint64_t offset, uint64_t length, int upload, int *use_offset_op)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (upload) {
+		ret = afc_stripe_write_range(client, handle, fd, chunk, offset, length, *use_offset_op);
+	} else {
+		ret = afc_stripe_read_range(client, handle, fd, chunk, offset, length, *use_offset_op);
+	}
+	if (*use_offset_op && afc_stripe_unsupported(ret)) {
+		*use_offset_op = 0;
+		if (upload) {
+			ret = afc_stripe_write_range(client, handle, fd, chunk, offset, length, 0);
+		} else {
+			ret = afc_stripe_read_range(client, handle, fd, chunk, offset, length, 0);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Brings the destination of a transfer up to date with its source, sending
+ * only the blocks whose hashes differ.
+ *
+ * The part both files have in common is compared block by block against
+ * hashes calculated by the device. Runs of changed blocks and everything
+ * beyond the end of the destination are transferred, and the destination is
+ * truncated to the size of the source afterwards.
+ *
+ * @param client The client to use.
+ * @param device_path The file on the device.
+ * @param fd Descriptor of the local file, opened for reading and writing.
+ * @param local_size The size of the local file.
+ * @param device_size The size of the device file.
+ * @param upload 1 to update the device file, 0 to update the local file.
+ * @param transferred Will be set to the number of bytes transferred.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_delta_transfer(afc_client_t client, const char *device_path, int fd, uint64_t local_size, uint64_t device_size, int upload, uint64_t *transferred)
+{
+	struct afc_block_hashes blocks;
+	struct afc_arena arena;
+	unsigned char local_hash[32];
+	char *block = NULL;
+	char *chunk = NULL;
+	uint64_t handle = 0;
+	uint64_t common = (local_size < device_size) ? local_size : device_size;
+	uint64_t source_size = (upload) ? local_size : device_size;
+	uint64_t run_start = 0;
+	uint64_t run_length = 0;
+	uint64_t i;
+	int use_offset_op = 1;
+	int have_hashes = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	*transferred = 0;
+
+	arena.head = NULL;
+	block = (char*)malloc(AFC_SYNC_BLOCK_SIZE);
+	chunk = (char*)malloc(AFC_STRIPE_CHUNK_SIZE);
+	if (!block || !chunk) {
+		ret = AFC_E_NO_MEM;
+		goto leave;
+	}
+
+	/* compare the part both files have in common block by block */
+	if (common > 0) {
+		ret = afc_get_block_hashes(client, device_path, common, AFC_SYNC_BLOCK_SIZE, &blocks, &arena);
+		if (ret == AFC_E_SUCCESS) {
+			have_hashes = 1;
+		} else if (afc_stripe_unsupported(ret)) {
+			debug_info("range hashes not supported, transferring the whole file");
+			ret = AFC_E_SUCCESS;
+		} else {
+			goto leave;
+		}
+	}
+
+	/* opening for reading and writing keeps the unchanged contents */
+	ret = afc_file_open(client, device_path, (upload) ? AFC_FOPEN_RW : AFC_FOPEN_RDONLY, &handle);
+	if (ret != AFC_E_SUCCESS)
+		goto leave;
+
+	if (afc_lseek(fd, 0, SEEK_SET) < 0) {
+		ret = AFC_E_READ_ERROR;
+		goto leave;
+	}
+	for (i = 0; have_hashes && i < blocks.count; i++) {
+		uint64_t offset = i * AFC_SYNC_BLOCK_SIZE;
+		uint32_t length = (common - offset > AFC_SYNC_BLOCK_SIZE) ? AFC_SYNC_BLOCK_SIZE : (uint32_t)(common - offset);
+		uint32_t done = 0;
+		int differs = 1;
+
+		while (done < length) {
+			int res = read(fd, block + done, length - done);
+			if (res <= 0) {
+				ret = AFC_E_READ_ERROR;
+				goto leave;
+			}
+			done += res;
+		}
+		if (afc_hash_local_data(block, length, blocks.lengths[i], local_hash) == 0) {
+			differs = (memcmp(local_hash, blocks.hashes[i], blocks.lengths[i]) != 0);
+		}
+
+		/* transfer runs of changed blocks with one request stream */
+		if (differs) {
+			if (run_length == 0)
+				run_start = offset;
+			run_length += length;
+		}
+		if ((!differs || i == blocks.count - 1) && run_length > 0) {
+			ret = afc_delta_transfer_range(client, handle, fd, chunk, run_start, run_length, upload, &use_offset_op);
+			if (ret != AFC_E_SUCCESS)
+				goto leave;
+			*transferred += run_length;
+			run_length = 0;
+			/* continue reading after the current block */
+			if (afc_lseek(fd, offset + length, SEEK_SET) < 0) {
+				ret = AFC_E_READ_ERROR;
+				goto leave;
+			}
+		}
+	}
+
+	/* transfer everything that could not be compared */
+	if (!have_hashes)
+		common = 0;
+	if (source_size > common) {
+		ret = afc_delta_transfer_range(client, handle, fd, chunk, common, source_size - common, upload, &use_offset_op);
+		if (ret != AFC_E_SUCCESS)
+			goto leave;
+		*transferred += source_size - common;
+	}
+
+	/* drop whatever the destination has beyond the end of the source */
+	if (upload && device_size > source_size) {
+		ret = afc_file_truncate(client, handle, source_size);
+	} else if (!upload && local_size > source_size) {
+		if (afc_ftruncate(fd, source_size) != 0) {
+			ret = AFC_E_WRITE_ERROR;
+		}
+	}
+
+leave:
+	if (handle)
+		afc_file_close(client, handle);
+	afc_arena_free(&arena);
+	free(block);
+	free(chunk);
+
+	debug_info("transferred %llu of %llu bytes", (unsigned long long)*transferred, (unsigned long long)source_size);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_sync_file(afc_client_t client, const char *device_path, const char *local_path, uint64_t *bytes_transferred)
+{
+	struct afc_tree_node node;
+	struct stat st;
+	char **info = NULL;
+	uint64_t transferred = 0;
+	int fd = -1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+
+	if (bytes_transferred)
+		*bytes_transferred = 0;
+
+	ret = afc_get_file_info(client, device_path, &info);
+	if (ret != AFC_E_SUCCESS) {
+		if (info)
+			afc_dictionary_free(info);
+		return ret;
+	}
+	memset(&node, '\0', sizeof(node));
+	afc_tree_node_set_info(&node, info);
+	afc_dictionary_free(info);
+	free(node.link_target);
+	if (node.type == AFC_TREE_ENTRY_DIRECTORY)
+		return AFC_E_OBJECT_IS_DIR;
+	if (node.type != AFC_TREE_ENTRY_FILE)
+		return AFC_E_OP_NOT_SUPPORTED;
+
+	fd = open(local_path, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		debug_info("could not open local file %s: %s", local_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return AFC_E_WRITE_ERROR;
+	}
+
+	ret = afc_delta_transfer(client, device_path, fd, (uint64_t)st.st_size, node.size, 0, &transferred);
+	close(fd);
+
+	if (ret == AFC_E_SUCCESS) {
+		afc_tree_set_local_mtime(local_path, node.mtime);
+	}
+	if (bytes_transferred)
+		*bytes_transferred = transferred;
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_upload_file_delta(afc_client_t client, const char *local_path, const char *device_path, uint64_t *bytes_transferred)
+{
+	struct afc_tree_node node;
+	struct stat st;
+	char **info = NULL;
+	uint64_t transferred = 0;
+	int fd = -1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+
+	if (bytes_transferred)
+		*bytes_transferred = 0;
+
+	/* a missing device file is simply uploaded as a whole */
+	memset(&node, '\0', sizeof(node));
+	ret = afc_get_file_info(client, device_path, &info);
+	if (ret == AFC_E_SUCCESS) {
+		afc_tree_node_set_info(&node, info);
+		free(node.link_target);
+		if (node.type == AFC_TREE_ENTRY_DIRECTORY) {
+			afc_dictionary_free(info);
+			return AFC_E_OBJECT_IS_DIR;
+		}
+	} else if (ret != AFC_E_OBJECT_NOT_FOUND) {
+		if (info)
+			afc_dictionary_free(info);
+		return ret;
+	}
+	if (info)
+		afc_dictionary_free(info);
+
+	fd = open(local_path, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		debug_info("could not open local file %s: %s", local_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return AFC_E_READ_ERROR;
+	}
+
+	ret = afc_delta_transfer(client, device_path, fd, (uint64_t)st.st_size, node.size, 1, &transferred);
+	close(fd);
+
+	if (bytes_transferred)
+		*bytes_transferred = transferred;
+
+	return ret;
+}
@@ -33,6 +33,27 @@
 #define AFC_MAGIC "CFA6LPAA"
 #define AFC_MAGIC_LEN (8)
 
+#define AFC_READ_PIPELINE_CHUNK_SIZE (65536)
+#define AFC_READ_PIPELINE_DEFAULT_DEPTH (4)
+#define AFC_READ_PIPELINE_MAX_DEPTH (32)
+
+#define AFC_TREE_COPY_CHUNK_SIZE (1024*1024)
+#define AFC_TREE_COPY_READ_DEPTH (4)
+#define AFC_TREE_COPY_STAT_DEPTH (16)
+#define AFC_TREE_COPY_MAX_CLIENTS (16)
+
+#define AFC_STRIPE_SIZE (8*1024*1024)
+#define AFC_STRIPE_CHUNK_SIZE (1024*1024)
+#define AFC_STRIPE_DEPTH (4)
+#define AFC_STRIPE_MAX_CLIENTS (16)
+
+#define AFC_DIR_BATCH_SIZE (256)
+#define AFC_ARENA_BLOCK_SIZE (65536)
+#define AFC_ARENA_MIN_RECEIVE (4096)
+
+#define AFC_SYNC_BLOCK_SIZE (1024*1024)
+#define AFC_SYNC_HASH_DEPTH (16)
+
 typedef struct {
 	char magic[AFC_MAGIC_LEN];
 	uint64_t entire_length, this_length, packet_num, operation;
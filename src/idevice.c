@@ -31,6 +31,19 @@
 
 #ifdef WIN32
 #include <windows.h>
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#include <poll.h>
 #endif
 
 #include <usbmuxd.h>
@@ -46,6 +59,7 @@
 #endif
 
 #include "idevice.h"
+#include "lockdown.h"
 #include "common/userpref.h"
 #include "common/thread.h"
 #include "common/debug.h"
@@ -66,8 +80,24 @@ static unsigned long id_function(void)
 }
 #endif
 
+static mutex_t ssl_cache_mutex;
+static ssl_credentials_t ssl_cache = NULL;
+static int ssl_cache_enabled = 1;
+
+static void internal_ssl_cache_remove(const char *udid);
+
+static mutex_t event_mutex;
+static mutex_t dispatch_mutex;
+static mutex_t subscribe_mutex;
+
+static void internal_device_table_clear(void);
+
 static void internal_idevice_init(void)
 {
+	mutex_init(&ssl_cache_mutex);
+	mutex_init(&event_mutex);
+	mutex_init(&dispatch_mutex);
+	mutex_init(&subscribe_mutex);
 #ifdef HAVE_OPENSSL
 	int i;
 	SSL_library_init();
@@ -87,6 +117,13 @@ static void internal_idevice_init(void)
 
 static void internal_idevice_deinit(void)
 {
+	lockdownd_pool_remove(NULL);
+	internal_ssl_cache_remove(NULL);
+	mutex_destroy(&ssl_cache_mutex);
+	internal_device_table_clear();
+	mutex_destroy(&event_mutex);
+	mutex_destroy(&dispatch_mutex);
+	mutex_destroy(&subscribe_mutex);
 #ifdef HAVE_OPENSSL
 	int i;
 	if (mutex_buf) {
@@ -141,44 +178,522 @@ static void __attribute__((destructor)) libimobiledevice_deinitialize(void)
 }
 #endif
 
-static idevice_event_cb_t event_cb = NULL;
+/* subscribers and device table, protected by event_mutex */
+static idevice_subscription_context_t event_subscribers = NULL;
+static struct idevice_device_entry *device_table = NULL;
+static struct idevice_device_entry *device_index[IDEVICE_DEVICE_TABLE_BUCKETS];
+static int device_table_valid = 0;
+/* set while the usbmuxd event subscription is active, protected by subscribe_mutex */
+static int usbmux_subscribed = 0;
+/* set when the last subscriber is gone but the usbmuxd event subscription
+ * could not be ended yet, protected by event_mutex */
+static int usbmux_unsubscribe_pending = 0;
+/* callbacks are only invoked with dispatch_mutex held */
+static int event_dispatching = 0;
+static thread_id_t event_dispatch_thread;
+/* context used by idevice_event_subscribe() */
+static idevice_subscription_context_t legacy_context = NULL;
+
+static unsigned int internal_device_index_hash(const char *udid)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	while (*udid) {
+		hash ^= (unsigned char)*udid++;
+		hash *= 16777619u;
+	}
+	return hash % IDEVICE_DEVICE_TABLE_BUCKETS;
+}
+
+/**
+ * Looks up a device in the device table. Must be called with event_mutex held.
+ */
+static struct idevice_device_entry *internal_device_table_find(const char *udid)
+{
+	struct idevice_device_entry *entry;
+	for (entry = device_index[internal_device_index_hash(udid)]; entry; entry = entry->hash_next) {
+		if (!strcmp(entry->udid, udid))
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Adds a device to the device table. Must be called with event_mutex held.
+ *
+ * @return 1 if the device was added, 0 if it was known already.
+ */
+static int internal_device_table_add(const char *udid, uint32_t handle)
+{
+	struct idevice_device_entry *entry = internal_device_table_find(udid);
+	unsigned int bucket;
+	if (entry) {
+		entry->handle = handle;
+		return 0;
+	}
+	entry = (struct idevice_device_entry*)malloc(sizeof(struct idevice_device_entry));
+	if (!entry)
+		return 0;
+	entry->udid = strdup(udid);
+	entry->handle = handle;
+	entry->next = device_table;
+	device_table = entry;
+	bucket = internal_device_index_hash(udid);
+	entry->hash_next = device_index[bucket];
+	device_index[bucket] = entry;
+	return 1;
+}
+
+/**
+ * Removes a device from the device table. Must be called with event_mutex held.
+ */
+static void internal_device_table_remove(const char *udid)
+{
+	struct idevice_device_entry **prev = &device_index[internal_device_index_hash(udid)];
+	struct idevice_device_entry *entry = NULL;
+
+	while (*prev) {
+		if (!strcmp((*prev)->udid, udid)) {
+			entry = *prev;
+			*prev = entry->hash_next;
+			break;
+		}
+		prev = &(*prev)->hash_next;
+	}
+	if (!entry)
+		return;
+
+	for (prev = &device_table; *prev; prev = &(*prev)->next) {
+		if (*prev == entry) {
+			*prev = entry->next;
+			break;
+		}
+	}
+	free(entry->udid);
+	free(entry);
+}
+
+static void internal_device_table_clear(void)
+{
+	while (device_table) {
+		struct idevice_device_entry *entry = device_table;
+		device_table = entry->next;
+		free(entry->udid);
+		free(entry);
+	}
+	memset(device_index, '\0', sizeof(device_index));
+	device_table_valid = 0;
+}
+
+/**
+ * Frees subscription contexts that have been removed during a dispatch.
+ * Must be called with event_mutex held.
+ */
+static void internal_subscribers_purge(void)
+{
+	idevice_subscription_context_t *prev = &event_subscribers;
+	while (*prev) {
+		idevice_subscription_context_t context = *prev;
+		if (context->removed) {
+			*prev = context->next;
+			free(context);
+		} else {
+			prev = &context->next;
+		}
+	}
+}
+
+/**
+ * Returns 1 if there is a subscriber that has not been removed. Must be
+ * called with event_mutex held.
+ */
+static int internal_subscribers_active(void)
+{
+	idevice_subscription_context_t context;
+	for (context = event_subscribers; context; context = context->next) {
+		if (!context->removed) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int internal_in_dispatch(void)
+{
+	int res;
+	mutex_lock(&event_mutex);
+	res = (event_dispatching && event_dispatch_thread == THREAD_ID);
+	mutex_unlock(&event_mutex);
+	return res;
+}
+
+/**
+ * Passes an event to all subscribers. Must be called with dispatch_mutex held.
+ */
+static void internal_dispatch_event(const idevice_event_t *ev)
+{
+	idevice_subscription_context_t context = NULL;
+
+	mutex_lock(&event_mutex);
+	event_dispatching = 1;
+	event_dispatch_thread = THREAD_ID;
+	context = event_subscribers;
+	mutex_unlock(&event_mutex);
+
+	/* callbacks might subscribe or unsubscribe, so only walk the list
+	 * with the lock held */
+	while (context) {
+		int removed;
+		mutex_lock(&event_mutex);
+		removed = context->removed;
+		mutex_unlock(&event_mutex);
+		if (!removed) {
+			context->callback(ev, context->user_data);
+		}
+		mutex_lock(&event_mutex);
+		context = context->next;
+		mutex_unlock(&event_mutex);
+	}
+
+	mutex_lock(&event_mutex);
+	event_dispatching = 0;
+	internal_subscribers_purge();
+	mutex_unlock(&event_mutex);
+}
+
+/**
+ * Ends the usbmuxd event subscription if the last subscriber is gone. Must
+ * be called with subscribe_mutex held, and not by the event thread.
+ */
+static void internal_usbmux_unsubscribe_unused(void)
+{
+	int unused;
+
+	mutex_lock(&event_mutex);
+	unused = usbmux_unsubscribe_pending && !internal_subscribers_active();
+	usbmux_unsubscribe_pending = 0;
+	mutex_unlock(&event_mutex);
+
+	if (unused && usbmux_subscribed) {
+		int res = usbmuxd_unsubscribe();
+		if (res != 0) {
+			debug_info("ERROR: usbmuxd_unsubscribe() returned %d!", res);
+		}
+		usbmux_subscribed = 0;
+		mutex_lock(&event_mutex);
+		internal_device_table_clear();
+		mutex_unlock(&event_mutex);
+	}
+}
+
+static void* internal_usbmux_unsubscribe_thread(void *data)
+{
+	mutex_lock(&subscribe_mutex);
+	internal_usbmux_unsubscribe_unused();
+	mutex_unlock(&subscribe_mutex);
+	return NULL;
+}
 
 static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 {
 	idevice_event_t ev;
+	int dispatch = 1;
+	int pending;
 
 	ev.event = event->event;
 	ev.udid = event->device.udid;
 	ev.conn_type = CONNECTION_USBMUXD;
 
-	if (event_cb) {
-		event_cb(&ev, user_data);
+	if (ev.event == IDEVICE_DEVICE_REMOVE) {
+		/* pair records might change until the device shows up again */
+		userpref_pair_record_cache_invalidate(ev.udid);
+		lockdownd_pool_remove(ev.udid);
+	}
+
+	mutex_lock(&dispatch_mutex);
+
+	mutex_lock(&event_mutex);
+	if (ev.event == IDEVICE_DEVICE_ADD) {
+		/* devices reported on subscription are known already */
+		dispatch = internal_device_table_add(ev.udid, event->device.handle);
+	} else if (ev.event == IDEVICE_DEVICE_REMOVE) {
+		internal_device_table_remove(ev.udid);
+	}
+	mutex_unlock(&event_mutex);
+
+	if (dispatch) {
+		internal_dispatch_event(&ev);
+	}
+
+	mutex_unlock(&dispatch_mutex);
+
+	mutex_lock(&event_mutex);
+	pending = usbmux_unsubscribe_pending;
+	mutex_unlock(&event_mutex);
+	if (pending) {
+		/* the last subscriber left from a callback; the event thread can't
+		 * end its own subscription, so leave that to another thread */
+		thread_t thread;
+		if (thread_new(&thread, internal_usbmux_unsubscribe_thread, NULL) == 0) {
+			thread_detach(thread);
+		}
 	}
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+/**
+ * Sends add events for all known devices to a new subscriber. Must be
+ * called with dispatch_mutex held.
+ */
+static void internal_replay_devices(idevice_subscription_context_t context)
+{
+	char **udids = NULL;
+	int count = 0;
+	int i;
+	int was_dispatching;
+	thread_id_t prev_thread;
+	struct idevice_device_entry *entry;
+
+	/* copy the udids as the callback may not be called with the lock held */
+	mutex_lock(&event_mutex);
+	was_dispatching = event_dispatching;
+	prev_thread = event_dispatch_thread;
+	event_dispatching = 1;
+	event_dispatch_thread = THREAD_ID;
+	for (entry = device_table; entry; entry = entry->next) {
+		count++;
+	}
+	if (count > 0) {
+		udids = (char**)malloc(sizeof(char*) * count);
+	}
+	count = 0;
+	if (udids) {
+		for (entry = device_table; entry; entry = entry->next) {
+			udids[count++] = strdup(entry->udid);
+		}
+	}
+	mutex_unlock(&event_mutex);
+
+	for (i = 0; i < count; i++) {
+		idevice_event_t ev;
+		int removed;
+		ev.event = IDEVICE_DEVICE_ADD;
+		ev.udid = udids[i];
+		ev.conn_type = CONNECTION_USBMUXD;
+		mutex_lock(&event_mutex);
+		removed = context->removed;
+		mutex_unlock(&event_mutex);
+		if (!removed) {
+			context->callback(&ev, context->user_data);
+		}
+		free(udids[i]);
+	}
+	free(udids);
+
+	mutex_lock(&event_mutex);
+	event_dispatching = was_dispatching;
+	event_dispatch_thread = prev_thread;
+	if (!event_dispatching) {
+		internal_subscribers_purge();
+	}
+	mutex_unlock(&event_mutex);
+}
+
+/**
+ * Starts the usbmuxd event subscription and fills the device table with
+ * the devices currently attached. Must be called with subscribe_mutex held.
+ */
+static idevice_error_t internal_usbmux_subscribe(void)
 {
-	event_cb = callback;
-	int res = usbmuxd_subscribe(usbmux_event_cb, user_data);
+	usbmuxd_device_info_t *dev_list = NULL;
+	int res;
+	int i;
+
+	res = usbmuxd_subscribe(usbmux_event_cb, NULL);
 	if (res != 0) {
-		event_cb = NULL;
 		debug_info("ERROR: usbmuxd_subscribe() returned %d!", res);
 		return IDEVICE_E_UNKNOWN_ERROR;
 	}
+	usbmux_subscribed = 1;
+
+	/* devices the event thread has not reported yet are announced here,
+	 * their initial add events are dropped as duplicates later */
+	mutex_lock(&dispatch_mutex);
+	if (usbmuxd_get_device_list(&dev_list) >= 0) {
+		for (i = 0; dev_list[i].handle > 0; i++) {
+			int added;
+			mutex_lock(&event_mutex);
+			added = internal_device_table_add(dev_list[i].udid, dev_list[i].handle);
+			mutex_unlock(&event_mutex);
+			if (added) {
+				idevice_event_t ev;
+				ev.event = IDEVICE_DEVICE_ADD;
+				ev.udid = dev_list[i].udid;
+				ev.conn_type = CONNECTION_USBMUXD;
+				internal_dispatch_event(&ev);
+			}
+		}
+		usbmuxd_device_list_free(&dev_list);
+		mutex_lock(&event_mutex);
+		device_table_valid = 1;
+		mutex_unlock(&event_mutex);
+	}
+	mutex_unlock(&dispatch_mutex);
+
 	return IDEVICE_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe()
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_subscribe_ex(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data)
 {
-	event_cb = NULL;
-	int res = usbmuxd_unsubscribe();
-	if (res != 0) {
-		debug_info("ERROR: usbmuxd_unsubscribe() returned %d!", res);
+	idevice_subscription_context_t new_context = NULL;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	int in_dispatch;
+
+	if (!context || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	new_context = (idevice_subscription_context_t)malloc(sizeof(struct idevice_subscription_context_private));
+	if (!new_context)
 		return IDEVICE_E_UNKNOWN_ERROR;
+	new_context->callback = callback;
+	new_context->user_data = user_data;
+	new_context->removed = 0;
+
+	in_dispatch = internal_in_dispatch();
+
+	if (!in_dispatch) {
+		mutex_lock(&subscribe_mutex);
+		mutex_lock(&dispatch_mutex);
+	}
+
+	internal_replay_devices(new_context);
+
+	mutex_lock(&event_mutex);
+	new_context->next = event_subscribers;
+	event_subscribers = new_context;
+	mutex_unlock(&event_mutex);
+
+	if (!in_dispatch) {
+		mutex_unlock(&dispatch_mutex);
+		if (!usbmux_subscribed) {
+			res = internal_usbmux_subscribe();
+			if (res != IDEVICE_E_SUCCESS) {
+				mutex_lock(&event_mutex);
+				new_context->removed = 1;
+				internal_subscribers_purge();
+				mutex_unlock(&event_mutex);
+				new_context = NULL;
+			}
+		}
+		/* callbacks invoked so far might have left */
+		internal_usbmux_unsubscribe_unused();
+		mutex_unlock(&subscribe_mutex);
+	}
+
+	*context = new_context;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_unsubscribe_ex(idevice_subscription_context_t context)
+{
+	int in_dispatch;
+
+	if (!context)
+		return IDEVICE_E_INVALID_ARG;
+
+	in_dispatch = internal_in_dispatch();
+
+	if (!in_dispatch) {
+		/* wait for a running dispatch to finish, no callback is
+		 * invoked for this context after returning */
+		mutex_lock(&subscribe_mutex);
+		mutex_lock(&dispatch_mutex);
+	}
+
+	mutex_lock(&event_mutex);
+	context->removed = 1;
+	if (!event_dispatching) {
+		internal_subscribers_purge();
+	}
+	if (!internal_subscribers_active()) {
+		usbmux_unsubscribe_pending = 1;
 	}
+	mutex_unlock(&event_mutex);
+
+	/* within a callback the subscription is ended once the dispatch is over */
+	if (!in_dispatch) {
+		mutex_unlock(&dispatch_mutex);
+		internal_usbmux_unsubscribe_unused();
+		mutex_unlock(&subscribe_mutex);
+	}
+
 	return IDEVICE_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+{
+	idevice_subscription_context_t context = NULL;
+	idevice_error_t res;
+
+	if (legacy_context) {
+		idevice_events_unsubscribe_ex(legacy_context);
+		legacy_context = NULL;
+	}
+	res = idevice_events_subscribe_ex(&context, callback, user_data);
+	if (res == IDEVICE_E_SUCCESS) {
+		legacy_context = context;
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe()
+{
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+
+	if (legacy_context) {
+		res = idevice_events_unsubscribe_ex(legacy_context);
+		legacy_context = NULL;
+	}
+	return res;
+}
+
+/**
+ * Returns the udids of all devices in the device table if it is being kept
+ * up to date by an active event subscription.
+ *
+ * @return 1 if the list was filled from the device table, 0 otherwise.
+ */
+static int internal_device_table_get_list(char ***devices, int *count)
+{
+	struct idevice_device_entry *entry;
+	char **newlist = NULL;
+	int newcount = 0;
+
+	mutex_lock(&event_mutex);
+	if (!device_table_valid) {
+		mutex_unlock(&event_mutex);
+		return 0;
+	}
+	for (entry = device_table; entry; entry = entry->next) {
+		newcount++;
+	}
+	newlist = (char**)malloc(sizeof(char*) * (newcount+1));
+	if (!newlist) {
+		mutex_unlock(&event_mutex);
+		return 0;
+	}
+	newcount = 0;
+	for (entry = device_table; entry; entry = entry->next) {
+		newlist[newcount++] = strdup(entry->udid);
+	}
+	newlist[newcount] = NULL;
+	mutex_unlock(&event_mutex);
+
+	*devices = newlist;
+	*count = newcount;
+	return 1;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, int *count)
 {
 	usbmuxd_device_info_t *dev_list;
@@ -186,6 +701,11 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, in
 	*devices = NULL;
 	*count = 0;
 
+	/* answer from memory while the device table is kept up to date */
+	if (internal_device_table_get_list(devices, count)) {
+		return IDEVICE_E_SUCCESS;
+	}
+
 	if (usbmuxd_get_device_list(&dev_list) < 0) {
 		debug_info("ERROR: usbmuxd is not running!", __func__);
 		return IDEVICE_E_NO_DEVICE;
@@ -195,16 +715,21 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, in
 	int i, newcount = 0;
 
 	for (i = 0; dev_list[i].handle > 0; i++) {
-		newlist = realloc(*devices, sizeof(char*) * (newcount+1));
-		newlist[newcount++] = strdup(dev_list[i].udid);
-		*devices = newlist;
+		newcount++;
+	}
+	newlist = (char**)malloc(sizeof(char*) * (newcount+1));
+	if (!newlist) {
+		usbmuxd_device_list_free(&dev_list);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < newcount; i++) {
+		newlist[i] = strdup(dev_list[i].udid);
 	}
+	newlist[newcount] = NULL;
 	usbmuxd_device_list_free(&dev_list);
 
-	*count = newcount;
-	newlist = realloc(*devices, sizeof(char*) * (newcount+1));
-	newlist[newcount] = NULL;
 	*devices = newlist;
+	*count = newcount;
 
 	return IDEVICE_E_SUCCESS;
 }
@@ -227,15 +752,63 @@ LIBIMOBILEDEVICE_API void idevice_set_debug_level(int level)
 	internal_set_debug_level(level);
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_pair_record_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	if (!hits && !misses)
+		return IDEVICE_E_INVALID_ARG;
+
+	userpref_pair_record_cache_get_stats(hits, misses);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Looks up the usbmuxd handle of a device in the device table.
+ *
+ * @param udid The udid of the device, or NULL to use any device.
+ * @param udid_out Set to a copy of the udid of the device found.
+ * @param handle Set to the usbmuxd handle of the device found.
+ *
+ * @return 1 if the device was found, 0 otherwise.
+ */
+static int internal_device_table_lookup(const char *udid, char **udid_out, uint32_t *handle)
+{
+	struct idevice_device_entry *entry = NULL;
+
+	mutex_lock(&event_mutex);
+	if (device_table_valid) {
+		entry = (udid) ? internal_device_table_find(udid) : device_table;
+		if (entry) {
+			*udid_out = strdup(entry->udid);
+			*handle = entry->handle;
+		}
+	}
+	mutex_unlock(&event_mutex);
+
+	return (entry != NULL);
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_new(idevice_t * device, const char *udid)
 {
 	usbmuxd_device_info_t muxdev;
-	int res = usbmuxd_get_device_by_udid(udid, &muxdev);
-	if (res > 0) {
+	char *dev_udid = NULL;
+	uint32_t handle = 0;
+
+	/* only ask usbmuxd for devices missing in the device table */
+	if (!internal_device_table_lookup(udid, &dev_udid, &handle)) {
+		int res = usbmuxd_get_device_by_udid(udid, &muxdev);
+		if (res > 0) {
+			dev_udid = strdup(muxdev.udid);
+			handle = muxdev.handle;
+		}
+	}
+
+	if (dev_udid) {
 		idevice_t dev = (idevice_t) malloc(sizeof(struct idevice_private));
-		dev->udid = strdup(muxdev.udid);
+		dev->udid = dev_udid;
 		dev->conn_type = CONNECTION_USBMUXD;
-		dev->conn_data = (void*)(long)muxdev.handle;
+		dev->conn_data = (void*)(long)handle;
+		lockdownd_pool_device_ref(dev->udid);
 		*device = dev;
 		return IDEVICE_E_SUCCESS;
 	}
@@ -252,6 +825,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
 
 	ret = IDEVICE_E_SUCCESS;
 
+	lockdownd_pool_device_unref(device->udid);
 	free(device->udid);
 
 	if (device->conn_type == CONNECTION_USBMUXD) {
@@ -280,6 +854,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t
 		new_connection->type = CONNECTION_USBMUXD;
 		new_connection->data = (void*)(long)sfd;
 		new_connection->ssl_data = NULL;
+		new_connection->nonblocking = 0;
 		idevice_get_udid(device, &new_connection->udid);
 		*connection = new_connection;
 		return IDEVICE_E_SUCCESS;
@@ -363,62 +938,308 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_
 	return internal_connection_send(connection, data, len, sent_bytes);
 }
 
+#ifndef WIN32
 /**
- * Internally used function for receiving raw data over the given connection
- * using a timeout.
+ * Internally used function to send raw data from multiple buffers over the
+ * given connection with a single writev() call where possible.
  */
-static idevice_error_t internal_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+static idevice_error_t internal_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes)
 {
-	if (!connection) {
-		return IDEVICE_E_INVALID_ARG;
+	struct iovec vec[IDEVICE_SENDV_MAX_IOV];
+	uint32_t i;
+	int cnt = 0;
+	int fd;
+
+	*sent_bytes = 0;
+
+	if (connection->type != CONNECTION_USBMUXD) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	fd = (int)(long)connection->data;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].length == 0)
+			continue;
+		vec[cnt].iov_base = (void*)iov[i].data;
+		vec[cnt].iov_len = iov[i].length;
+		cnt++;
 	}
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int res = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
+	i = 0;
+	while (i < (uint32_t)cnt) {
+		ssize_t res = writev(fd, vec + i, cnt - i);
 		if (res < 0) {
-			debug_info("ERROR: usbmuxd_recv_timeout returned %d (%s)", res, strerror(-res));
+			if (errno == EINTR)
+				continue;
+			debug_info("ERROR: writev returned %d (%s)", errno, strerror(errno));
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
+		*sent_bytes += (uint32_t)res;
+		/* skip what has been written completely and adjust a partial one */
+		while (i < (uint32_t)cnt && (size_t)res >= vec[i].iov_len) {
+			res -= vec[i].iov_len;
+			i++;
+		}
+		if (i < (uint32_t)cnt) {
+			vec[i].iov_base = (char*)vec[i].iov_base + res;
+			vec[i].iov_len -= res;
+		}
 	}
-	return IDEVICE_E_UNKNOWN_ERROR;
+	return IDEVICE_E_SUCCESS;
 }
+#endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+	char buf[IDEVICE_SENDV_COALESCE_SIZE];
+	uint32_t buflen = 0;
+	uint32_t sent = 0;
+	uint32_t i;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+
+	if (!connection || !iov || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->ssl_data) {
-#ifdef HAVE_OPENSSL
-		uint32_t received = 0;
-		while (received < len) {
-			int r = SSL_read(connection->ssl_data->session, (void*)((char*)(data+received)), (int)len-received);
-			if (r > 0) {
-				received += r;
-			} else {
-				break;
-			}
-		}
-		debug_info("SSL_read %d, received %d", len, received);
-#else
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+	*sent_bytes = 0;
+
+	if (iovcnt == 1) {
+		return idevice_connection_send(connection, iov[0].data, iov[0].length, sent_bytes);
+	}
+
+#ifndef WIN32
+	if (!connection->ssl_data && iovcnt <= IDEVICE_SENDV_MAX_IOV) {
+		return internal_connection_sendv(connection, iov, iovcnt, sent_bytes);
+	}
 #endif
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
+
+	/* coalesce the buffers so they go out in full writes or SSL records */
+	for (i = 0; i < iovcnt; i++) {
+		const char *data = iov[i].data;
+		uint32_t length = iov[i].length;
+
+		if (length == 0)
+			continue;
+		if (buflen > 0 && buflen + length > sizeof(buf)) {
+			/* top up the pending data with the start of this buffer */
+			uint32_t part = sizeof(buf) - buflen;
+			memcpy(buf + buflen, data, part);
+			data += part;
+			length -= part;
+			res = idevice_connection_send(connection, buf, sizeof(buf), &sent);
+			*sent_bytes += sent;
+			if (res != IDEVICE_E_SUCCESS || sent < sizeof(buf))
+				return res;
+			buflen = 0;
+		}
+		if (length < sizeof(buf)) {
+			memcpy(buf + buflen, data, length);
+			buflen += length;
+		} else {
+			res = idevice_connection_send(connection, data, length, &sent);
+			*sent_bytes += sent;
+			if (res != IDEVICE_E_SUCCESS || sent < length)
+				return res;
 		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
 	}
-	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+	if (buflen > 0) {
+		res = idevice_connection_send(connection, buf, buflen, &sent);
+		*sent_bytes += sent;
+	}
+	return res;
 }
 
+#ifdef HAVE_SYS_SENDFILE_H
 /**
- * Internally used function for receiving raw data over the given connection.
+ * Internally used function to send file contents over the given connection
+ * with sendfile(), without copying them through user space.
+ *
+ * @return 0 on success, -1 on error, or 1 if sendfile() can't be used for
+ *   the file and nothing has been sent.
+ */
+static int internal_connection_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
+{
+	off_t off = (off_t)offset;
+	int sfd;
+
+	*sent_bytes = 0;
+
+	if (connection->type != CONNECTION_USBMUXD) {
+		debug_info("Unknown connection type %d", connection->type);
+		return -1;
+	}
+	sfd = (int)(long)connection->data;
+
+	while (*sent_bytes < length) {
+		ssize_t res = sendfile(sfd, fd, &off, length - *sent_bytes);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				/* the connection is in non-blocking mode, wait until the
+				 * socket can take more data */
+				struct pollfd pfd;
+				pfd.fd = sfd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+					debug_info("ERROR: poll returned %d (%s)", errno, strerror(errno));
+					return -1;
+				}
+				continue;
+			}
+			if (((errno == EINVAL) || (errno == ENOSYS)) && (*sent_bytes == 0))
+				return 1;
+			debug_info("ERROR: sendfile returned %d (%s)", errno, strerror(errno));
+			return -1;
+		}
+		if (res == 0) {
+			/* end of file */
+			break;
+		}
+		*sent_bytes += (uint32_t)res;
+	}
+	return 0;
+}
+#endif
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
+{
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	char *buf = NULL;
+	uint32_t bufsize;
+	uint32_t sent = 0;
+
+	if (!connection || (fd < 0) || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+
+#ifdef HAVE_SYS_SENDFILE_H
+	if (!connection->ssl_data) {
+		int r = internal_connection_send_file(connection, fd, offset, length, sent_bytes);
+		if (r == 0) {
+			return IDEVICE_E_SUCCESS;
+		} else if (r < 0) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	}
+#endif
+
+	/* read into a large buffer and send it from there, which is needed for SSL anyway */
+	bufsize = (length < IDEVICE_SEND_FILE_BUFFER_SIZE) ? length : IDEVICE_SEND_FILE_BUFFER_SIZE;
+	if (bufsize == 0) {
+		return IDEVICE_E_SUCCESS;
+	}
+#ifdef HAVE_POSIX_MEMALIGN
+	if (posix_memalign((void**)&buf, 4096, bufsize) != 0) {
+		buf = NULL;
+	}
+#else
+	buf = (char*)malloc(bufsize);
+#endif
+	if (!buf) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fd, (off_t)offset, (off_t)length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	while (*sent_bytes < length) {
+		uint32_t chunk = length - *sent_bytes;
+		ssize_t r;
+		if (chunk > bufsize) {
+			chunk = bufsize;
+		}
+#ifdef WIN32
+		if (_lseeki64(fd, offset + *sent_bytes, SEEK_SET) < 0) {
+			r = -1;
+		} else {
+			r = read(fd, buf, chunk);
+		}
+#else
+		r = pread(fd, buf, chunk, (off_t)(offset + *sent_bytes));
+#endif
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			debug_info("ERROR: reading file failed: %s", strerror(errno));
+			res = IDEVICE_E_UNKNOWN_ERROR;
+			break;
+		}
+		if (r == 0) {
+			/* end of file */
+			break;
+		}
+		res = idevice_connection_send(connection, buf, (uint32_t)r, &sent);
+		*sent_bytes += sent;
+		if ((res != IDEVICE_E_SUCCESS) || (sent < (uint32_t)r)) {
+			break;
+		}
+	}
+	free(buf);
+
+	return res;
+}
+
+/**
+ * Internally used function for receiving raw data over the given connection
+ * using a timeout.
+ */
+static idevice_error_t internal_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->type == CONNECTION_USBMUXD) {
+		int res = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
+		if (res < 0) {
+			debug_info("ERROR: usbmuxd_recv_timeout returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->ssl_data) {
+#ifdef HAVE_OPENSSL
+		uint32_t received = 0;
+		while (received < len) {
+			int r = SSL_read(connection->ssl_data->session, (void*)((char*)(data+received)), (int)len-received);
+			if (r > 0) {
+				received += r;
+			} else {
+				break;
+			}
+		}
+		debug_info("SSL_read %d, received %d", len, received);
+#else
+		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+#endif
+		if (received > 0) {
+			*recv_bytes = received;
+			return IDEVICE_E_SUCCESS;
+		}
+		*recv_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+}
+
+/**
+ * Internally used function for receiving raw data over the given connection.
  */
 static idevice_error_t internal_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
 {
@@ -426,41 +1247,549 @@ static idevice_error_t internal_connection_receive(idevice_connection_t connecti
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
-		if (res < 0) {
-			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
+	if (connection->type == CONNECTION_USBMUXD) {
+		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
+		if (res < 0) {
+			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->ssl_data) {
+#ifdef HAVE_OPENSSL
+		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
+		debug_info("SSL_read %d, received %d", len, received);
+#else
+		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+#endif
+		if (received > 0) {
+			*recv_bytes = received;
+			return IDEVICE_E_SUCCESS;
+		}
+		*recv_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_receive(connection, data, len, recv_bytes);
+}
+
+/**
+ * Internally used function to check if the last socket operation failed
+ * because it would have blocked.
+ */
+static int internal_socket_would_block(void)
+{
+#ifdef WIN32
+	int err = WSAGetLastError();
+	return (err == WSAEWOULDBLOCK || err == WSAEINTR);
+#else
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+}
+
+/**
+ * Internally used function for receiving raw data from a connection in
+ * non-blocking mode.
+ */
+static idevice_error_t internal_connection_receive_nonblock(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	*recv_bytes = 0;
+
+	if (connection->type != CONNECTION_USBMUXD) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	int res = recv((int)(long)connection->data, (void*)data, len, 0);
+	if (res < 0) {
+		if (internal_socket_would_block())
+			return IDEVICE_E_WANT_READ;
+		debug_info("ERROR: recv returned %d (%s)", errno, strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	if (res == 0) {
+		debug_info("connection closed");
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	*recv_bytes = (uint32_t)res;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function for sending raw data over a connection in
+ * non-blocking mode.
+ */
+static idevice_error_t internal_connection_send_nonblock(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	int flags = 0;
+
+	*sent_bytes = 0;
+
+	if (connection->type != CONNECTION_USBMUXD) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	int res = send((int)(long)connection->data, (const void*)data, len, flags);
+	if (res < 0) {
+		if (internal_socket_would_block())
+			return IDEVICE_E_WANT_WRITE;
+		debug_info("ERROR: send returned %d (%s)", errno, strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	*sent_bytes = (uint32_t)res;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to check if the SSL layer of a connection holds
+ * data that can be read without waiting for the socket.
+ */
+static int internal_connection_pending(idevice_connection_t connection)
+{
+	if (!connection->ssl_data || !connection->ssl_data->session)
+		return 0;
+#ifdef HAVE_OPENSSL
+	return (SSL_pending(connection->ssl_data->session) > 0);
+#else
+	if (gnutls_record_check_pending(connection->ssl_data->session) > 0)
+		return 1;
+	return (connection->ssl_data->recv_buffer && connection->ssl_data->recv_buffer_pos < connection->ssl_data->recv_buffer_len);
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
+{
+	if (!connection || !fd)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (connection->type == CONNECTION_USBMUXD) {
+		*fd = (int)(long)connection->data;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_set_nonblocking(idevice_connection_t connection, int nonblocking)
+{
+	if (!connection)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (connection->type != CONNECTION_USBMUXD) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	nonblocking = (nonblocking) ? 1 : 0;
+	if (connection->nonblocking == nonblocking)
+		return IDEVICE_E_SUCCESS;
+
+	int fd = (int)(long)connection->data;
+#ifdef WIN32
+	u_long mode = nonblocking;
+	if (ioctlsocket(fd, FIONBIO, &mode) != 0) {
+		debug_info("ERROR: ioctlsocket failed: %d", WSAGetLastError());
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		debug_info("ERROR: fcntl failed: %s", strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	flags = (nonblocking) ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if (fcntl(fd, F_SETFL, flags) < 0) {
+		debug_info("ERROR: fcntl failed: %s", strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+#endif
+
+#ifdef HAVE_OPENSSL
+	if (connection->ssl_data && connection->ssl_data->session) {
+		/* a non-blocking SSL_write might only write some of the records */
+		if (nonblocking) {
+			SSL_set_mode(connection->ssl_data->session, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		} else {
+			SSL_clear_mode(connection->ssl_data->session, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		}
+	}
+#endif
+	connection->nonblocking = nonblocking;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send_nonblock(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data || !sent_bytes || !connection->nonblocking || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+
+	if (connection->ssl_data) {
+#ifdef HAVE_OPENSSL
+		int sent = SSL_write(connection->ssl_data->session, (const void*)data, (int)len);
+		if (sent > 0) {
+			*sent_bytes = sent;
+			return IDEVICE_E_SUCCESS;
+		}
+		switch (SSL_get_error(connection->ssl_data->session, sent)) {
+			case SSL_ERROR_WANT_READ:
+				return IDEVICE_E_WANT_READ;
+			case SSL_ERROR_WANT_WRITE:
+				return IDEVICE_E_WANT_WRITE;
+			default:
+				break;
+		}
+#else
+		ssize_t sent = gnutls_record_send(connection->ssl_data->session, (void*)data, (size_t)len);
+		if (sent > 0) {
+			*sent_bytes = sent;
+			return IDEVICE_E_SUCCESS;
+		}
+		if (sent == GNUTLS_E_AGAIN || sent == GNUTLS_E_INTERRUPTED) {
+			return (gnutls_record_get_direction(connection->ssl_data->session)) ? IDEVICE_E_WANT_WRITE : IDEVICE_E_WANT_READ;
+		}
+#endif
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_send_nonblock(connection, data, len, sent_bytes);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_nonblock(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection || !data || !recv_bytes || !connection->nonblocking || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*recv_bytes = 0;
+
+	if (connection->ssl_data) {
+#ifdef HAVE_OPENSSL
+		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
+		if (received > 0) {
+			*recv_bytes = received;
+			return IDEVICE_E_SUCCESS;
+		}
+		switch (SSL_get_error(connection->ssl_data->session, received)) {
+			case SSL_ERROR_WANT_READ:
+				return IDEVICE_E_WANT_READ;
+			case SSL_ERROR_WANT_WRITE:
+				return IDEVICE_E_WANT_WRITE;
+			default:
+				break;
+		}
+#else
+		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+		if (received > 0) {
+			*recv_bytes = received;
+			return IDEVICE_E_SUCCESS;
+		}
+		if (received == GNUTLS_E_AGAIN || received == GNUTLS_E_INTERRUPTED) {
+			return (gnutls_record_get_direction(connection->ssl_data->session)) ? IDEVICE_E_WANT_WRITE : IDEVICE_E_WANT_READ;
+		}
+#endif
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_receive_nonblock(connection, data, len, recv_bytes);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t internal_loop_events_to_epoll(int events)
+{
+	uint32_t ev = 0;
+	if (events & IDEVICE_LOOP_READ)
+		ev |= EPOLLIN;
+	if (events & IDEVICE_LOOP_WRITE)
+		ev |= EPOLLOUT;
+	return ev;
+}
+
+static struct idevice_loop_source *internal_loop_find(idevice_loop_t loop, idevice_connection_t connection)
+{
+	struct idevice_loop_source *src;
+	for (src = loop->sources; src; src = src->next) {
+		if (src->connection == connection && !src->removed)
+			return src;
+	}
+	return NULL;
+}
+
+/**
+ * Frees all sources that have been removed while callbacks were running.
+ */
+static void internal_loop_purge(idevice_loop_t loop)
+{
+	struct idevice_loop_source **prev = &loop->sources;
+	while (*prev) {
+		struct idevice_loop_source *src = *prev;
+		if (src->removed) {
+			*prev = src->next;
+			free(src);
+		} else {
+			prev = &src->next;
+		}
+	}
+}
+#endif
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_new(idevice_loop_t *loop)
+{
+	if (!loop)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	idevice_loop_t new_loop = (idevice_loop_t)malloc(sizeof(struct idevice_loop_private));
+	if (!new_loop)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	new_loop->epfd = epoll_create(IDEVICE_LOOP_MAX_EVENTS);
+	if (new_loop->epfd < 0) {
+		debug_info("ERROR: epoll_create failed: %s", strerror(errno));
+		free(new_loop);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	fcntl(new_loop->epfd, F_SETFD, FD_CLOEXEC);
+	new_loop->stop = 0;
+	new_loop->dispatching = 0;
+	new_loop->sources = NULL;
+
+	*loop = new_loop;
+	return IDEVICE_E_SUCCESS;
+#else
+	debug_info("ERROR: event loops are not supported on this system");
+	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_free(idevice_loop_t loop)
+{
+	if (!loop)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	while (loop->sources) {
+		struct idevice_loop_source *src = loop->sources;
+		loop->sources = src->next;
+		free(src);
+	}
+	close(loop->epfd);
+	free(loop);
+	return IDEVICE_E_SUCCESS;
+#else
+	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_add(idevice_loop_t loop, idevice_connection_t connection, int events, idevice_loop_cb_t callback, void *user_data)
+{
+	if (!loop || !connection || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	struct idevice_loop_source *src = NULL;
+	int fd = -1;
+	idevice_error_t res;
+
+	if (internal_loop_find(loop, connection))
+		return IDEVICE_E_INVALID_ARG;
+
+	res = idevice_connection_get_fd(connection, &fd);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+
+	res = idevice_connection_set_nonblocking(connection, 1);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+
+	src = (struct idevice_loop_source*)malloc(sizeof(struct idevice_loop_source));
+	if (!src)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	src->connection = connection;
+	src->events = events;
+	src->revents = 0;
+	src->removed = 0;
+	src->callback = callback;
+	src->user_data = user_data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = internal_loop_events_to_epoll(events);
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		debug_info("ERROR: epoll_ctl failed: %s", strerror(errno));
+		free(src);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	src->next = loop->sources;
+	loop->sources = src;
+
+	return IDEVICE_E_SUCCESS;
+#else
+	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_modify(idevice_loop_t loop, idevice_connection_t connection, int events)
+{
+	if (!loop || !connection)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	struct idevice_loop_source *src = internal_loop_find(loop, connection);
+	int fd = -1;
+
+	if (!src)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_connection_get_fd(connection, &fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = internal_loop_events_to_epoll(events);
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		debug_info("ERROR: epoll_ctl failed: %s", strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	src->events = events;
+
+	return IDEVICE_E_SUCCESS;
+#else
+	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_remove(idevice_loop_t loop, idevice_connection_t connection)
+{
+	if (!loop || !connection)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	struct idevice_loop_source *src = internal_loop_find(loop, connection);
+	int fd = -1;
+
+	if (!src)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_connection_get_fd(connection, &fd);
+
+	/* a non-NULL event is required by kernels before 2.6.9 */
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+
+	/* events for this source might still be pending in the current dispatch */
+	src->removed = 1;
+	if (!loop->dispatching) {
+		internal_loop_purge(loop);
+	}
+
+	return IDEVICE_E_SUCCESS;
+#else
+	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_run_once(idevice_loop_t loop, int timeout)
+{
+	if (!loop || loop->dispatching)
+		return IDEVICE_E_INVALID_ARG;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[IDEVICE_LOOP_MAX_EVENTS];
+	struct idevice_loop_source *src;
+	int pending = 0;
+	int count;
+	int i;
+
+	/* data buffered by the SSL layer does not make the socket readable */
+	for (src = loop->sources; src; src = src->next) {
+		src->revents = 0;
+		if ((src->events & IDEVICE_LOOP_READ) && internal_connection_pending(src->connection)) {
+			src->revents = IDEVICE_LOOP_READ;
+			pending = 1;
+		}
+	}
+
+	count = epoll_wait(loop->epfd, events, IDEVICE_LOOP_MAX_EVENTS, (pending) ? 0 : timeout);
+	if (count < 0) {
+		if (errno == EINTR) {
+			count = 0;
+		} else {
+			debug_info("ERROR: epoll_wait failed: %s", strerror(errno));
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
+	}
 
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
+	for (i = 0; i < count; i++) {
+		src = (struct idevice_loop_source*)events[i].data.ptr;
+		if (events[i].events & EPOLLIN)
+			src->revents |= IDEVICE_LOOP_READ;
+		if (events[i].events & EPOLLOUT)
+			src->revents |= IDEVICE_LOOP_WRITE;
+		if (events[i].events & (EPOLLHUP | EPOLLERR))
+			src->revents |= IDEVICE_LOOP_HUP;
+	}
+
+	loop->dispatching = 1;
+	for (src = loop->sources; src; src = src->next) {
+		if (src->revents && !src->removed) {
+			src->callback(src->connection, src->revents, src->user_data);
+		}
 	}
+	loop->dispatching = 0;
+	internal_loop_purge(loop);
+
+	return IDEVICE_E_SUCCESS;
+#else
 	return IDEVICE_E_UNKNOWN_ERROR;
+#endif
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_run(idevice_loop_t loop)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+
+	if (!loop)
 		return IDEVICE_E_INVALID_ARG;
-	}
 
-	if (connection->ssl_data) {
-#ifdef HAVE_OPENSSL
-		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
-		debug_info("SSL_read %d, received %d", len, received);
-#else
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
-#endif
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
-		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+	loop->stop = 0;
+	while (!loop->stop && loop->sources) {
+		res = idevice_loop_run_once(loop, -1);
+		if (res != IDEVICE_E_SUCCESS)
+			break;
 	}
-	return internal_connection_receive(connection, data, len, recv_bytes);
+	loop->stop = 0;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_loop_stop(idevice_loop_t loop)
+{
+	if (!loop)
+		return IDEVICE_E_INVALID_ARG;
+
+	loop->stop = 1;
+	return IDEVICE_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle)
@@ -489,47 +1818,58 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_udid(idevice_t device, char **u
 #ifndef HAVE_OPENSSL
 /**
  * Internally used gnutls callback function for receiving encrypted data.
+ *
+ * Data is received in large chunks into a per-connection buffer which
+ * subsequent calls are served from until it is drained.
  */
 static ssize_t internal_ssl_read(gnutls_transport_ptr_t transport, char *buffer, size_t length)
 {
-	int bytes = 0, pos_start_fill = 0;
-	size_t tbytes = 0;
-	int this_len = length;
+	uint32_t bytes = 0;
+	size_t avail = 0;
 	idevice_error_t res;
-	idevice_connection_t connection = (idevice_connection_t)transport;
-	char *recv_buffer;
+	ssl_data_t ssl_data = (ssl_data_t)transport;
 
 	debug_info("pre-read client wants %zi bytes", length);
 
-	recv_buffer = (char *)malloc(sizeof(char) * this_len);
+	if (!ssl_data->recv_buffer) {
+		ssl_data->recv_buffer = (char*)malloc(IDEVICE_SSL_RECV_BUFFER_SIZE);
+		if (!ssl_data->recv_buffer) {
+			debug_info("ERROR: out of memory");
+			return -1;
+		}
+		ssl_data->recv_buffer_len = 0;
+		ssl_data->recv_buffer_pos = 0;
+	}
 
-	/* repeat until we have the full data or an error occurs */
-	do {
-		if ((res = internal_connection_receive(connection, recv_buffer, this_len, (uint32_t*)&bytes)) != IDEVICE_E_SUCCESS) {
+	/* refill the buffer with whatever is available once it is drained */
+	while (ssl_data->recv_buffer_pos >= ssl_data->recv_buffer_len) {
+		ssl_data->recv_buffer_len = 0;
+		ssl_data->recv_buffer_pos = 0;
+		if (ssl_data->connection->nonblocking) {
+			res = internal_connection_receive_nonblock(ssl_data->connection, ssl_data->recv_buffer, IDEVICE_SSL_RECV_BUFFER_SIZE, &bytes);
+			if (res == IDEVICE_E_WANT_READ) {
+				gnutls_transport_set_errno(ssl_data->session, EAGAIN);
+				return -1;
+			}
+		} else {
+			res = internal_connection_receive(ssl_data->connection, ssl_data->recv_buffer, IDEVICE_SSL_RECV_BUFFER_SIZE, &bytes);
+		}
+		if (res != IDEVICE_E_SUCCESS) {
 			debug_info("ERROR: idevice_connection_receive returned %d", res);
 			return res;
 		}
 		debug_info("post-read we got %i bytes", bytes);
+		ssl_data->recv_buffer_len = bytes;
+	}
 
-		/* increase read count */
-		tbytes += bytes;
-
-		/* fill the buffer with what we got right now */
-		memcpy(buffer + pos_start_fill, recv_buffer, bytes);
-		pos_start_fill += bytes;
-
-		if (tbytes >= length) {
-			break;
-		}
-
-		this_len = length - tbytes;
-		debug_info("re-read trying to read missing %i bytes", this_len);
-	} while (tbytes < length);
-
-	if (recv_buffer) {
-		free(recv_buffer);
+	avail = ssl_data->recv_buffer_len - ssl_data->recv_buffer_pos;
+	if (avail > length) {
+		avail = length;
 	}
-	return tbytes;
+	memcpy(buffer, ssl_data->recv_buffer + ssl_data->recv_buffer_pos, avail);
+	ssl_data->recv_buffer_pos += avail;
+
+	return avail;
 }
 
 /**
@@ -539,9 +1879,19 @@ static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer
 {
 	uint32_t bytes = 0;
 	idevice_error_t res;
-	idevice_connection_t connection = (idevice_connection_t)transport;
+	ssl_data_t ssl_data = (ssl_data_t)transport;
+	idevice_connection_t connection = ssl_data->connection;
 	debug_info("pre-send length = %zi", length);
-	if ((res = internal_connection_send(connection, buffer, length, &bytes)) != IDEVICE_E_SUCCESS) {
+	if (connection->nonblocking) {
+		res = internal_connection_send_nonblock(connection, buffer, length, &bytes);
+		if (res == IDEVICE_E_WANT_WRITE) {
+			gnutls_transport_set_errno(ssl_data->session, EAGAIN);
+			return -1;
+		}
+	} else {
+		res = internal_connection_send(connection, buffer, length, &bytes);
+	}
+	if (res != IDEVICE_E_SUCCESS) {
 		debug_info("ERROR: internal_connection_send returned %d", res);
 		return -1;
 	}
@@ -550,43 +1900,6 @@ static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer
 }
 #endif
 
-/**
- * Internally used function for cleaning up SSL stuff.
- */
-static void internal_ssl_cleanup(ssl_data_t ssl_data)
-{
-	if (!ssl_data)
-		return;
-
-#ifdef HAVE_OPENSSL
-	if (ssl_data->session) {
-		SSL_free(ssl_data->session);
-	}
-	if (ssl_data->ctx) {
-		SSL_CTX_free(ssl_data->ctx);
-	}
-#else
-	if (ssl_data->session) {
-		gnutls_deinit(ssl_data->session);
-	}
-	if (ssl_data->certificate) {
-		gnutls_certificate_free_credentials(ssl_data->certificate);
-	}
-	if (ssl_data->root_cert) {
-		gnutls_x509_crt_deinit(ssl_data->root_cert);
-	}
-	if (ssl_data->host_cert) {
-		gnutls_x509_crt_deinit(ssl_data->host_cert);
-	}
-	if (ssl_data->root_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->root_privkey);
-	}
-	if (ssl_data->host_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
-	}
-#endif
-}
-
 #ifdef HAVE_OPENSSL
 static int ssl_verify_callback(int ok, X509_STORE_CTX *ctx)
 {
@@ -632,12 +1945,12 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 	gnutls_certificate_type_t type = gnutls_certificate_type_get(session);
 	if (type == GNUTLS_CRT_X509) {
 		ssl_data_t ssl_data = (ssl_data_t)gnutls_session_get_ptr(session);
-		if (ssl_data && ssl_data->host_privkey && ssl_data->host_cert) {
+		if (ssl_data && ssl_data->credentials && ssl_data->credentials->host_privkey && ssl_data->credentials->host_cert) {
 			debug_info("Passing certificate");
 			st->type = type;
 			st->ncerts = 1;
-			st->cert.x509 = &ssl_data->host_cert;
-			st->key.x509 = ssl_data->host_privkey;
+			st->cert.x509 = &ssl_data->credentials->host_cert;
+			st->key.x509 = ssl_data->credentials->host_privkey;
 			st->deinit_all = 0;
 			res = 0;
 		}
@@ -646,21 +1959,28 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 }
 #endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+/**
+ * Internally used function to create SSL credentials from the pair record
+ * of the device with the given udid.
+ */
+static ssl_credentials_t internal_ssl_credentials_new(const char *udid)
 {
-	if (!connection || connection->ssl_data)
-		return IDEVICE_E_INVALID_ARG;
-
-	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
-	uint32_t return_me = 0;
 	plist_t pair_record = NULL;
 
-	userpref_read_pair_record(connection->udid, &pair_record);
+	userpref_read_pair_record(udid, &pair_record);
 	if (!pair_record) {
-		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->udid);
-		return ret;
+		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", udid);
+		return NULL;
 	}
 
+	ssl_credentials_t cred = (ssl_credentials_t)calloc(1, sizeof(struct ssl_credentials_private));
+	if (!cred) {
+		plist_free(pair_record);
+		return NULL;
+	}
+	cred->udid = strdup(udid);
+	cred->refcount = 1;
+
 #ifdef HAVE_OPENSSL
 	key_data_t root_cert = { NULL, 0 };
 	key_data_t root_privkey = { NULL, 0 };
@@ -668,21 +1988,16 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
 	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
 
-	if (pair_record)
-		plist_free(pair_record);
-
-	BIO *ssl_bio = BIO_new(BIO_s_socket());
-	if (!ssl_bio) {
-		debug_info("ERROR: Could not create SSL bio.");
-		return ret;
-	}
-	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+	plist_free(pair_record);
 
-	SSL_CTX *ssl_ctx = SSL_CTX_new(SSLv3_method());
-	if (ssl_ctx == NULL) {
+	cred->ctx = SSL_CTX_new(SSLv3_method());
+	if (cred->ctx == NULL) {
 		debug_info("ERROR: Could not create SSL context.");
-		BIO_free(ssl_bio);
-		return ret;
+		free(root_cert.data);
+		free(root_privkey.data);
+		free(cred->udid);
+		free(cred);
+		return NULL;
 	}
 
 	BIO* membp;
@@ -690,7 +2005,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	membp = BIO_new_mem_buf(root_cert.data, root_cert.size);
 	PEM_read_bio_X509(membp, &rootCert, NULL, NULL);
 	BIO_free(membp);
-	if (SSL_CTX_use_certificate(ssl_ctx, rootCert) != 1) {
+	if (SSL_CTX_use_certificate(cred->ctx, rootCert) != 1) {
 		debug_info("WARNING: Could not load RootCertificate");
 	}
 	X509_free(rootCert);
@@ -700,32 +2015,326 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	membp = BIO_new_mem_buf(root_privkey.data, root_privkey.size);
 	PEM_read_bio_RSAPrivateKey(membp, &rootPrivKey, NULL, NULL);
 	BIO_free(membp);
-	if (SSL_CTX_use_RSAPrivateKey(ssl_ctx, rootPrivKey) != 1) {
+	if (SSL_CTX_use_RSAPrivateKey(cred->ctx, rootPrivKey) != 1) {
 		debug_info("WARNING: Could not load RootPrivateKey");
 	}
 	RSA_free(rootPrivKey);
 	free(root_privkey.data);
+#else
+	gnutls_certificate_allocate_credentials(&cred->certificate);
+	gnutls_certificate_client_set_retrieve_function(cred->certificate, internal_cert_callback);
+
+	gnutls_x509_crt_init(&cred->root_cert);
+	gnutls_x509_crt_init(&cred->host_cert);
+	gnutls_x509_privkey_init(&cred->root_privkey);
+	gnutls_x509_privkey_init(&cred->host_privkey);
+
+	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, cred->root_cert);
+	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, cred->host_cert);
+	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, cred->root_privkey);
+	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, cred->host_privkey);
+
+	plist_free(pair_record);
+#endif
+
+	return cred;
+}
+
+/**
+ * Internally used function to free SSL credentials.
+ */
+static void internal_ssl_credentials_free(ssl_credentials_t cred)
+{
+	if (!cred)
+		return;
+
+#ifdef HAVE_OPENSSL
+	if (cred->session) {
+		SSL_SESSION_free(cred->session);
+	}
+	if (cred->ctx) {
+		SSL_CTX_free(cred->ctx);
+	}
+#else
+	if (cred->session_data.data) {
+		gnutls_free(cred->session_data.data);
+	}
+	if (cred->certificate) {
+		gnutls_certificate_free_credentials(cred->certificate);
+	}
+	if (cred->root_cert) {
+		gnutls_x509_crt_deinit(cred->root_cert);
+	}
+	if (cred->host_cert) {
+		gnutls_x509_crt_deinit(cred->host_cert);
+	}
+	if (cred->root_privkey) {
+		gnutls_x509_privkey_deinit(cred->root_privkey);
+	}
+	if (cred->host_privkey) {
+		gnutls_x509_privkey_deinit(cred->host_privkey);
+	}
+#endif
+	free(cred->udid);
+	free(cred);
+}
+
+/**
+ * Internally used function to drop a reference to SSL credentials.
+ */
+static void internal_ssl_credentials_release(ssl_credentials_t cred)
+{
+	int last = 0;
+
+	if (!cred)
+		return;
+
+	mutex_lock(&ssl_cache_mutex);
+	cred->refcount--;
+	last = (cred->refcount == 0);
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (last) {
+		internal_ssl_credentials_free(cred);
+	}
+}
+
+/**
+ * Internally used function to get SSL credentials for the device with the
+ * given udid, either from the cache or freshly created from the pair record.
+ * The returned reference has to be dropped with
+ * internal_ssl_credentials_release().
+ */
+static ssl_credentials_t internal_ssl_credentials_get(const char *udid)
+{
+	ssl_credentials_t cred = NULL;
+
+	mutex_lock(&ssl_cache_mutex);
+	if (ssl_cache_enabled) {
+		for (cred = ssl_cache; cred; cred = cred->next) {
+			if (!strcmp(cred->udid, udid)) {
+				cred->refcount++;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (cred) {
+		debug_info("using cached SSL credentials for udid %s", udid);
+		return cred;
+	}
+
+	cred = internal_ssl_credentials_new(udid);
+	if (!cred)
+		return NULL;
+
+	mutex_lock(&ssl_cache_mutex);
+	if (ssl_cache_enabled) {
+		ssl_credentials_t c;
+		for (c = ssl_cache; c; c = c->next) {
+			if (!strcmp(c->udid, udid))
+				break;
+		}
+		/* the cache holds its own reference */
+		if (!c) {
+			cred->refcount++;
+			cred->next = ssl_cache;
+			ssl_cache = cred;
+		}
+	}
+	mutex_unlock(&ssl_cache_mutex);
+
+	return cred;
+}
+
+/**
+ * Internally used function to remove cached SSL credentials. If udid is
+ * NULL, all cached credentials are removed.
+ */
+static void internal_ssl_cache_remove(const char *udid)
+{
+	ssl_credentials_t removed = NULL;
+	ssl_credentials_t *prev = NULL;
+	ssl_credentials_t cred = NULL;
+
+	mutex_lock(&ssl_cache_mutex);
+	prev = &ssl_cache;
+	while (*prev) {
+		cred = *prev;
+		if (!udid || !strcmp(cred->udid, udid)) {
+			*prev = cred->next;
+			cred->next = removed;
+			removed = cred;
+		} else {
+			prev = &cred->next;
+		}
+	}
+	mutex_unlock(&ssl_cache_mutex);
+
+	while (removed) {
+		cred = removed;
+		removed = removed->next;
+		cred->next = NULL;
+		internal_ssl_credentials_release(cred);
+	}
+}
+
+void idevice_ssl_cache_invalidate(const char *udid)
+{
+	if (!udid)
+		return;
+	debug_info("invalidating cached SSL credentials for udid %s", udid);
+	internal_ssl_cache_remove(udid);
+}
+
+LIBIMOBILEDEVICE_API void idevice_set_ssl_cache(int enabled)
+{
+	mutex_lock(&ssl_cache_mutex);
+	ssl_cache_enabled = enabled ? 1 : 0;
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (!enabled) {
+		internal_ssl_cache_remove(NULL);
+	}
+}
+
+/**
+ * Internally used function to prepare an SSL session for resumption using
+ * the session data stored with its credentials.
+ */
+static void internal_ssl_session_restore(ssl_data_t ssl_data)
+{
+	ssl_credentials_t cred = ssl_data->credentials;
+
+	mutex_lock(&ssl_cache_mutex);
+#ifdef HAVE_OPENSSL
+	if (cred->session) {
+		SSL_set_session(ssl_data->session, cred->session);
+		debug_info("attempting to resume SSL session");
+	}
+#else
+	if (cred->session_data.data) {
+		gnutls_session_set_data(ssl_data->session, cred->session_data.data, cred->session_data.size);
+		debug_info("attempting to resume SSL session");
+	}
+#endif
+	mutex_unlock(&ssl_cache_mutex);
+}
 
-	SSL *ssl = SSL_new(ssl_ctx);
+/**
+ * Internally used function to store the data of an established SSL session
+ * with its credentials so that later sessions can resume it.
+ */
+static void internal_ssl_session_save(ssl_data_t ssl_data)
+{
+	ssl_credentials_t cred = ssl_data->credentials;
+
+#ifdef HAVE_OPENSSL
+	SSL_SESSION *sess = SSL_get1_session(ssl_data->session);
+	SSL_SESSION *old = NULL;
+	if (!sess)
+		return;
+
+	mutex_lock(&ssl_cache_mutex);
+	old = cred->session;
+	cred->session = sess;
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (old) {
+		SSL_SESSION_free(old);
+	}
+#else
+	gnutls_datum_t data = { NULL, 0 };
+	gnutls_datum_t old = { NULL, 0 };
+	if (gnutls_session_get_data2(ssl_data->session, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	mutex_lock(&ssl_cache_mutex);
+	old = cred->session_data;
+	cred->session_data = data;
+	mutex_unlock(&ssl_cache_mutex);
+
+	if (old.data) {
+		gnutls_free(old.data);
+	}
+#endif
+}
+
+/**
+ * Internally used function for cleaning up SSL stuff.
+ */
+static void internal_ssl_cleanup(ssl_data_t ssl_data)
+{
+	if (!ssl_data)
+		return;
+
+#ifdef HAVE_OPENSSL
+	if (ssl_data->session) {
+		SSL_free(ssl_data->session);
+	}
+#else
+	if (ssl_data->session) {
+		gnutls_deinit(ssl_data->session);
+	}
+	if (ssl_data->recv_buffer) {
+		free(ssl_data->recv_buffer);
+	}
+#endif
+	internal_ssl_credentials_release(ssl_data->credentials);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+{
+	if (!connection || connection->ssl_data)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
+	uint32_t return_me = 0;
+	ssl_credentials_t cred = NULL;
+
+	cred = internal_ssl_credentials_get(connection->udid);
+	if (!cred) {
+		return ret;
+	}
+
+#ifdef HAVE_OPENSSL
+	BIO *ssl_bio = BIO_new(BIO_s_socket());
+	if (!ssl_bio) {
+		debug_info("ERROR: Could not create SSL bio.");
+		internal_ssl_credentials_release(cred);
+		return ret;
+	}
+	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+
+	SSL *ssl = SSL_new(cred->ctx);
 	if (!ssl) {
 		debug_info("ERROR: Could not create SSL object");
 		BIO_free(ssl_bio);
-		SSL_CTX_free(ssl_ctx);
+		internal_ssl_credentials_release(cred);
 		return ret;
 	}
 	SSL_set_connect_state(ssl);
 	SSL_set_verify(ssl, 0, ssl_verify_callback);
 	SSL_set_bio(ssl, ssl_bio, ssl_bio);
 
+	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_loc->session = ssl;
+	ssl_data_loc->credentials = cred;
+
+	internal_ssl_session_restore(ssl_data_loc);
+
 	return_me = SSL_do_handshake(ssl);
 	if (return_me != 1) {
 		debug_info("ERROR in SSL_do_handshake: %s", ssl_error_to_string(SSL_get_error(ssl, return_me)));
-		SSL_free(ssl);
-		SSL_CTX_free(ssl_ctx);
+		/* the cached credentials might be outdated, don't use them again */
+		idevice_ssl_cache_invalidate(connection->udid);
+		userpref_pair_record_cache_invalidate(connection->udid);
+		internal_ssl_cleanup(ssl_data_loc);
+		free(ssl_data_loc);
 	} else {
-		ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
-		ssl_data_loc->session = ssl;
-		ssl_data_loc->ctx = ssl_ctx;
+		debug_info("SSL session %s", SSL_session_reused(ssl) ? "resumed" : "established");
+		internal_ssl_session_save(ssl_data_loc);
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
 		debug_info("SSL mode enabled, cipher: %s", SSL_get_cipher(ssl));
@@ -738,32 +2347,24 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 #endif
 #else
 	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_loc->credentials = cred;
+	ssl_data_loc->connection = connection;
+	ssl_data_loc->recv_buffer = NULL;
+	ssl_data_loc->recv_buffer_len = 0;
+	ssl_data_loc->recv_buffer_pos = 0;
 
 	/* Set up GnuTLS... */
 	debug_info("enabling SSL mode");
 	errno = 0;
-	gnutls_certificate_allocate_credentials(&ssl_data_loc->certificate);
-	gnutls_certificate_client_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
 	gnutls_init(&ssl_data_loc->session, GNUTLS_CLIENT);
 	gnutls_priority_set_direct(ssl_data_loc->session, "NONE:+VERS-SSL3.0:+ANON-DH:+RSA:+AES-128-CBC:+AES-256-CBC:+SHA1:+MD5:+COMP-NULL", NULL);
-	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
+	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, cred->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
-	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
-	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
-	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
-	gnutls_x509_privkey_init(&ssl_data_loc->host_privkey);
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, ssl_data_loc->root_cert);
-	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, ssl_data_loc->host_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, ssl_data_loc->root_privkey);
-	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, ssl_data_loc->host_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
+	internal_ssl_session_restore(ssl_data_loc);
 
 	debug_info("GnuTLS step 1...");
-	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
+	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)ssl_data_loc);
 	debug_info("GnuTLS step 2...");
 	gnutls_transport_set_push_function(ssl_data_loc->session, (gnutls_push_func) & internal_ssl_write);
 	debug_info("GnuTLS step 3...");
@@ -776,12 +2377,17 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	debug_info("GnuTLS handshake done...");
 
 	if (return_me != GNUTLS_E_SUCCESS) {
+		/* the cached credentials might be outdated, don't use them again */
+		idevice_ssl_cache_invalidate(connection->udid);
+		userpref_pair_record_cache_invalidate(connection->udid);
 		internal_ssl_cleanup(ssl_data_loc);
 		free(ssl_data_loc);
 		debug_info("GnuTLS reported something wrong.");
 		gnutls_perror(return_me);
 		debug_info("oh.. errno says %s", strerror(errno));
 	} else {
+		debug_info("SSL session %s", gnutls_session_is_resumed(ssl_data_loc->session) ? "resumed" : "established");
+		internal_ssl_session_save(ssl_data_loc);
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
 		debug_info("SSL mode enabled");
@@ -46,21 +46,51 @@
 #include "common/userpref.h"
 #include "libimobiledevice/libimobiledevice.h"
 
+/* size of the buffer used to coalesce scatter/gather sends, which matches
+ * the maximum SSL record size */
+#define IDEVICE_SENDV_COALESCE_SIZE 16384
+/* maximum number of buffers passed to a single writev() call */
+#define IDEVICE_SENDV_MAX_IOV 16
+/* size of the buffer file contents are read into when they can't be sent
+ * with sendfile() */
+#define IDEVICE_SEND_FILE_BUFFER_SIZE (1024 * 1024)
+/* size of the buffer that gnutls pulls encrypted data from */
+#define IDEVICE_SSL_RECV_BUFFER_SIZE 65536
+/* maximum number of events fetched by one epoll_wait() of an event loop */
+#define IDEVICE_LOOP_MAX_EVENTS 64
+
 enum connection_type {
 	CONNECTION_USBMUXD = 1
 };
 
-struct ssl_data_private {
+struct ssl_credentials_private {
+	char *udid;
+	int refcount;
 #ifdef HAVE_OPENSSL
-	SSL *session;
 	SSL_CTX *ctx;
+	SSL_SESSION *session;
 #else
 	gnutls_certificate_credentials_t certificate;
-	gnutls_session_t session;
 	gnutls_x509_privkey_t root_privkey;
 	gnutls_x509_crt_t root_cert;
 	gnutls_x509_privkey_t host_privkey;
 	gnutls_x509_crt_t host_cert;
+	gnutls_datum_t session_data;
+#endif
+	struct ssl_credentials_private *next;
+};
+typedef struct ssl_credentials_private *ssl_credentials_t;
+
+struct ssl_data_private {
+	ssl_credentials_t credentials;
+#ifdef HAVE_OPENSSL
+	SSL *session;
+#else
+	gnutls_session_t session;
+	struct idevice_connection_private *connection;
+	char *recv_buffer;
+	uint32_t recv_buffer_len;
+	uint32_t recv_buffer_pos;
 #endif
 };
 typedef struct ssl_data_private *ssl_data_t;
@@ -70,6 +100,7 @@ struct idevice_connection_private {
 	enum connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
+	int nonblocking;
 };
 
 struct idevice_private {
@@ -78,4 +109,40 @@ struct idevice_private {
 	void *conn_data;
 };
 
+struct idevice_subscription_context_private {
+	idevice_event_cb_t callback;
+	void *user_data;
+	int removed;
+	struct idevice_subscription_context_private *next;
+};
+
+/* number of hash buckets of the udid index of the device table */
+#define IDEVICE_DEVICE_TABLE_BUCKETS 64
+
+struct idevice_device_entry {
+	char *udid;
+	uint32_t handle;
+	struct idevice_device_entry *next;
+	struct idevice_device_entry *hash_next;
+};
+
+struct idevice_loop_source {
+	idevice_connection_t connection;
+	int events;
+	int revents;
+	int removed;
+	idevice_loop_cb_t callback;
+	void *user_data;
+	struct idevice_loop_source *next;
+};
+
+struct idevice_loop_private {
+	int epfd;
+	int stop;
+	int dispatching;
+	struct idevice_loop_source *sources;
+};
+
+void idevice_ssl_cache_invalidate(const char *udid);
+
 #endif
@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
 #ifdef HAVE_OPENSSL
 #include <openssl/pem.h>
 #include <openssl/x509.h>
@@ -50,6 +51,7 @@
 #include "common/debug.h"
 #include "common/userpref.h"
 #include "common/utils.h"
+#include "common/thread.h"
 #include "asprintf.h"
 
 #ifdef WIN32
@@ -423,16 +425,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t c
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+/**
+ * Internally used function to create a GetValue request.
+ */
+static plist_t lockdownd_get_value_request_new(lockdownd_client_t client, const char *domain, const char *key)
 {
-	if (!client)
-		return LOCKDOWN_E_INVALID_ARG;
-
-	plist_t dict = NULL;
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	/* setup request plist */
-	dict = plist_new_dict();
+	plist_t dict = plist_new_dict();
 	plist_dict_add_label(dict, client->label);
 	if (domain) {
 		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
@@ -441,6 +439,19 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 		plist_dict_set_item(dict,"Key", plist_new_string(key));
 	}
 	plist_dict_set_item(dict,"Request", plist_new_string("GetValue"));
+	return dict;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	/* setup request plist */
+	dict = lockdownd_get_value_request_new(client, domain, key);
 
 	/* send to device */
 	ret = lockdownd_send(client, dict);
@@ -477,6 +488,80 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *out)
+{
+	if (!client || !keys || count == 0 || !out)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	plist_t dict = NULL;
+	plist_t result = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	uint32_t sent = 0;
+	uint32_t i;
+
+	*out = NULL;
+
+	/* send all requests first so the device can answer them back to back */
+	for (sent = 0; sent < count; sent++) {
+		dict = lockdownd_get_value_request_new(client, (domains) ? domains[sent] : NULL, keys[sent]);
+		ret = lockdownd_send(client, dict);
+		plist_free(dict);
+		dict = NULL;
+		if (ret != LOCKDOWN_E_SUCCESS)
+			break;
+	}
+
+	if (sent == 0)
+		return ret;
+
+	/* replies arrive in the order the requests were sent */
+	result = plist_new_array();
+	for (i = 0; i < sent; i++) {
+		const char *domain = (domains) ? domains[i] : NULL;
+		plist_t entry = NULL;
+		lockdownd_error_t err;
+
+		err = lockdownd_receive(client, &dict);
+		if (err != LOCKDOWN_E_SUCCESS) {
+			/* the connection is unusable, give up on the remaining replies */
+			plist_free(result);
+			return err;
+		}
+
+		entry = plist_new_dict();
+		if (domain) {
+			plist_dict_set_item(entry, "Domain", plist_new_string(domain));
+		}
+		if (keys[i]) {
+			plist_dict_set_item(entry, "Key", plist_new_string(keys[i]));
+		}
+
+		err = lockdown_check_result(dict, "GetValue");
+		if (err == LOCKDOWN_E_SUCCESS) {
+			plist_t value_node = plist_dict_get_item(dict, "Value");
+			if (value_node) {
+				plist_dict_set_item(entry, "Value", plist_copy(value_node));
+			}
+		} else {
+			plist_t err_node = plist_dict_get_item(dict, "Error");
+			if (err_node && plist_get_node_type(err_node) == PLIST_STRING) {
+				plist_dict_set_item(entry, "Error", plist_copy(err_node));
+			} else {
+				plist_dict_set_item(entry, "Error", plist_new_string("UnknownError"));
+			}
+		}
+		plist_free(dict);
+		dict = NULL;
+
+		plist_array_append_item(result, entry);
+	}
+
+	*out = result;
+
+	/* a failed send leaves the trailing requests unanswered */
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *domain, const char *key, plist_t value)
 {
 	if (!client || !value)
@@ -963,6 +1048,7 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
 			if (!strcmp("Unpair", verb)) {
 				/* remove public key from config */
 				userpref_delete_pair_record(client->udid);
+				idevice_ssl_cache_invalidate(client->udid);
 			} else {
 				if (!strcmp("Pair", verb)) {
 					/* add returned escrow bag if available */
@@ -981,6 +1067,7 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
 					}
 
 					userpref_save_pair_record(client->udid, pair_record_plist);
+					idevice_ssl_cache_invalidate(client->udid);
 				}
 			}
 		} else {
@@ -1366,6 +1453,292 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_service_with_escrow_bag(l
 	return lockdownd_do_start_service(client, identifier, 1, service);
 }
 
+struct lockdownd_pool_entry {
+	lockdownd_client_t client;
+	time_t last_used;
+	struct lockdownd_pool_entry *next;
+};
+
+/* counts the device handles per udid, sessions are only pooled while the
+ * device is in use */
+struct lockdownd_pool_device {
+	char *udid;
+	unsigned int refs;
+	struct lockdownd_pool_device *next;
+};
+
+static struct lockdownd_pool_entry *lockdownd_pool = NULL;
+static struct lockdownd_pool_device *lockdownd_pool_devices = NULL;
+static int lockdownd_pool_enabled = 1;
+static mutex_t lockdownd_pool_mutex;
+static thread_once_t lockdownd_pool_once = THREAD_ONCE_INIT;
+
+static void lockdownd_pool_init(void)
+{
+	mutex_init(&lockdownd_pool_mutex);
+}
+
+static int lockdownd_pool_strcmp(const char *a, const char *b)
+{
+	if (!a || !b)
+		return (a == b) ? 0 : 1;
+	return strcmp(a, b);
+}
+
+/**
+ * Frees a list of pool entries including their lockdownd clients.
+ */
+static void lockdownd_pool_free_entries(struct lockdownd_pool_entry *entry)
+{
+	while (entry) {
+		struct lockdownd_pool_entry *next = entry->next;
+		lockdownd_client_free(entry->client);
+		free(entry);
+		entry = next;
+	}
+}
+
+/**
+ * Takes an idle lockdownd client with a running session for the given device
+ * and label out of the pool. Clients that have been idle for too long are
+ * discarded on the way.
+ *
+ * @return A lockdownd client or NULL if there is no usable client available.
+ */
+static lockdownd_client_t lockdownd_pool_take(const char *udid, const char *label)
+{
+	struct lockdownd_pool_entry **prev = NULL;
+	struct lockdownd_pool_entry *entry = NULL;
+	struct lockdownd_pool_entry *expired = NULL;
+	lockdownd_client_t client = NULL;
+	time_t now = time(NULL);
+
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	prev = &lockdownd_pool;
+	while (*prev) {
+		entry = *prev;
+		if (now - entry->last_used >= LOCKDOWN_POOL_IDLE_TIMEOUT) {
+			*prev = entry->next;
+			entry->next = expired;
+			expired = entry;
+			continue;
+		}
+		if (!client && !strcmp(entry->client->udid, udid) && !lockdownd_pool_strcmp(entry->client->label, label)) {
+			*prev = entry->next;
+			client = entry->client;
+			free(entry);
+			continue;
+		}
+		prev = &entry->next;
+	}
+	mutex_unlock(&lockdownd_pool_mutex);
+
+	lockdownd_pool_free_entries(expired);
+
+	if (client) {
+		debug_info("reusing pooled lockdownd session for device %s", udid);
+	}
+	return client;
+}
+
+/**
+ * Returns a lockdownd client with a running session to the pool. If the pool
+ * is disabled or already holds an idle client for the same device and label,
+ * the client is freed instead.
+ */
+static void lockdownd_pool_put(lockdownd_client_t client)
+{
+	struct lockdownd_pool_entry *entry = NULL;
+
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	if (lockdownd_pool_enabled && client->session_id) {
+		for (entry = lockdownd_pool; entry; entry = entry->next) {
+			if (!strcmp(entry->client->udid, client->udid) && !lockdownd_pool_strcmp(entry->client->label, client->label))
+				break;
+		}
+		if (!entry) {
+			entry = (struct lockdownd_pool_entry*)malloc(sizeof(struct lockdownd_pool_entry));
+			if (entry) {
+				entry->client = client;
+				entry->last_used = time(NULL);
+				entry->next = lockdownd_pool;
+				lockdownd_pool = entry;
+				client = NULL;
+			}
+		}
+	}
+	mutex_unlock(&lockdownd_pool_mutex);
+
+	if (client) {
+		lockdownd_client_free(client);
+	}
+}
+
+void lockdownd_pool_remove(const char *udid)
+{
+	struct lockdownd_pool_entry **prev = NULL;
+	struct lockdownd_pool_entry *entry = NULL;
+	struct lockdownd_pool_entry *removed = NULL;
+
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	prev = &lockdownd_pool;
+	while (*prev) {
+		entry = *prev;
+		if (!udid || !strcmp(entry->client->udid, udid)) {
+			*prev = entry->next;
+			entry->next = removed;
+			removed = entry;
+		} else {
+			prev = &entry->next;
+		}
+	}
+	mutex_unlock(&lockdownd_pool_mutex);
+
+	lockdownd_pool_free_entries(removed);
+}
+
+void lockdownd_pool_device_ref(const char *udid)
+{
+	struct lockdownd_pool_device *device = NULL;
+
+	if (!udid)
+		return;
+
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	for (device = lockdownd_pool_devices; device; device = device->next) {
+		if (!strcmp(device->udid, udid))
+			break;
+	}
+	if (device) {
+		device->refs++;
+	} else {
+		device = (struct lockdownd_pool_device*)malloc(sizeof(struct lockdownd_pool_device));
+		if (device) {
+			device->udid = strdup(udid);
+			if (device->udid) {
+				device->refs = 1;
+				device->next = lockdownd_pool_devices;
+				lockdownd_pool_devices = device;
+			} else {
+				free(device);
+			}
+		}
+	}
+	mutex_unlock(&lockdownd_pool_mutex);
+}
+
+void lockdownd_pool_device_unref(const char *udid)
+{
+	struct lockdownd_pool_device **prev = NULL;
+	struct lockdownd_pool_device *device = NULL;
+	int unused = 1;
+
+	if (!udid)
+		return;
+
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	for (prev = &lockdownd_pool_devices; *prev; prev = &(*prev)->next) {
+		device = *prev;
+		if (!strcmp(device->udid, udid)) {
+			if (--device->refs > 0) {
+				unused = 0;
+			} else {
+				*prev = device->next;
+				free(device->udid);
+				free(device);
+			}
+			break;
+		}
+	}
+	mutex_unlock(&lockdownd_pool_mutex);
+
+	/* nobody is going to reuse the sessions, don't keep them open */
+	if (unused) {
+		lockdownd_pool_remove(udid);
+	}
+}
+
+LIBIMOBILEDEVICE_API void lockdownd_set_client_pool(int enabled)
+{
+	thread_once(&lockdownd_pool_once, lockdownd_pool_init);
+
+	mutex_lock(&lockdownd_pool_mutex);
+	lockdownd_pool_enabled = enabled ? 1 : 0;
+	mutex_unlock(&lockdownd_pool_mutex);
+
+	if (!enabled) {
+		lockdownd_pool_remove(NULL);
+	}
+}
+
+/**
+ * Checks if a lockdownd error means that the connection or session of the
+ * client that produced it is no longer usable.
+ */
+static int lockdownd_error_is_fatal(lockdownd_error_t err)
+{
+	switch (err) {
+		case LOCKDOWN_E_SUCCESS:
+		case LOCKDOWN_E_INVALID_SERVICE:
+		case LOCKDOWN_E_MISSING_SERVICE:
+		case LOCKDOWN_E_SERVICE_PROHIBITED:
+		case LOCKDOWN_E_SERVICE_LIMIT:
+		case LOCKDOWN_E_PASSWORD_PROTECTED:
+		case LOCKDOWN_E_ESCROW_LOCKED:
+			return 0;
+		default:
+			break;
+	}
+	return 1;
+}
+
+lockdownd_error_t lockdownd_start_service_pooled(idevice_t device, const char *label, const char *identifier, lockdownd_service_descriptor_t *service)
+{
+	lockdownd_client_t client = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	if (!device || !identifier || !service)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	client = lockdownd_pool_take(device->udid, label);
+	if (client) {
+		ret = lockdownd_start_service(client, identifier, service);
+		if (!lockdownd_error_is_fatal(ret)) {
+			lockdownd_pool_put(client);
+			return ret;
+		}
+		/* the session went away, retry with a new one */
+		debug_info("pooled lockdownd session failed (%d), starting a new one", ret);
+		lockdownd_client_free(client);
+		client = NULL;
+	}
+
+	ret = lockdownd_client_new_with_handshake(device, &client, label);
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		debug_info("Could not create a lockdown client.");
+		return ret;
+	}
+
+	ret = lockdownd_start_service(client, identifier, service);
+	if (!lockdownd_error_is_fatal(ret)) {
+		lockdownd_pool_put(client);
+	} else {
+		lockdownd_client_free(client);
+	}
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_activate(lockdownd_client_t client, plist_t activation_record)
 {
 	if (!client)
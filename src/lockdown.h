@@ -28,6 +28,10 @@
 
 #define LOCKDOWN_PROTOCOL_VERSION "2"
 
+/* seconds after which an idle pooled session is discarded; the device
+ * closes lockdown connections that idle for more than 10 seconds */
+#define LOCKDOWN_POOL_IDLE_TIMEOUT 8
+
 struct lockdownd_client_private {
 	property_list_service_client_t parent;
 	int ssl_enabled;
@@ -36,4 +40,9 @@ struct lockdownd_client_private {
 	char *label;
 };
 
+lockdownd_error_t lockdownd_start_service_pooled(idevice_t device, const char *label, const char *identifier, lockdownd_service_descriptor_t *service);
+void lockdownd_pool_remove(const char *udid);
+void lockdownd_pool_device_ref(const char *udid);
+void lockdownd_pool_device_unref(const char *udid);
+
 #endif
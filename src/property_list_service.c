@@ -68,6 +68,7 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 	/* create client object */
 	property_list_service_client_t client_loc = (property_list_service_client_t)malloc(sizeof(struct property_list_service_client_private));
 	client_loc->parent = parent;
+	plist_framer_init(&client_loc->framer, PROPERTY_LIST_SERVICE_DEFAULT_MAX_SIZE);
 
 	/* all done, return success */
 	*client = client_loc;
@@ -81,6 +82,7 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 
 	property_list_service_error_t err = service_to_property_list_service_error(service_client_free(client->parent));
 
+	plist_framer_free(&client->framer);
 	free(client);
 	client = NULL;
 
@@ -108,6 +110,7 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 	uint32_t length = 0;
 	uint32_t nlen = 0;
 	int bytes = 0;
+	idevice_iovec_t iov[2];
 
 	if (!client || (client && !client->parent) || !plist) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
@@ -125,18 +128,23 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 
 	nlen = htobe32(length);
 	debug_info("sending %d bytes", length);
-	service_send(client->parent, (const char*)&nlen, sizeof(nlen), (uint32_t*)&bytes);
-	if (bytes == sizeof(nlen)) {
-		service_send(client->parent, content, length, (uint32_t*)&bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if ((uint32_t)bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
-			}
+	/* send length prefix and plist data with a single write */
+	iov[0].data = (const char*)&nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = content;
+	iov[1].length = length;
+	service_sendv(client->parent, iov, 2, (uint32_t*)&bytes);
+	if (bytes > (int)sizeof(nlen)) {
+		bytes -= sizeof(nlen);
+		debug_info("sent %d bytes", bytes);
+		debug_plist(plist);
+		if ((uint32_t)bytes == length) {
+			res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+		} else {
+			debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
 		}
+	} else {
+		bytes = 0;
 	}
 	if (bytes <= 0) {
 		debug_info("ERROR: sending to device failed.");
@@ -157,10 +165,166 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_bi
 	return internal_plist_send(client, plist, 1);
 }
 
+void plist_framer_init(struct plist_framer *framer, uint32_t max_size)
+{
+	framer->buffer = NULL;
+	framer->capacity = 0;
+	framer->length = 0;
+	framer->max_size = max_size;
+}
+
+void plist_framer_free(struct plist_framer *framer)
+{
+	free(framer->buffer);
+	framer->buffer = NULL;
+	framer->capacity = 0;
+	framer->length = 0;
+}
+
+/**
+ * Discards all buffered data, e.g. after the framing has been lost.
+ */
+void plist_framer_reset(struct plist_framer *framer)
+{
+	framer->length = 0;
+	if (framer->capacity > PLIST_FRAMER_KEEP_SIZE) {
+		plist_framer_free(framer);
+	}
+}
+
+/**
+ * Returns the number of bytes that are missing to complete the packet
+ * currently being decoded, or 0 if a complete packet is buffered.
+ */
+uint32_t plist_framer_wanted(struct plist_framer *framer)
+{
+	uint32_t pktlen = 0;
+
+	if (framer->length < sizeof(pktlen))
+		return sizeof(pktlen) - framer->length;
+
+	memcpy(&pktlen, framer->buffer, sizeof(pktlen));
+	pktlen = be32toh(pktlen);
+	if (pktlen > framer->max_size || framer->length - sizeof(pktlen) >= pktlen)
+		return 0;
+
+	return pktlen - (framer->length - sizeof(pktlen));
+}
+
+/**
+ * Makes room for size more bytes in the buffer of the framer.
+ *
+ * @return A pointer to where the data has to be written, to be followed
+ *     by a call to plist_framer_commit(), or NULL when out of memory.
+ */
+char *plist_framer_reserve(struct plist_framer *framer, uint32_t size)
+{
+	uint64_t needed = (uint64_t)framer->length + size;
+
+	if (needed > framer->capacity) {
+		uint64_t newcap = (framer->capacity > 0) ? (uint64_t)framer->capacity * 2 : 4096;
+		char *newbuf = NULL;
+		if (newcap < needed)
+			newcap = needed;
+		if (newcap > (uint64_t)framer->max_size + sizeof(uint32_t))
+			newcap = needed;
+		if (newcap > UINT32_MAX)
+			return NULL;
+		newbuf = (char*)realloc(framer->buffer, (size_t)newcap);
+		if (!newbuf) {
+			debug_info("out of memory when allocating %llu bytes", (unsigned long long)newcap);
+			return NULL;
+		}
+		framer->buffer = newbuf;
+		framer->capacity = (uint32_t)newcap;
+	}
+
+	return framer->buffer + framer->length;
+}
+
+/**
+ * Marks size bytes written to the pointer returned by plist_framer_reserve()
+ * as part of the buffered data.
+ */
+void plist_framer_commit(struct plist_framer *framer, uint32_t size)
+{
+	framer->length += size;
+}
+
+/**
+ * Decodes the next complete plist packet buffered in the framer.
+ *
+ * @param framer The framer to decode from.
+ * @param plist Pointer to a plist_t that will point to the decoded plist
+ *      upon successful return.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when no complete packet is
+ *      buffered yet, PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the packet
+ *      cannot be converted to a plist, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when the packet exceeds the maximum size.
+ */
+property_list_service_error_t plist_framer_next(struct plist_framer *framer, plist_t *plist)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+	uint32_t pktlen = 0;
+	uint32_t remaining = 0;
+	uint32_t i;
+	char *content = NULL;
+
+	*plist = NULL;
+
+	if (framer->length < sizeof(pktlen))
+		return PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA;
+
+	memcpy(&pktlen, framer->buffer, sizeof(pktlen));
+	pktlen = be32toh(pktlen);
+	if (pktlen > framer->max_size) { /* prevent huge buffers */
+		debug_info("packet size %u exceeds maximum of %u bytes", pktlen, framer->max_size);
+		return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	}
+	if (framer->length - sizeof(pktlen) < pktlen)
+		return PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA;
+
+	debug_info("%d bytes following", pktlen);
+	content = framer->buffer + sizeof(pktlen);
+	if ((pktlen > 8) && !memcmp(content, "bplist00", 8)) {
+		plist_from_bin(content, pktlen, plist);
+	} else if ((pktlen > 5) && !memcmp(content, "<?xml", 5)) {
+		/* iOS 4.3+ hack: plist data might contain invalid characters, thus we convert those to spaces */
+		for (i = 0; i < pktlen-1; i++) {
+			if ((content[i] >= 0) && (content[i] < 0x20) && (content[i] != 0x09) && (content[i] != 0x0a) && (content[i] != 0x0d))
+				content[i] = 0x20;
+		}
+		plist_from_xml(content, pktlen, plist);
+	} else {
+		debug_info("WARNING: received unexpected non-plist content");
+		debug_buffer(content, pktlen);
+	}
+	if (*plist) {
+		debug_plist(*plist);
+		res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	}
+
+	/* keep whatever follows the packet for the next call */
+	remaining = framer->length - sizeof(pktlen) - pktlen;
+	if (remaining > 0) {
+		memmove(framer->buffer, content + pktlen, remaining);
+		framer->length = remaining;
+	} else {
+		plist_framer_reset(framer);
+	}
+
+	return res;
+}
+
 /**
  * Receives a plist using the given property list service client.
  * Internally used generic plist receive function.
  *
+ * Only the bytes belonging to the packet are read from the connection, as
+ * some protocols send raw data right after a plist.
+ *
  * @param client The property list service client to use for receiving
  * @param plist pointer to a plist_t that will point to the received plist
  *      upon successful return
@@ -176,7 +340,7 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_bi
 static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
 {
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
-	uint32_t pktlen = 0;
+	struct plist_framer *framer = NULL;
 	uint32_t bytes = 0;
 
 	if (!client || (client && !client->parent) || !plist) {
@@ -184,69 +348,40 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 	}
 
 	*plist = NULL;
-	service_error_t serr = service_receive_with_timeout(client->parent, (char*)&pktlen, sizeof(pktlen), &bytes, timeout);
-	if ((serr == SERVICE_E_SUCCESS) && (bytes == 0)) {
-		return PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT;
-	}
-	debug_info("initial read=%i", bytes);
-	if (bytes < 4) {
-		debug_info("initial read failed!");
-		return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
-	} else {
-		pktlen = be32toh(pktlen);
-		if (pktlen < (1 << 24)) { /* prevent huge buffers */
-			uint32_t curlen = 0;
-			char *content = NULL;
-			debug_info("%d bytes following", pktlen);
-			content = (char*)malloc(pktlen);
-			if (!content) {
-				debug_info("out of memory when allocating %d bytes", pktlen);
-				return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
-			}
-
-			while (curlen < pktlen) {
-				service_receive(client->parent, content+curlen, pktlen-curlen, &bytes);
-				if (bytes <= 0) {
-					res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
-					break;
-				}
-				debug_info("received %d bytes", bytes);
-				curlen += bytes;
-			}
-			if (curlen < pktlen) {
-				debug_info("received incomplete packet (%d of %d bytes)", curlen, pktlen);
-				if (curlen > 0) {
-					debug_info("incomplete packet following:");
-					debug_buffer(content, curlen);
-				}
-				free(content);
-				return res;
-			}
-			if ((pktlen > 8) && !memcmp(content, "bplist00", 8)) {
-				plist_from_bin(content, pktlen, plist);
-			} else if ((pktlen > 5) && !memcmp(content, "<?xml", 5)) {
-				/* iOS 4.3+ hack: plist data might contain invalid characters, thus we convert those to spaces */
-				for (bytes = 0; bytes < pktlen-1; bytes++) {
-					if ((content[bytes] >= 0) && (content[bytes] < 0x20) && (content[bytes] != 0x09) && (content[bytes] != 0x0a) && (content[bytes] != 0x0d))
-						content[bytes] = 0x20;
-				}
-				plist_from_xml(content, pktlen, plist);
-			} else {
-				debug_info("WARNING: received unexpected non-plist content");
-				debug_buffer(content, pktlen);
-			}
-			if (*plist) {
-				debug_plist(*plist);
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+	framer = &client->framer;
+	while ((res = plist_framer_next(framer, plist)) == PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA) {
+		uint32_t wanted = plist_framer_wanted(framer);
+		char *buf = plist_framer_reserve(framer, wanted);
+		if (!buf) {
+			plist_framer_reset(framer);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		bytes = 0;
+		if (framer->length == 0) {
+			service_error_t serr = service_receive_with_timeout(client->parent, buf, wanted, &bytes, timeout);
+			if ((serr == SERVICE_E_SUCCESS) && (bytes == 0)) {
+				return PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT;
 			}
-			free(content);
-			content = NULL;
 		} else {
-			res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+			service_receive(client->parent, buf, wanted, &bytes);
 		}
+		if (bytes == 0) {
+			debug_info("received incomplete packet (%d bytes)", framer->length);
+			if (framer->length > 0) {
+				debug_info("incomplete packet following:");
+				debug_buffer(framer->buffer, framer->length);
+			}
+			plist_framer_reset(framer);
+			return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+		}
+		debug_info("received %d bytes", bytes);
+		plist_framer_commit(framer, bytes);
 	}
+	if (res == PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR) {
+		/* the packet is too large, framing can't be recovered */
+		plist_framer_reset(framer);
+	}
+
 	return res;
 }
 
@@ -274,3 +409,55 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_disable
 	return service_to_property_list_service_error(service_disable_ssl(client->parent));
 }
 
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_get_connection(property_list_service_client_t client, idevice_connection_t *connection)
+{
+	if (!client || !client->parent)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	return service_to_property_list_service_error(service_get_connection(client->parent, connection));
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_plist_nonblock(property_list_service_client_t client, plist_t *plist)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	struct plist_framer *framer = NULL;
+	uint32_t bytes = 0;
+
+	if (!client || !client->parent || !client->parent->connection || !plist) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	*plist = NULL;
+	framer = &client->framer;
+	while ((res = plist_framer_next(framer, plist)) == PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA) {
+		uint32_t wanted = plist_framer_wanted(framer);
+		char *buf = plist_framer_reserve(framer, wanted);
+		if (!buf) {
+			plist_framer_reset(framer);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		bytes = 0;
+		idevice_error_t ierr = idevice_connection_receive_nonblock(client->parent->connection, buf, wanted, &bytes);
+		if (ierr == IDEVICE_E_WANT_READ || ierr == IDEVICE_E_WANT_WRITE) {
+			/* partial data stays buffered for the next call */
+			return PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA;
+		}
+		if (ierr != IDEVICE_E_SUCCESS) {
+			plist_framer_reset(framer);
+			return (ierr == IDEVICE_E_SSL_ERROR) ? PROPERTY_LIST_SERVICE_E_SSL_ERROR : PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+		}
+		plist_framer_commit(framer, bytes);
+	}
+	if (res == PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR) {
+		plist_framer_reset(framer);
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_set_max_size(property_list_service_client_t client, uint32_t max_size)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	client->framer.max_size = (max_size > 0) ? max_size : PROPERTY_LIST_SERVICE_DEFAULT_MAX_SIZE;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
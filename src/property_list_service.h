@@ -25,8 +25,30 @@
 #include "libimobiledevice/property_list_service.h"
 #include "service.h"
 
+/* default maximum size of a single received plist packet */
+#define PROPERTY_LIST_SERVICE_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+/* receive buffers up to this size are kept for the next packet */
+#define PLIST_FRAMER_KEEP_SIZE (256 * 1024)
+
+/* incremental decoder for length-prefixed plist packets */
+struct plist_framer {
+	char *buffer;
+	uint32_t capacity;
+	uint32_t length;
+	uint32_t max_size;
+};
+
 struct property_list_service_client_private {
 	service_client_t parent;
+	struct plist_framer framer;
 };
 
+void plist_framer_init(struct plist_framer *framer, uint32_t max_size);
+void plist_framer_free(struct plist_framer *framer);
+void plist_framer_reset(struct plist_framer *framer);
+uint32_t plist_framer_wanted(struct plist_framer *framer);
+char *plist_framer_reserve(struct plist_framer *framer, uint32_t size);
+void plist_framer_commit(struct plist_framer *framer, uint32_t size);
+property_list_service_error_t plist_framer_next(struct plist_framer *framer, plist_t *plist);
+
 #endif
@@ -26,6 +26,7 @@
 
 #include "service.h"
 #include "idevice.h"
+#include "lockdown.h"
 #include "common/debug.h"
 
 /**
@@ -80,15 +81,9 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 {
 	*client = NULL;
 
-	lockdownd_client_t lckd = NULL;
-	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lckd, label)) {
-		debug_info("Could not create a lockdown client.");
-		return SERVICE_E_START_SERVICE_ERROR;
-	}
-
+	/* borrows a pooled lockdownd session if one is available */
 	lockdownd_service_descriptor_t service = NULL;
-	lockdownd_start_service(lckd, service_name, &service);
-	lockdownd_client_free(lckd);
+	lockdownd_start_service_pooled(device, label, service_name, &service);
 
 	if (!service || service->port == 0) {
 		debug_info("Could not start service %s!", service_name);
@@ -149,6 +144,48 @@ LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const
 	return res;
 }
 
+LIBIMOBILEDEVICE_API service_error_t service_send_file(service_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || (fd < 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	debug_info("sending %d bytes from file", length);
+	res = idevice_to_service_error(idevice_connection_send_file(client->connection, fd, offset, length, &bytes));
+	if (bytes == 0 && length > 0) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !iov || (iovcnt == 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	debug_info("sending %d buffers", iovcnt);
+	res = idevice_to_service_error(idevice_connection_sendv(client->connection, iov, iovcnt, &bytes));
+	if (bytes == 0) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client_t client, char* data, uint32_t size, uint32_t *received, unsigned int timeout)
 {
 	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
@@ -188,3 +225,10 @@ LIBIMOBILEDEVICE_API service_error_t service_disable_ssl(service_client_t client
 	return idevice_to_service_error(idevice_connection_disable_ssl(client->connection));
 }
 
+LIBIMOBILEDEVICE_API service_error_t service_get_connection(service_client_t client, idevice_connection_t *connection)
+{
+	if (!client || !client->connection || !connection)
+		return SERVICE_E_INVALID_ARG;
+	*connection = client->connection;
+	return SERVICE_E_SUCCESS;
+}
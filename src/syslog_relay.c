@@ -24,6 +24,7 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "syslog_relay.h"
 #include "lockdown.h"
@@ -32,6 +33,7 @@
 struct syslog_relay_worker_thread {
 	syslog_relay_client_t client;
 	syslog_relay_receive_cb_t cbfunc;
+	syslog_relay_receive_raw_cb_t raw_cbfunc;
 	void *user_data;
 };
 
@@ -114,6 +116,187 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_free(syslog_relay_
 	return err;
 }
 
+static const char *syslog_relay_level_names[] = {
+	"Unknown",
+	"Debug",
+	"Info",
+	"Notice",
+	"Warning",
+	"Error",
+	"Critical",
+	"Alert",
+	"Emergency"
+};
+
+#define SYSLOG_RELAY_NUM_LEVELS (sizeof(syslog_relay_level_names) / sizeof(syslog_relay_level_names[0]))
+
+/* any number of up to 9 digits fits into an int */
+#define SYSLOG_RELAY_MAX_PID_DIGITS 9
+
+LIBIMOBILEDEVICE_API const char *syslog_relay_level_to_string(syslog_relay_level_t level)
+{
+	if ((unsigned int)level >= SYSLOG_RELAY_NUM_LEVELS)
+		level = SYSLOG_RELAY_LEVEL_UNKNOWN;
+	return syslog_relay_level_names[level];
+}
+
+/**
+ * Compares a string of the given length case-insensitively with a NUL
+ * terminated one.
+ */
+static int syslog_relay_strncaseeq(const char *str, uint32_t length, const char *name)
+{
+	uint32_t i;
+	for (i = 0; i < length; i++) {
+		if (name[i] == '\0' || tolower((unsigned char)str[i]) != tolower((unsigned char)name[i]))
+			return 0;
+	}
+	return (name[length] == '\0');
+}
+
+static syslog_relay_level_t syslog_relay_level_from_field(const char *str, uint32_t length)
+{
+	unsigned int i;
+	for (i = 1; i < SYSLOG_RELAY_NUM_LEVELS; i++) {
+		if (syslog_relay_strncaseeq(str, length, syslog_relay_level_names[i]))
+			return (syslog_relay_level_t)i;
+	}
+	return SYSLOG_RELAY_LEVEL_UNKNOWN;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_level_t syslog_relay_level_from_string(const char *name)
+{
+	if (!name)
+		return SYSLOG_RELAY_LEVEL_UNKNOWN;
+	return syslog_relay_level_from_field(name, strlen(name));
+}
+
+/**
+ * Splits the syslog header off a line without its trailing newline.
+ * The record may be left partially filled if parsing fails.
+ */
+static syslog_relay_error_t syslog_relay_parse_header(const char *line, uint32_t length, syslog_relay_record_t *record)
+{
+	const char *end = line + length;
+	const char *p = NULL;
+	const char *hdr_end = NULL;
+	const char *sender_end = NULL;
+
+	/* timestamp, "Mmm dd hh:mm:ss" */
+	if (length < 17 || line[3] != ' ' || line[6] != ' ' || line[9] != ':' || line[12] != ':' || line[15] != ' ')
+		return SYSLOG_RELAY_E_PARSE_ERROR;
+
+	/* device name */
+	p = line + 16;
+	hdr_end = p;
+	while (hdr_end < end && *hdr_end != ' ')
+		hdr_end++;
+	if (hdr_end == p || hdr_end >= end)
+		return SYSLOG_RELAY_E_PARSE_ERROR;
+	record->device_name.data = p;
+	record->device_name.length = hdr_end - p;
+	p = hdr_end + 1;
+
+	/* the sender part ends at the first ": " */
+	for (hdr_end = p; hdr_end + 1 < end; hdr_end++) {
+		if (hdr_end[0] == ':' && hdr_end[1] == ' ')
+			break;
+	}
+	if (hdr_end + 1 >= end) {
+		if (hdr_end < end && *hdr_end == ':') {
+			/* empty message */
+		} else {
+			return SYSLOG_RELAY_E_PARSE_ERROR;
+		}
+	}
+
+	sender_end = hdr_end;
+
+	/* optional level, " <Notice>" */
+	if (sender_end > p && sender_end[-1] == '>') {
+		const char *lvl = sender_end - 1;
+		while (lvl > p && *lvl != '<')
+			lvl--;
+		if (*lvl == '<' && lvl > p && lvl[-1] == ' ') {
+			record->level = syslog_relay_level_from_field(lvl + 1, (sender_end - 1) - (lvl + 1));
+			sender_end = lvl - 1;
+		}
+	}
+
+	/* optional pid, "[123]" */
+	if (sender_end > p && sender_end[-1] == ']') {
+		const char *bracket = sender_end - 1;
+		while (bracket > p && *bracket != '[')
+			bracket--;
+		if (*bracket == '[') {
+			const char *digit;
+			int pid = 0;
+			if ((sender_end - 1) - (bracket + 1) > SYSLOG_RELAY_MAX_PID_DIGITS)
+				return SYSLOG_RELAY_E_PARSE_ERROR;
+			for (digit = bracket + 1; digit < sender_end - 1; digit++) {
+				if (*digit < '0' || *digit > '9')
+					return SYSLOG_RELAY_E_PARSE_ERROR;
+				pid = pid * 10 + (*digit - '0');
+			}
+			record->pid = pid;
+			sender_end = bracket;
+		}
+	}
+
+	/* optional image, "(libfoo.dylib)" */
+	if (sender_end > p && sender_end[-1] == ')') {
+		const char *paren = sender_end - 1;
+		while (paren > p && *paren != '(')
+			paren--;
+		if (*paren == '(' && paren > p) {
+			record->image.data = paren + 1;
+			record->image.length = (sender_end - 1) - (paren + 1);
+			sender_end = paren;
+		}
+	}
+
+	if (sender_end <= p)
+		return SYSLOG_RELAY_E_PARSE_ERROR;
+
+	record->timestamp.data = line;
+	record->timestamp.length = 15;
+	record->process.data = p;
+	record->process.length = sender_end - p;
+
+	p = hdr_end + 1;
+	if (p < end && *p == ' ')
+		p++;
+	record->message.data = p;
+	record->message.length = (p < end) ? end - p : 0;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_parse_line(const char *line, uint32_t length, syslog_relay_record_t *record)
+{
+	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+
+	if (!line || !record)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+		length--;
+
+	memset(record, '\0', sizeof(syslog_relay_record_t));
+	record->pid = -1;
+
+	res = syslog_relay_parse_header(line, length, record);
+	if (res != SYSLOG_RELAY_E_SUCCESS) {
+		/* don't leave any parts of a partially parsed header behind */
+		memset(record, '\0', sizeof(syslog_relay_record_t));
+		record->pid = -1;
+		record->message.data = line;
+		record->message.length = length;
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive(syslog_relay_client_t client, char* data, uint32_t size, uint32_t *received)
 {
 	return syslog_relay_receive_with_timeout(client, data, size, received, 1000);
@@ -139,45 +322,124 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive_with_timeout(sysl
 	return res;
 }
 
+/**
+ * Removes the NUL bytes separating the syslog messages from the given data.
+ *
+ * @return The length of the remaining data.
+ */
+static uint32_t syslog_relay_strip_nul(char *data, uint32_t length)
+{
+	char *end = data + length;
+	char *dst = (char*)memchr(data, '\0', length);
+	char *src = dst;
+
+	if (!dst)
+		return length;
+
+	while (src < end) {
+		char *nul;
+		/* skip a run of NUL bytes, then move everything up to the next one */
+		while (src < end && *src == '\0')
+			src++;
+		nul = (char*)memchr(src, '\0', end - src);
+		if (!nul)
+			nul = end;
+		memmove(dst, src, nul - src);
+		dst += nul - src;
+		src = nul;
+	}
+
+	return dst - data;
+}
+
+/**
+ * Passes a block of syslog data to the callback of the capture worker.
+ */
+static void syslog_relay_deliver(struct syslog_relay_worker_thread *srwt, const char *data, uint32_t length)
+{
+	uint32_t i;
+
+	if (srwt->raw_cbfunc) {
+		srwt->raw_cbfunc(data, length, srwt->user_data);
+		return;
+	}
+
+	/* compatibility with the per-character callback */
+	for (i = 0; i < length; i++) {
+		srwt->cbfunc(data[i], srwt->user_data);
+	}
+}
+
 void *syslog_relay_worker(void *arg)
 {
 	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	char *buf = NULL;
+	uint32_t len = 0;
 
 	if (!srwt)
 		return NULL;
 
+	buf = (char*)malloc(SYSLOG_RELAY_CAPTURE_BUFFER_SIZE);
+	if (!buf) {
+		debug_info("Out of memory");
+		free(srwt);
+		return NULL;
+	}
+
 	debug_info("Running");
 
 	while (srwt->client->parent) {
-		char c;
 		uint32_t bytes = 0;
-		ret = syslog_relay_receive_with_timeout(srwt->client, &c, 1, &bytes, 100);
+		uint32_t i;
+		ret = syslog_relay_receive_with_timeout(srwt->client, buf + len, SYSLOG_RELAY_CAPTURE_BUFFER_SIZE - len, &bytes, 100);
 		if ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS)) {
 			continue;
 		} else if (ret < 0) {
 			debug_info("Connection to syslog relay interrupted");
 			break;
 		}
-		if(c != 0) {
-			srwt->cbfunc(c, srwt->user_data);
+
+		len += syslog_relay_strip_nul(buf + len, bytes);
+
+		if (srwt->raw_cbfunc) {
+			/* deliver all complete lines at once, keep the rest for later
+			 * unless a single line fills the whole buffer */
+			for (i = len; i > 0; i--) {
+				if (buf[i-1] == '\n')
+					break;
+			}
+			if (i == 0 && len == SYSLOG_RELAY_CAPTURE_BUFFER_SIZE) {
+				i = len;
+			}
+		} else {
+			/* the per-character callback gets every byte right away */
+			i = len;
+		}
+		if (i > 0) {
+			syslog_relay_deliver(srwt, buf, i);
+			memmove(buf, buf + i, len - i);
+			len -= i;
 		}
 	}
 
-	if (srwt) {
-		free(srwt);
+	if (len > 0) {
+		syslog_relay_deliver(srwt, buf, len);
 	}
 
+	free(buf);
+	free(srwt);
+
 	debug_info("Exiting");
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+/**
+ * Starts the capture worker thread with either of the given callbacks.
+ */
+static syslog_relay_error_t syslog_relay_start_capture_internal(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, syslog_relay_receive_raw_cb_t raw_callback, void* user_data)
 {
-	if (!client || !callback)
-		return SYSLOG_RELAY_E_INVALID_ARG;
-
 	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 
 	if (client->worker) {
@@ -190,16 +452,35 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 	if (srwt) {
 		srwt->client = client;
 		srwt->cbfunc = callback;
+		srwt->raw_cbfunc = raw_callback;
 		srwt->user_data = user_data;
 
 		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
 			res = SYSLOG_RELAY_E_SUCCESS;
+		} else {
+			free(srwt);
 		}
 	}
 
 	return res;
 }
 
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_capture_internal(client, callback, NULL, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_raw_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_capture_internal(client, NULL, callback, user_data);
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
 {
 	if (client->worker) {
@@ -26,6 +26,9 @@
 #include "service.h"
 #include "common/thread.h"
 
+/* size of the buffer the capture worker reads syslog data into */
+#define SYSLOG_RELAY_CAPTURE_BUFFER_SIZE 65536
+
 struct syslog_relay_client_private {
 	service_client_t parent;
 	thread_t worker;
@@ -0,0 +1,423 @@
+/*
+ * afc_latency_bench.c
+ * Measures AFC file reads against a stand-in with configurable latency
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * A file is read once with afc_file_read() and once with
+ * afc_file_read_pipelined() for each depth. The stand-in answers every
+ * request only after the configured latency has passed since it arrived,
+ * but keeps reading further requests meanwhile, like a device behind a
+ * slow link would.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+
+#include "endianness.h"
+#include "standin.h"
+#include "common/thread.h"
+
+#define AFC_STANDIN_PORT 1001
+
+/* the parts of the AFC protocol the stand-in speaks */
+#define AFC_MAGIC "CFA6LPAA"
+#define AFC_OP_STATUS 0x01
+#define AFC_OP_DATA 0x02
+#define AFC_OP_FILE_OPEN 0x0D
+#define AFC_OP_FILE_OPEN_RES 0x0E
+#define AFC_OP_FILE_READ 0x0F
+#define AFC_OP_FILE_CLOSE 0x14
+#define AFC_E_OP_NOT_SUPPORTED_CODE 15
+
+/* the chunk size of the afc_file_read() loop */
+#define READ_CHUNK_SIZE 65536
+
+typedef struct {
+	char magic[8];
+	uint64_t entire_length, this_length, packet_num, operation;
+} afc_standin_header_t;
+
+/** A reply waiting for its latency to pass. */
+struct afc_standin_reply {
+	double due;
+	char *data;
+	uint32_t length;
+	struct afc_standin_reply *next;
+};
+
+struct afc_standin {
+	int fd;
+	double latency;
+	uint64_t file_size;
+	uint64_t position;
+	mutex_t mutex;
+	cond_t cond;
+	struct afc_standin_reply *head;
+	struct afc_standin_reply *tail;
+	int done;
+};
+
+static double latency_ms = 1.0;
+static uint64_t file_size = 32 * 1024 * 1024;
+
+static unsigned char content_byte(uint64_t offset)
+{
+	return (unsigned char)(offset % 251);
+}
+
+static void afc_standin_queue(struct afc_standin *afc, uint64_t packet_num, uint64_t operation, const char *payload, uint64_t payload_length, double received)
+{
+	struct afc_standin_reply *reply = NULL;
+	afc_standin_header_t hdr;
+
+	reply = (struct afc_standin_reply*)malloc(sizeof(struct afc_standin_reply));
+	if (!reply)
+		return;
+	reply->length = (uint32_t)(sizeof(hdr) + payload_length);
+	reply->data = (char*)malloc(reply->length);
+	if (!reply->data) {
+		free(reply);
+		return;
+	}
+	memcpy(hdr.magic, AFC_MAGIC, sizeof(hdr.magic));
+	hdr.entire_length = htole64(reply->length);
+	/* like the device, only count the data of a data reply as payload */
+	hdr.this_length = htole64((operation == AFC_OP_DATA) ? sizeof(hdr) : reply->length);
+	hdr.packet_num = htole64(packet_num);
+	hdr.operation = htole64(operation);
+	memcpy(reply->data, &hdr, sizeof(hdr));
+	if (payload_length > 0)
+		memcpy(reply->data + sizeof(hdr), payload, payload_length);
+	reply->due = received + afc->latency;
+	reply->next = NULL;
+
+	mutex_lock(&afc->mutex);
+	if (afc->tail) {
+		afc->tail->next = reply;
+	} else {
+		afc->head = reply;
+	}
+	afc->tail = reply;
+	cond_signal(&afc->cond);
+	mutex_unlock(&afc->mutex);
+}
+
+static void afc_standin_status(struct afc_standin *afc, uint64_t packet_num, uint64_t status, double received)
+{
+	uint64_t code = htole64(status);
+	afc_standin_queue(afc, packet_num, AFC_OP_STATUS, (const char*)&code, sizeof(code), received);
+}
+
+/** Sends the queued replies once they are due. */
+static void *afc_standin_writer(void *arg)
+{
+	struct afc_standin *afc = (struct afc_standin*)arg;
+
+	while (1) {
+		struct afc_standin_reply *reply = NULL;
+		double now;
+
+		mutex_lock(&afc->mutex);
+		while (!afc->head && !afc->done) {
+			cond_wait(&afc->cond, &afc->mutex);
+		}
+		reply = afc->head;
+		if (reply) {
+			afc->head = reply->next;
+			if (!afc->head)
+				afc->tail = NULL;
+		}
+		mutex_unlock(&afc->mutex);
+		if (!reply)
+			break;
+
+		now = standin_time();
+		if (reply->due > now) {
+			struct timespec ts;
+			double wait = reply->due - now;
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+			nanosleep(&ts, NULL);
+		}
+		standin_write(afc->fd, reply->data, reply->length);
+		free(reply->data);
+		free(reply);
+	}
+
+	return NULL;
+}
+
+/**
+ * Plays an AFC service with a single file of file_size bytes, which is
+ * opened whatever path is asked for.
+ */
+static void afc_standin(int fd, void *user_data)
+{
+	struct afc_standin afc;
+	thread_t writer;
+	char *buf = NULL;
+	uint32_t buf_size = 0;
+
+	memset(&afc, '\0', sizeof(afc));
+	afc.fd = fd;
+	afc.latency = latency_ms / 1000.0;
+	afc.file_size = file_size;
+	mutex_init(&afc.mutex);
+	cond_init(&afc.cond);
+
+	if (thread_new(&writer, afc_standin_writer, &afc) != 0) {
+		close(fd);
+		return;
+	}
+
+	while (1) {
+		afc_standin_header_t hdr;
+		uint64_t length;
+		double received;
+
+		if (standin_read(fd, &hdr, sizeof(hdr)) < 0)
+			break;
+		received = standin_time();
+		length = le64toh(hdr.entire_length);
+		if (memcmp(hdr.magic, AFC_MAGIC, sizeof(hdr.magic)) != 0 || length < sizeof(hdr) || length - sizeof(hdr) > 0x10000)
+			break;
+		length -= sizeof(hdr);
+		if (length > buf_size) {
+			char *newbuf = (char*)realloc(buf, length);
+			if (!newbuf)
+				break;
+			buf = newbuf;
+			buf_size = (uint32_t)length;
+		}
+		if (length > 0 && standin_read(fd, buf, (uint32_t)length) < 0)
+			break;
+		hdr.packet_num = le64toh(hdr.packet_num);
+
+		switch (le64toh(hdr.operation)) {
+		case AFC_OP_FILE_OPEN: {
+			uint64_t handle = htole64(1);
+			afc.position = 0;
+			afc_standin_queue(&afc, hdr.packet_num, AFC_OP_FILE_OPEN_RES, (const char*)&handle, sizeof(handle), received);
+			break;
+		}
+		case AFC_OP_FILE_READ: {
+			uint64_t size = 0;
+			uint64_t available = afc.file_size - afc.position;
+			char *data = NULL;
+			uint64_t i;
+			if (length >= 16) {
+				memcpy(&size, buf + 8, sizeof(size));
+				size = le64toh(size);
+			}
+			if (size > available)
+				size = available;
+			data = (char*)malloc(size + 1);
+			if (!data) {
+				afc_standin_status(&afc, hdr.packet_num, AFC_E_OP_NOT_SUPPORTED_CODE, received);
+				break;
+			}
+			for (i = 0; i < size; i++) {
+				data[i] = (char)content_byte(afc.position + i);
+			}
+			afc.position += size;
+			afc_standin_queue(&afc, hdr.packet_num, AFC_OP_DATA, data, size, received);
+			free(data);
+			break;
+		}
+		case AFC_OP_FILE_CLOSE:
+			afc_standin_status(&afc, hdr.packet_num, 0, received);
+			break;
+		default:
+			afc_standin_status(&afc, hdr.packet_num, AFC_E_OP_NOT_SUPPORTED_CODE, received);
+			break;
+		}
+	}
+
+	mutex_lock(&afc.mutex);
+	afc.done = 1;
+	cond_signal(&afc.cond);
+	mutex_unlock(&afc.mutex);
+	thread_join(writer);
+	thread_free(writer);
+
+	while (afc.head) {
+		struct afc_standin_reply *next = afc.head->next;
+		free(afc.head->data);
+		free(afc.head);
+		afc.head = next;
+	}
+	cond_destroy(&afc.cond);
+	mutex_destroy(&afc.mutex);
+	free(buf);
+	close(fd);
+}
+
+struct read_check {
+	uint64_t offset;
+	int corrupt;
+};
+
+static int read_check_cb(const char *data, uint32_t length, void *user_data)
+{
+	struct read_check *check = (struct read_check*)user_data;
+	uint32_t i;
+
+	for (i = 0; i < length; i++) {
+		if ((unsigned char)data[i] != content_byte(check->offset + i)) {
+			check->corrupt = 1;
+			return 1;
+		}
+	}
+	check->offset += length;
+
+	return 0;
+}
+
+/**
+ * Reads the whole file over a new stand-in connection and returns the time
+ * it took in seconds, or a negative value on error. A depth of 0 uses the
+ * afc_file_read() loop.
+ */
+static double run(uint32_t depth)
+{
+	struct lockdownd_service_descriptor service;
+	struct read_check check;
+	idevice_t device = NULL;
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	afc_error_t err = AFC_E_SUCCESS;
+	double start = 0;
+	double elapsed = -1;
+
+	standin_set_service(AFC_STANDIN_PORT, afc_standin, NULL);
+
+	if (idevice_new(&device, STANDIN_UDID) != IDEVICE_E_SUCCESS)
+		return -1;
+	service.port = AFC_STANDIN_PORT;
+	service.ssl_enabled = 0;
+	if (afc_client_new(device, &service, &afc) != AFC_E_SUCCESS) {
+		idevice_free(device);
+		return -1;
+	}
+
+	memset(&check, '\0', sizeof(check));
+	start = standin_time();
+	err = afc_file_open(afc, "/bench.bin", AFC_FOPEN_RDONLY, &handle);
+	if (err == AFC_E_SUCCESS) {
+		if (depth == 0) {
+			char *buf = (char*)malloc(READ_CHUNK_SIZE);
+			uint32_t bytes = 0;
+			if (!buf) {
+				err = AFC_E_NO_MEM;
+			}
+			while (err == AFC_E_SUCCESS && check.offset < file_size) {
+				err = afc_file_read(afc, handle, buf, READ_CHUNK_SIZE, &bytes);
+				if (err != AFC_E_SUCCESS || bytes == 0)
+					break;
+				read_check_cb(buf, bytes, &check);
+			}
+			free(buf);
+		} else {
+			err = afc_file_read_pipelined(afc, handle, read_check_cb, &check, depth);
+		}
+		afc_file_close(afc, handle);
+	}
+	if (err == AFC_E_SUCCESS && !check.corrupt && check.offset == file_size) {
+		elapsed = standin_time() - start;
+	} else {
+		fprintf(stderr, "ERROR: read %llu of %llu bytes (error %d%s)\n", (unsigned long long)check.offset, (unsigned long long)file_size, err, (check.corrupt) ? ", corrupt data" : "");
+	}
+
+	afc_client_free(afc);
+	idevice_free(device);
+	standin_wait();
+
+	return elapsed;
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	printf("Measure AFC file reads against a stand-in with configurable latency.\n\n");
+	printf("  -l, --latency MS\tdelay of every reply in milliseconds (default: 1)\n");
+	printf("  -s, --size MB\t\tsize of the file to read (default: 32)\n");
+	printf("  -d, --depth N\t\tonly measure this pipeline depth\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const uint32_t depths[] = { 0, 1, 2, 4, 8, 16, 32 };
+	uint32_t only_depth = 0;
+	int size_mb = 32;
+	unsigned int i;
+
+	for (i = 1; i < (unsigned int)argc; i++) {
+		if ((!strcmp(argv[i], "-l") || !strcmp(argv[i], "--latency")) && i + 1 < (unsigned int)argc) {
+			latency_ms = atof(argv[++i]);
+		} else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) && i + 1 < (unsigned int)argc) {
+			size_mb = atoi(argv[++i]);
+		} else if ((!strcmp(argv[i], "-d") || !strcmp(argv[i], "--depth")) && i + 1 < (unsigned int)argc) {
+			only_depth = (uint32_t)atoi(argv[++i]);
+		} else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+	if (latency_ms < 0 || size_mb <= 0) {
+		print_usage(argc, argv);
+		return 1;
+	}
+	file_size = (uint64_t)size_mb * 1024 * 1024;
+
+	printf("%d MB file, %.2f ms latency\n", size_mb, latency_ms);
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		double elapsed;
+		if (only_depth > 0 && depths[i] != 0 && depths[i] != only_depth)
+			continue;
+		elapsed = run(depths[i]);
+		if (elapsed < 0)
+			return 1;
+		if (depths[i] == 0) {
+			printf("%-30s %10.1f MB/s\n", "afc_file_read", size_mb / elapsed);
+		} else {
+			char label[64];
+			snprintf(label, sizeof(label), "afc_file_read_pipelined(%u)", depths[i]);
+			printf("%-30s %10.1f MB/s\n", label, size_mb / elapsed);
+		}
+	}
+
+	return 0;
+}
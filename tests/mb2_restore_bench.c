@@ -0,0 +1,418 @@
+/*
+ * mb2_restore_bench.c
+ * Measures the throughput of sending restore files over mobilebackup2
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The files are sent the way idevicebackup2 answers DLMessageDownloadFiles
+ * during a restore, once with the buffered reads used before and once with
+ * mobilebackup2_send_raw_file(), to a stand-in that parses the stream like
+ * the device does.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/mobilebackup2.h>
+#include <plist/plist.h>
+
+#include "standin.h"
+
+#define MB2_STANDIN_PORT 1002
+
+#define CODE_SUCCESS 0x00
+#define CODE_ERROR_LOCAL 0x06
+#define CODE_FILE_DATA 0x0c
+
+/* chunk sizes of the buffered and of the sendfile() path of idevicebackup2 */
+#define BUFFERED_CHUNK_SIZE 32768
+#define SEND_FILE_CHUNK_SIZE (1024 * 1024)
+
+struct mb2_standin_result {
+	uint64_t files;
+	uint64_t bytes;
+	int failed;
+	double end;
+};
+
+static int mb2_standin_send_plist(int fd, plist_t plist)
+{
+	char *data = NULL;
+	uint32_t length = 0;
+	uint32_t nlen;
+	int res;
+
+	plist_to_bin(plist, &data, &length);
+	plist_free(plist);
+	if (!data)
+		return -1;
+	nlen = htonl(length);
+	res = standin_write(fd, &nlen, sizeof(nlen));
+	if (res == 0)
+		res = standin_write(fd, data, length);
+	free(data);
+
+	return res;
+}
+
+static plist_t mb2_standin_receive_plist(int fd)
+{
+	plist_t plist = NULL;
+	char *data = NULL;
+	uint32_t length = 0;
+
+	if (standin_read(fd, &length, sizeof(length)) < 0)
+		return NULL;
+	length = ntohl(length);
+	data = (char*)malloc(length);
+	if (!data)
+		return NULL;
+	if (standin_read(fd, data, length) == 0) {
+		plist_from_bin(data, length, &plist);
+	}
+	free(data);
+
+	return plist;
+}
+
+/**
+ * Plays the device: performs the DeviceLink version exchange, then consumes
+ * uploaded files until the terminating empty file name arrives.
+ */
+static void mb2_standin(int fd, void *user_data)
+{
+	struct mb2_standin_result *result = (struct mb2_standin_result*)user_data;
+	char *chunk = NULL;
+	plist_t msg = NULL;
+
+	msg = plist_new_array();
+	plist_array_append_item(msg, plist_new_string("DLMessageVersionExchange"));
+	plist_array_append_item(msg, plist_new_uint(300));
+	plist_array_append_item(msg, plist_new_uint(0));
+	if (mb2_standin_send_plist(fd, msg) < 0)
+		goto leave;
+	msg = mb2_standin_receive_plist(fd);
+	if (!msg)
+		goto leave;
+	plist_free(msg);
+	msg = plist_new_array();
+	plist_array_append_item(msg, plist_new_string("DLMessageDeviceReady"));
+	if (mb2_standin_send_plist(fd, msg) < 0)
+		goto leave;
+
+	chunk = (char*)malloc(SEND_FILE_CHUNK_SIZE);
+	if (!chunk)
+		goto leave;
+
+	while (1) {
+		uint32_t nlen = 0;
+		uint32_t length = 0;
+		uint8_t code = 0;
+
+		/* file name */
+		if (standin_read(fd, &nlen, sizeof(nlen)) < 0)
+			goto leave;
+		nlen = ntohl(nlen);
+		if (nlen == 0)
+			break;
+		if (nlen > SEND_FILE_CHUNK_SIZE || standin_read(fd, chunk, nlen) < 0)
+			goto leave;
+
+		/* data chunks until the status of the file */
+		do {
+			if (standin_read(fd, &length, sizeof(length)) < 0 || standin_read(fd, &code, 1) < 0)
+				goto leave;
+			length = ntohl(length);
+			if (length == 0 || length - 1 > SEND_FILE_CHUNK_SIZE)
+				goto leave;
+			if (standin_read(fd, chunk, length - 1) < 0)
+				goto leave;
+			if (code == CODE_FILE_DATA) {
+				result->bytes += length - 1;
+			} else if (code != CODE_SUCCESS) {
+				result->failed++;
+			}
+		} while (code == CODE_FILE_DATA);
+		result->files++;
+	}
+	result->end = standin_time();
+
+	/* wait for the DLMessageDisconnect of mobilebackup2_client_free() */
+	msg = mb2_standin_receive_plist(fd);
+	plist_free(msg);
+
+leave:
+	free(chunk);
+	close(fd);
+}
+
+static int send_file_buffered(mobilebackup2_client_t mb2, int fd)
+{
+	char buf[BUFFERED_CHUNK_SIZE];
+	char hdr[5];
+	uint32_t bytes = 0;
+	uint32_t nlen;
+	ssize_t r;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		nlen = htonl((uint32_t)r + 1);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_FILE_DATA;
+		if (mobilebackup2_send_raw(mb2, hdr, 5, &bytes) != MOBILEBACKUP2_E_SUCCESS || bytes != 5)
+			return -1;
+		if (mobilebackup2_send_raw(mb2, buf, (uint32_t)r, &bytes) != MOBILEBACKUP2_E_SUCCESS || bytes != (uint32_t)r)
+			return -1;
+	}
+
+	return (r < 0) ? -1 : 0;
+}
+
+static int send_file_direct(mobilebackup2_client_t mb2, int fd, uint64_t total)
+{
+	char hdr[5];
+	uint32_t bytes = 0;
+	uint32_t nlen;
+	uint64_t sent = 0;
+
+	while (sent < total) {
+		uint32_t length = (total - sent < SEND_FILE_CHUNK_SIZE) ? (uint32_t)(total - sent) : SEND_FILE_CHUNK_SIZE;
+		nlen = htonl(length + 1);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_FILE_DATA;
+		if (mobilebackup2_send_raw(mb2, hdr, 5, &bytes) != MOBILEBACKUP2_E_SUCCESS || bytes != 5)
+			return -1;
+		if (mobilebackup2_send_raw_file(mb2, fd, sent, length, &bytes) != MOBILEBACKUP2_E_SUCCESS || bytes != length)
+			return -1;
+		sent += length;
+	}
+
+	return 0;
+}
+
+/**
+ * Sends all files to a new stand-in connection and returns the achieved
+ * throughput in MB/s, or a negative value on error.
+ */
+static double run(const char *dir, int count, uint64_t size, int direct)
+{
+	struct mb2_standin_result result;
+	struct lockdownd_service_descriptor service;
+	idevice_t device = NULL;
+	mobilebackup2_client_t mb2 = NULL;
+	char path[512];
+	char name[32];
+	char hdr[5];
+	uint32_t bytes = 0;
+	uint32_t nlen;
+	double start;
+	int failed = 0;
+	int i;
+
+	memset(&result, '\0', sizeof(result));
+	standin_set_service(MB2_STANDIN_PORT, mb2_standin, &result);
+
+	if (idevice_new(&device, STANDIN_UDID) != IDEVICE_E_SUCCESS)
+		return -1;
+	service.port = MB2_STANDIN_PORT;
+	service.ssl_enabled = 0;
+	if (mobilebackup2_client_new(device, &service, &mb2) != MOBILEBACKUP2_E_SUCCESS) {
+		idevice_free(device);
+		standin_wait();
+		return -1;
+	}
+
+	start = standin_time();
+	for (i = 0; i < count && !failed; i++) {
+		idevice_iovec_t iov[2];
+		int fd;
+
+		snprintf(name, sizeof(name), "file%d", i);
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		nlen = htonl((uint32_t)strlen(name));
+		iov[0].data = (const char*)&nlen;
+		iov[0].length = sizeof(nlen);
+		iov[1].data = name;
+		iov[1].length = (uint32_t)strlen(name);
+		if (mobilebackup2_send_rawv(mb2, iov, 2, &bytes) != MOBILEBACKUP2_E_SUCCESS) {
+			failed = 1;
+			break;
+		}
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			failed = 1;
+			break;
+		}
+		failed = (direct) ? send_file_direct(mb2, fd, size) : send_file_buffered(mb2, fd);
+		close(fd);
+
+		nlen = htonl(1);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_SUCCESS;
+		mobilebackup2_send_raw(mb2, hdr, 5, &bytes);
+	}
+	nlen = 0;
+	mobilebackup2_send_raw(mb2, (const char*)&nlen, sizeof(nlen), &bytes);
+
+	mobilebackup2_client_free(mb2);
+	idevice_free(device);
+	standin_wait();
+
+	if (failed || result.failed || result.files != (uint64_t)count || result.bytes != size * count) {
+		fprintf(stderr, "ERROR: stand-in received %llu of %d files, %llu of %llu bytes\n", (unsigned long long)result.files, count, (unsigned long long)result.bytes, (unsigned long long)(size * count));
+		return -1;
+	}
+
+	return (double)result.bytes / (1024 * 1024) / (result.end - start);
+}
+
+static int create_files(const char *dir, int count, uint64_t size)
+{
+	char path[512];
+	char *buf = NULL;
+	int i;
+
+	buf = (char*)malloc(SEND_FILE_CHUNK_SIZE);
+	if (!buf)
+		return -1;
+	for (i = 0; i < SEND_FILE_CHUNK_SIZE; i++) {
+		buf[i] = (char)(i * 31 + 7);
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t written = 0;
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		f = fopen(path, "wb");
+		if (!f) {
+			free(buf);
+			return -1;
+		}
+		while (written < size) {
+			size_t length = (size - written < SEND_FILE_CHUNK_SIZE) ? (size_t)(size - written) : SEND_FILE_CHUNK_SIZE;
+			if (fwrite(buf, 1, length, f) != length)
+				break;
+			written += length;
+		}
+		if (fclose(f) != 0 || written < size) {
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
+static void remove_files(const char *dir, int count)
+{
+	char path[512];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		remove(path);
+	}
+	rmdir(dir);
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	printf("Measure the throughput of sending restore files to a mobilebackup2 stand-in.\n\n");
+	printf("  -n, --count N\t\tnumber of files to send (default: 16)\n");
+	printf("  -s, --size MB\t\tsize of each file (default: 16)\n");
+	printf("  -r, --runs N\t\tnumber of runs per mode, the best one counts (default: 3)\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/mb2_restore_bench.XXXXXX";
+	int count = 16;
+	int size_mb = 16;
+	int runs = 3;
+	int mode;
+	int res = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--count")) && i + 1 < argc) {
+			count = atoi(argv[++i]);
+		} else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) && i + 1 < argc) {
+			size_mb = atoi(argv[++i]);
+		} else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--runs")) && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+	if (count <= 0 || size_mb <= 0 || runs <= 0) {
+		print_usage(argc, argv);
+		return 1;
+	}
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "ERROR: Could not create temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+	if (create_files(dir, count, (uint64_t)size_mb * 1024 * 1024) < 0) {
+		fprintf(stderr, "ERROR: Could not create the files to send\n");
+		remove_files(dir, count);
+		return 1;
+	}
+
+	printf("%d files of %d MB\n", count, size_mb);
+	for (mode = 0; mode < 2 && res == 0; mode++) {
+		double best = 0;
+		for (i = 0; i < runs; i++) {
+			double mbps = run(dir, count, (uint64_t)size_mb * 1024 * 1024, mode);
+			if (mbps < 0) {
+				res = 1;
+				break;
+			}
+			if (mbps > best)
+				best = mbps;
+		}
+		if (res == 0) {
+			printf("%-30s %10.1f MB/s\n", (mode) ? "mobilebackup2_send_raw_file" : "read + mobilebackup2_send_raw", best);
+		}
+	}
+
+	remove_files(dir, count);
+
+	return res;
+}
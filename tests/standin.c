@@ -0,0 +1,259 @@
+/*
+ * standin.c
+ * Local stand-ins for device services, used by the benchmarks
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The library reaches a device through the connection functions of
+ * libusbmuxd. This file defines them in the program itself, so they take
+ * precedence over the ones of libusbmuxd, and hands every connection to a
+ * local service over a socket pair instead. Nothing but the socket is
+ * faked, the library code runs unchanged on top of it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <usbmuxd.h>
+
+#include "standin.h"
+#include "common/thread.h"
+
+#ifdef HAVE_FVISIBILITY
+#define STANDIN_EXPORT __attribute__((visibility("default")))
+#else
+#define STANDIN_EXPORT
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define STANDIN_MAX_SERVICES 8
+#define STANDIN_MAX_THREADS 64
+
+struct standin_service {
+	uint16_t port;
+	standin_service_cb_t service;
+	void *user_data;
+};
+
+struct standin_connection {
+	struct standin_service *service;
+	int fd;
+};
+
+static struct standin_service services[STANDIN_MAX_SERVICES];
+static int num_services = 0;
+static thread_t threads[STANDIN_MAX_THREADS];
+static int num_threads = 0;
+
+void standin_set_service(uint16_t port, standin_service_cb_t service, void *user_data)
+{
+	int i;
+
+	for (i = 0; i < num_services; i++) {
+		if (services[i].port == port)
+			break;
+	}
+	if (i == STANDIN_MAX_SERVICES)
+		return;
+	services[i].port = port;
+	services[i].service = service;
+	services[i].user_data = user_data;
+	if (i == num_services)
+		num_services++;
+}
+
+void standin_wait(void)
+{
+	int i;
+
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	num_threads = 0;
+}
+
+int standin_read(int fd, void *data, uint32_t length)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		ssize_t res = recv(fd, (char*)data + done, length - done, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		done += res;
+	}
+
+	return 0;
+}
+
+int standin_write(int fd, const void *data, uint32_t length)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		ssize_t res = send(fd, (const char*)data + done, length - done, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		done += res;
+	}
+
+	return 0;
+}
+
+double standin_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *standin_connection_run(void *arg)
+{
+	struct standin_connection *conn = (struct standin_connection*)arg;
+
+	conn->service->service(conn->fd, conn->service->user_data);
+	free(conn);
+
+	return NULL;
+}
+
+/* replacements for the libusbmuxd functions used by the library */
+
+STANDIN_EXPORT int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info_t *device)
+{
+	if (udid && strcmp(udid, STANDIN_UDID) != 0)
+		return 0;
+
+	memset(device, '\0', sizeof(usbmuxd_device_info_t));
+	device->handle = 1;
+	strcpy(device->udid, STANDIN_UDID);
+
+	return 1;
+}
+
+STANDIN_EXPORT int usbmuxd_connect(const int handle, const unsigned short tcp_port)
+{
+	struct standin_connection *conn = NULL;
+	int sv[2];
+	int i;
+
+	for (i = 0; i < num_services; i++) {
+		if (services[i].port == tcp_port)
+			break;
+	}
+	if (handle != 1 || i == num_services || num_threads == STANDIN_MAX_THREADS)
+		return -ECONNREFUSED;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -errno;
+
+	conn = (struct standin_connection*)malloc(sizeof(struct standin_connection));
+	if (!conn) {
+		close(sv[0]);
+		close(sv[1]);
+		return -ENOMEM;
+	}
+	conn->service = &services[i];
+	conn->fd = sv[1];
+	if (thread_new(&threads[num_threads], standin_connection_run, conn) != 0) {
+		free(conn);
+		close(sv[0]);
+		close(sv[1]);
+		return -ECONNREFUSED;
+	}
+	num_threads++;
+
+	return sv[0];
+}
+
+STANDIN_EXPORT int usbmuxd_disconnect(int sfd)
+{
+	return close(sfd);
+}
+
+STANDIN_EXPORT int usbmuxd_send(int sfd, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	ssize_t res;
+
+	do {
+		res = send(sfd, data, len, MSG_NOSIGNAL);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0) {
+		*sent_bytes = 0;
+		return -errno;
+	}
+	*sent_bytes = (uint32_t)res;
+
+	return 0;
+}
+
+STANDIN_EXPORT int usbmuxd_recv_timeout(int sfd, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	struct pollfd pfd;
+	ssize_t res;
+
+	*recv_bytes = 0;
+
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do {
+		res = poll(&pfd, 1, (timeout > 0) ? (int)timeout : -1);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -errno;
+	if (res == 0)
+		return -ETIMEDOUT;
+
+	do {
+		res = recv(sfd, data, len, 0);
+	} while (res < 0 && errno == EINTR);
+	if (res < 0)
+		return -errno;
+	if (res == 0)
+		return -ECONNRESET;
+	*recv_bytes = (uint32_t)res;
+
+	return 0;
+}
+
+STANDIN_EXPORT int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	return usbmuxd_recv_timeout(sfd, data, len, recv_bytes, 5000);
+}
@@ -0,0 +1,56 @@
+/*
+ * standin.h
+ * Local stand-ins for device services, used by the benchmarks
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STANDIN_H
+#define __STANDIN_H
+
+#include <stdint.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+
+/** UDID of the device the stand-ins pretend to be */
+#define STANDIN_UDID "0000000000000000000000000000000000000001"
+
+/**
+ * Serves one connection to a stand-in service. The function owns fd and
+ * has to close it when done.
+ */
+typedef void (*standin_service_cb_t)(int fd, void *user_data);
+
+/**
+ * Makes connections to the given port of the stand-in device end up at the
+ * given function, which runs in a thread of its own for every connection.
+ */
+void standin_set_service(uint16_t port, standin_service_cb_t service, void *user_data);
+
+/** Waits until all service threads started so far have finished. */
+void standin_wait(void);
+
+/** Reads exactly length bytes. Returns 0 on success, -1 on error or EOF. */
+int standin_read(int fd, void *data, uint32_t length);
+
+/** Writes exactly length bytes. Returns 0 on success, -1 on error. */
+int standin_write(int fd, const void *data, uint32_t length);
+
+/** Returns a monotonic time in seconds. */
+double standin_time(void);
+
+#endif
@@ -20,11 +20,20 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <signal.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
@@ -37,6 +46,7 @@
 #include <libimobiledevice/notification_proxy.h>
 #include <libimobiledevice/afc.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <endianness.h>
 
@@ -52,14 +62,23 @@
 #include <sys/statvfs.h>
 #endif
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #define CODE_SUCCESS 0x00
 #define CODE_ERROR_LOCAL 0x06
 #define CODE_ERROR_REMOTE 0x0b
 #define CODE_FILE_DATA 0x0c
 
+/* size of the file data chunks sent to the device */
+#define MB2_SEND_CHUNK_SIZE (1024 * 1024)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 static int verbose = 1;
 static int quit_flag = 0;
+static const char *cas_store = NULL;
 
 #define PRINT_VERBOSE(min_level, ...) if (verbose >= min_level) { printf(__VA_ARGS__); };
 
@@ -460,53 +479,56 @@ static int win32err_to_errno(int err_value)
 }
 #endif
 
-static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char *backup_dir, const char *path, plist_t *errplist)
+struct mb2_digest_index;
+static char* mb2_cas_lookup(struct mb2_digest_index *digests, const char *path);
+
+static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char *backup_dir, const char *path, plist_t *errplist, struct mb2_digest_index *digests)
 {
 	uint32_t nlen = 0;
 	uint32_t pathlen = strlen(path);
 	uint32_t bytes = 0;
 	char *localfile = string_build_path(backup_dir, path, NULL);
 	char buf[32768];
+	char hdr[5];
+	int fd = -1;
+	idevice_iovec_t iov[2];
 #ifdef WIN32
 	struct _stati64 fst;
 #else
 	struct stat fst;
 #endif
 
-	FILE *f = NULL;
 	uint32_t slen = 0;
 	int errcode = -1;
 	int result = -1;
 	uint32_t length;
-#ifdef WIN32
 	uint64_t total;
 	uint64_t sent;
-#else
-	off_t total;
-	off_t sent;
-#endif
 
 	mobilebackup2_error_t err;
 
-	/* send path length */
+	/* send path length and path */
 	nlen = htobe32(pathlen);
-	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
+	iov[0].data = (const char*)&nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = path;
+	iov[1].length = pathlen;
+	err = mobilebackup2_send_rawv(mobilebackup2, iov, 2, &bytes);
 	if (err != MOBILEBACKUP2_E_SUCCESS) {
 		goto leave_proto_err;
 	}
-	if (bytes != (uint32_t)sizeof(nlen)) {
+	if (bytes != (uint32_t)sizeof(nlen) + pathlen) {
 		err = MOBILEBACKUP2_E_MUX_ERROR;
 		goto leave_proto_err;
 	}
 
-	/* send path */
-	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != pathlen) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
+	if (cas_store && (access(localfile, F_OK) != 0)) {
+		/* not in the backup tree, read the contents from the content store */
+		char *blob = mb2_cas_lookup(digests, path);
+		if (blob) {
+			free(localfile);
+			localfile = blob;
+		}
 	}
 
 #ifdef WIN32
@@ -532,179 +554,1626 @@ static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char
 		goto leave;
 	}
 
-	f = fopen(localfile, "rb");
-	if (!f) {
+	fd = open(localfile, O_RDONLY | O_BINARY);
+	if ((fd < 0) && cas_store) {
+		/* the backup tree copy can't be read, fall back to the content store */
+		int open_errno = errno;
+		char *blob = mb2_cas_lookup(digests, path);
+		if (blob) {
+			fd = open(blob, O_RDONLY | O_BINARY);
+		}
+		if (fd >= 0) {
+			free(localfile);
+			localfile = blob;
+		} else {
+			free(blob);
+			errno = open_errno;
+		}
+	}
+	if (fd < 0) {
 		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
 		errcode = errno;
 		goto leave;
 	}
 
 	sent = 0;
-	do {
-		length = ((total-sent) < (long long)sizeof(buf)) ? (uint32_t)total-sent : (uint32_t)sizeof(buf);
-		/* send data size (file size + 1) */
+	while (1) {
+		/* only announce data the file still has, it might have shrunk since it was stat()ed */
+#ifdef WIN32
+		if (_fstati64(fd, &fst) < 0)
+#else
+		if (fstat(fd, &fst) < 0)
+#endif
+		{
+			errcode = errno;
+			goto leave;
+		}
+		if ((uint64_t)fst.st_size <= sent) {
+			break;
+		}
+		length = (((uint64_t)fst.st_size-sent) < MB2_SEND_CHUNK_SIZE) ? (uint32_t)(fst.st_size-sent) : MB2_SEND_CHUNK_SIZE;
+
+		/* send data size (chunk size + 1) and code */
 		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, sizeof(nlen));
-		buf[4] = CODE_FILE_DATA;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, 5, &bytes);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_FILE_DATA;
+		err = mobilebackup2_send_raw(mobilebackup2, hdr, 5, &bytes);
 		if (err != MOBILEBACKUP2_E_SUCCESS) {
 			goto leave_proto_err;
 		}
 		if (bytes != 5) {
+			printf("Error: sent only %d of %d bytes\n", bytes, 5);
 			goto leave_proto_err;
 		}
 
-		/* send file contents */
-		size_t r = fread(buf, 1, sizeof(buf), f);
-		if (r <= 0) {
-			printf("%s: read error\n", __func__);
-			errcode = errno;
-			goto leave;
+		/* send the file contents, straight from the file where possible */
+		err = mobilebackup2_send_raw_file(mobilebackup2, fd, sent, length, &bytes);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			bytes = 0;
+		}
+		if (bytes != length) {
+			/* The file could not be read completely. Fill up the announced
+			 * chunk so the stream stays in sync, then report an error for
+			 * the file, which makes the device discard it. */
+			printf("Error: could only send %d of %d bytes of '%s'\n", bytes, length, localfile);
+			memset(buf, 0, sizeof(buf));
+			while (bytes < length) {
+				uint32_t fill = ((length-bytes) < sizeof(buf)) ? (length-bytes) : sizeof(buf);
+				err = mobilebackup2_send_raw(mobilebackup2, buf, fill, &slen);
+				if ((err != MOBILEBACKUP2_E_SUCCESS) || (slen != fill)) {
+					goto leave_proto_err;
+				}
+				bytes += fill;
+			}
+			errcode = EIO;
+			goto leave;
+		}
+		sent += length;
+	}
+	close(fd);
+	fd = -1;
+	errcode = 0;
+
+leave:
+	if (errcode == 0) {
+		result = 0;
+		nlen = 1;
+		nlen = htobe32(nlen);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_SUCCESS;
+		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
+	} else {
+		if (!*errplist) {
+			*errplist = plist_new_dict();
+		}
+		char *errdesc = strerror(errcode);
+		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
+
+		length = strlen(errdesc);
+		nlen = htobe32(length+1);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_ERROR_LOCAL;
+		slen = 5;
+		memcpy(buf+slen, errdesc, length);
+		slen += length;
+		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, slen, &bytes);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("could not send message\n");
+		}
+		if (bytes != slen) {
+			printf("could only send %d from %d\n", bytes, slen);
+		}
+	}
+
+leave_proto_err:
+	if (fd >= 0)
+		close(fd);
+	free(localfile);
+	return result;
+}
+
+static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, struct mb2_digest_index *digests)
+{
+	uint32_t cnt;
+	uint32_t i = 0;
+	uint32_t sent;
+	plist_t errplist = NULL;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+
+	plist_t files = plist_array_get_item(message, 1);
+	cnt = plist_array_get_size(files);
+
+	for (i = 0; i < cnt; i++) {
+		plist_t val = plist_array_get_item(files, i);
+		if (plist_get_node_type(val) != PLIST_STRING) {
+			continue;
+		}
+		char *str = NULL;
+		plist_get_string_val(val, &str);
+		if (!str)
+			continue;
+
+		if (mb2_handle_send_file(mobilebackup2, backup_dir, str, &errplist, digests) < 0) {
+			free(str);
+			//printf("Error when sending file '%s' to device\n", str);
+			// TODO: perhaps we can continue, we've got a multi status response?!
+			break;
+		}
+		free(str);
+	}
+
+	/* send terminating 0 dword */
+	uint32_t zero = 0;
+	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+
+	if (!errplist) {
+		plist_t emptydict = plist_new_dict();
+		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, emptydict);
+		plist_free(emptydict);
+	} else {
+		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
+		plist_free(errplist);
+	}
+}
+
+static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+{
+	uint32_t nlen = 0;
+	uint32_t rlen = 0;
+
+	do {
+		nlen = 0;
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
+		nlen = be32toh(nlen);
+
+		if ((nlen == 0) && (rlen == 4)) {
+			// a zero length means no more files to receive
+			return 0;
+		} else if(rlen == 0) {
+			// device needs more time, waiting...
+			continue;
+		} else if (nlen > 4096) {
+			// filename length is too large
+			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
+			return 0;
+		}
+
+		if (*filename != NULL) {
+			free(*filename);
+			*filename = NULL;
+		}
+
+		*filename = (char*)malloc(nlen+1);
+
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
+		if (rlen != nlen) {
+			printf("ERROR: %s: could not read filename\n", __func__);
+			return 0;
+		}
+
+		char* p = *filename;
+		p[rlen] = 0;
+
+		break;
+	} while(1 && !quit_flag);
+
+	return nlen;
+}
+
+/* name of the file index stored in the device backup directory */
+#define MB2_DIGEST_INDEX_FILE "Manifest.digests"
+#define MB2_DIGEST_INDEX_MAGIC "MB2D"
+#define MB2_DIGEST_INDEX_VERSION 2
+#define MB2_DIGEST_INDEX_HEADER_SIZE 16
+#define MB2_DIGEST_INDEX_RECORD_SIZE 80
+#define MB2_DIGEST_INDEX_MIN_BUCKETS 1024
+
+#define MB2_SHA1_LENGTH 20
+#define MB2_SHA256_LENGTH 32
+
+/* flags of index entries */
+#define MB2_ENTRY_DIRECTORY (1 << 0)
+#define MB2_ENTRY_DIGEST    (1 << 1)
+/* in memory only: all children of the directory are in the index */
+#define MB2_ENTRY_COMPLETE  (1 << 8)
+/* in memory only: read from the index file, the file might have been
+ * changed since */
+#define MB2_ENTRY_UNVERIFIED (1 << 9)
+#define MB2_ENTRY_STORED_FLAGS (MB2_ENTRY_DIRECTORY | MB2_ENTRY_DIGEST)
+
+struct mb2_digest_ctx {
+#ifdef HAVE_OPENSSL
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+#else
+	gcry_md_hd_t hd;
+#endif
+};
+
+static int mb2_digest_init(struct mb2_digest_ctx *ctx)
+{
+#ifdef HAVE_OPENSSL
+	SHA1_Init(&ctx->sha1);
+	SHA256_Init(&ctx->sha256);
+#else
+	if (gcry_md_open(&ctx->hd, GCRY_MD_SHA1, 0) != 0) {
+		return -1;
+	}
+	gcry_md_enable(ctx->hd, GCRY_MD_SHA256);
+#endif
+	return 0;
+}
+
+static void mb2_digest_update(struct mb2_digest_ctx *ctx, const char *data, uint32_t length)
+{
+#ifdef HAVE_OPENSSL
+	SHA1_Update(&ctx->sha1, data, length);
+	SHA256_Update(&ctx->sha256, data, length);
+#else
+	gcry_md_write(ctx->hd, data, length);
+#endif
+}
+
+static void mb2_digest_final(struct mb2_digest_ctx *ctx, unsigned char *sha1, unsigned char *sha256)
+{
+#ifdef HAVE_OPENSSL
+	SHA1_Final(sha1, &ctx->sha1);
+	SHA256_Final(sha256, &ctx->sha256);
+#else
+	memcpy(sha1, gcry_md_read(ctx->hd, GCRY_MD_SHA1), MB2_SHA1_LENGTH);
+	memcpy(sha256, gcry_md_read(ctx->hd, GCRY_MD_SHA256), MB2_SHA256_LENGTH);
+	gcry_md_close(ctx->hd);
+#endif
+}
+
+static void mb2_digest_abort(struct mb2_digest_ctx *ctx)
+{
+#ifndef HAVE_OPENSSL
+	gcry_md_close(ctx->hd);
+#endif
+}
+
+struct mb2_digest_entry {
+	char *path;
+	uint64_t size;
+	int64_t mtime;
+	uint16_t flags;
+	uint32_t stamp;
+	unsigned char sha1[MB2_SHA1_LENGTH];
+	unsigned char sha256[MB2_SHA256_LENGTH];
+	struct mb2_digest_entry *next;
+	/* the directory containing the entry and the entries of a directory */
+	struct mb2_digest_entry *parent;
+	struct mb2_digest_entry *children;
+	struct mb2_digest_entry *sibling;
+	struct mb2_digest_entry **sibling_prev;
+};
+
+/**
+ * Index of the files and directories in the backup directory, keyed by
+ * their path relative to the backup directory. It holds the size and
+ * modification time of every entry and the digests of the files.
+ *
+ * The index is updated while files are received, moved, copied or removed,
+ * so file contents never need to be read again to verify or deduplicate
+ * them, and directory listings can be answered without stat()ing every
+ * file. A modification time of 0 means it is not known.
+ *
+ * Every entry is linked to the entry of its parent directory, which is
+ * created as needed, so the entries of a directory or a subtree are found
+ * without looking at the whole index.
+ */
+struct mb2_digest_index {
+	mutex_t mutex;
+	struct mb2_digest_entry **buckets;
+	uint32_t num_buckets;
+	uint32_t count;
+	uint32_t stamp;
+};
+
+static unsigned int mb2_path_hash(const char *path)
+{
+	unsigned int hash = 5381;
+	while (*path) {
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+	}
+	return hash;
+}
+
+static struct mb2_digest_index* mb2_digest_index_new(void)
+{
+	struct mb2_digest_index *index = (struct mb2_digest_index*)calloc(1, sizeof(struct mb2_digest_index));
+	if (!index) {
+		return NULL;
+	}
+	index->num_buckets = MB2_DIGEST_INDEX_MIN_BUCKETS;
+	index->buckets = (struct mb2_digest_entry**)calloc(index->num_buckets, sizeof(struct mb2_digest_entry*));
+	if (!index->buckets) {
+		free(index);
+		return NULL;
+	}
+	mutex_init(&index->mutex);
+	return index;
+}
+
+static struct mb2_digest_entry* mb2_digest_entry_new(const char *path, uint16_t flags, uint64_t size, int64_t mtime)
+{
+	struct mb2_digest_entry *entry = (struct mb2_digest_entry*)calloc(1, sizeof(struct mb2_digest_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->path = strdup(path);
+	if (!entry->path) {
+		free(entry);
+		return NULL;
+	}
+	entry->flags = flags;
+	entry->size = size;
+	entry->mtime = mtime;
+	return entry;
+}
+
+static void mb2_digest_entry_list_free(struct mb2_digest_entry *list)
+{
+	while (list) {
+		struct mb2_digest_entry *entry = list;
+		list = entry->next;
+		free(entry->path);
+		free(entry);
+	}
+}
+
+static void mb2_digest_index_free(struct mb2_digest_index *index)
+{
+	uint32_t i;
+
+	if (!index) {
+		return;
+	}
+	for (i = 0; i < index->num_buckets; i++) {
+		mb2_digest_entry_list_free(index->buckets[i]);
+	}
+	free(index->buckets);
+	mutex_destroy(&index->mutex);
+	free(index);
+}
+
+static void mb2_digest_index_grow(struct mb2_digest_index *index)
+{
+	uint32_t num_buckets = index->num_buckets * 2;
+	struct mb2_digest_entry **buckets = (struct mb2_digest_entry**)calloc(num_buckets, sizeof(struct mb2_digest_entry*));
+	uint32_t i;
+
+	if (!buckets) {
+		/* keep using the current buckets */
+		return;
+	}
+	for (i = 0; i < index->num_buckets; i++) {
+		struct mb2_digest_entry *entry = index->buckets[i];
+		while (entry) {
+			struct mb2_digest_entry *next = entry->next;
+			unsigned int bucket = mb2_path_hash(entry->path) % num_buckets;
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->num_buckets = num_buckets;
+}
+
+/* Must be called with the mutex held. */
+static struct mb2_digest_entry* mb2_digest_index_find(struct mb2_digest_index *index, const char *path)
+{
+	struct mb2_digest_entry *entry;
+	for (entry = index->buckets[mb2_path_hash(path) % index->num_buckets]; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Removes an entry from its bucket. Must be called with the mutex held. */
+static void mb2_digest_index_unhash(struct mb2_digest_index *index, struct mb2_digest_entry *entry)
+{
+	struct mb2_digest_entry **prev = &index->buckets[mb2_path_hash(entry->path) % index->num_buckets];
+
+	while (*prev) {
+		if (*prev == entry) {
+			*prev = entry->next;
+			entry->next = NULL;
+			index->count--;
+			return;
+		}
+		prev = &(*prev)->next;
+	}
+}
+
+static void mb2_digest_entry_attach(struct mb2_digest_entry *parent, struct mb2_digest_entry *entry)
+{
+	entry->parent = parent;
+	entry->sibling = parent->children;
+	if (entry->sibling) {
+		entry->sibling->sibling_prev = &entry->sibling;
+	}
+	entry->sibling_prev = &parent->children;
+	parent->children = entry;
+}
+
+static void mb2_digest_entry_detach(struct mb2_digest_entry *entry)
+{
+	if (entry->sibling_prev) {
+		*entry->sibling_prev = entry->sibling;
+		if (entry->sibling) {
+			entry->sibling->sibling_prev = entry->sibling_prev;
+		}
+	}
+	entry->parent = NULL;
+	entry->sibling = NULL;
+	entry->sibling_prev = NULL;
+}
+
+/**
+ * Unlinks an entry and all entries below it from the index and prepends
+ * them to list. Must be called with the mutex held.
+ */
+static struct mb2_digest_entry* mb2_digest_index_take_entry(struct mb2_digest_index *index, struct mb2_digest_entry *entry, struct mb2_digest_entry *list)
+{
+	while (entry->children) {
+		list = mb2_digest_index_take_entry(index, entry->children, list);
+	}
+	mb2_digest_entry_detach(entry);
+	mb2_digest_index_unhash(index, entry);
+	entry->next = list;
+	return entry;
+}
+
+static void mb2_digest_index_insert(struct mb2_digest_index *index, struct mb2_digest_entry *entry);
+
+/**
+ * Returns the entry of the directory containing path, adding it if it is
+ * not in the index yet, or NULL if path is at the top level. Must be
+ * called with the mutex held.
+ */
+static struct mb2_digest_entry* mb2_digest_index_parent(struct mb2_digest_index *index, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	struct mb2_digest_entry *parent;
+	char *dir;
+
+	if (!slash) {
+		return NULL;
+	}
+	dir = (char*)malloc(slash - path + 1);
+	if (!dir) {
+		return NULL;
+	}
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = '\0';
+
+	parent = mb2_digest_index_find(index, dir);
+	if (!parent) {
+		parent = mb2_digest_entry_new(dir, MB2_ENTRY_DIRECTORY, 0, 0);
+		if (parent) {
+			mb2_digest_index_insert(index, parent);
+		}
+	} else if (!(parent->flags & MB2_ENTRY_DIRECTORY)) {
+		/* what we knew as a file has become a directory */
+		parent->flags = MB2_ENTRY_DIRECTORY;
+		parent->size = 0;
+		parent->mtime = 0;
+	}
+	free(dir);
+
+	return parent;
+}
+
+/* Adds an entry, replacing any entry with the same path. Must be called with the mutex held. */
+static void mb2_digest_index_insert(struct mb2_digest_index *index, struct mb2_digest_entry *entry)
+{
+	struct mb2_digest_entry *old = mb2_digest_index_find(index, entry->path);
+	struct mb2_digest_entry *parent;
+	unsigned int bucket;
+
+	entry->parent = NULL;
+	entry->children = NULL;
+	entry->sibling = NULL;
+	entry->sibling_prev = NULL;
+
+	if (old) {
+		if ((entry->flags & MB2_ENTRY_DIRECTORY) && old->children) {
+			/* the entries below a directory stay */
+			struct mb2_digest_entry *child;
+			entry->children = old->children;
+			entry->children->sibling_prev = &entry->children;
+			old->children = NULL;
+			for (child = entry->children; child; child = child->sibling) {
+				child->parent = entry;
+			}
+		}
+		mb2_digest_entry_list_free(mb2_digest_index_take_entry(index, old, NULL));
+	}
+
+	if (index->count >= index->num_buckets) {
+		mb2_digest_index_grow(index);
+	}
+	bucket = mb2_path_hash(entry->path) % index->num_buckets;
+	entry->next = index->buckets[bucket];
+	index->buckets[bucket] = entry;
+	index->count++;
+
+	parent = mb2_digest_index_parent(index, entry->path);
+	if (parent) {
+		mb2_digest_entry_attach(parent, entry);
+	}
+}
+
+/**
+ * Unlinks the entry for path and, if it is a directory, all entries below
+ * it. Must be called with the mutex held.
+ *
+ * @return A list of the unlinked entries.
+ */
+static struct mb2_digest_entry* mb2_digest_index_take(struct mb2_digest_index *index, const char *path)
+{
+	struct mb2_digest_entry *entry = mb2_digest_index_find(index, path);
+
+	if (!entry) {
+		/* nothing can be below a path that is not in the index */
+		return NULL;
+	}
+
+	return mb2_digest_index_take_entry(index, entry, NULL);
+}
+
+/**
+ * Records a file. sha1 and sha256 may be NULL if the digests of the file
+ * are not known.
+ */
+static void mb2_digest_index_set(struct mb2_digest_index *index, const char *path, uint64_t size, int64_t mtime, const unsigned char *sha1, const unsigned char *sha256)
+{
+	struct mb2_digest_entry *entry = mb2_digest_entry_new(path, 0, size, mtime);
+
+	if (!entry) {
+		return;
+	}
+	if (sha1 && sha256) {
+		memcpy(entry->sha1, sha1, MB2_SHA1_LENGTH);
+		memcpy(entry->sha256, sha256, MB2_SHA256_LENGTH);
+		entry->flags |= MB2_ENTRY_DIGEST;
+	}
+
+	mutex_lock(&index->mutex);
+	mb2_digest_index_insert(index, entry);
+	mutex_unlock(&index->mutex);
+}
+
+static void mb2_digest_index_remove(struct mb2_digest_index *index, const char *path)
+{
+	mutex_lock(&index->mutex);
+	mb2_digest_entry_list_free(mb2_digest_index_take(index, path));
+	mutex_unlock(&index->mutex);
+}
+
+/**
+ * Records a file written by ourselves, taking size and modification time
+ * from the file system.
+ */
+static void mb2_digest_index_set_from_file(struct mb2_digest_index *index, const char *backup_dir, const char *path)
+{
+	char *fullpath = string_build_path(backup_dir, path, NULL);
+	struct stat st;
+
+	if (stat(fullpath, &st) == 0) {
+		mb2_digest_index_set(index, path, st.st_size, st.st_mtime, NULL, NULL);
+	} else {
+		mb2_digest_index_remove(index, path);
+	}
+	free(fullpath);
+}
+
+/**
+ * Records a directory and any of its parent directories that are not in
+ * the index yet.
+ *
+ * @param created 1 if the directory has just been created and thus is
+ *   known to be empty.
+ */
+static void mb2_digest_index_add_directory(struct mb2_digest_index *index, const char *path, int created)
+{
+	char *dir = strdup(path);
+	char *p;
+
+	if (!dir) {
+		return;
+	}
+	mutex_lock(&index->mutex);
+	p = dir + strlen(dir);
+	while (1) {
+		if (!mb2_digest_index_find(index, dir)) {
+			struct mb2_digest_entry *entry = mb2_digest_entry_new(dir, MB2_ENTRY_DIRECTORY, 0, 0);
+			if (entry) {
+				if (created && (*p == '\0')) {
+					entry->flags |= MB2_ENTRY_COMPLETE;
+				}
+				mb2_digest_index_insert(index, entry);
+			}
+		}
+		p = strrchr(dir, '/');
+		if (!p) {
+			break;
+		}
+		*p = '\0';
+	}
+	mutex_unlock(&index->mutex);
+	free(dir);
+}
+
+/**
+ * Moves or copies the entry for a file, or a directory and the entries
+ * below it, to a new path.
+ */
+static void mb2_digest_index_relocate(struct mb2_digest_index *index, const char *from, const char *to, int copy)
+{
+	struct mb2_digest_entry *list;
+	size_t from_len = strlen(from);
+	size_t to_len = strlen(to);
+
+	mutex_lock(&index->mutex);
+	list = mb2_digest_index_take(index, from);
+	while (list) {
+		struct mb2_digest_entry *entry = list;
+		size_t suffix_len = strlen(entry->path + from_len);
+		char *path = (char*)malloc(to_len + suffix_len + 1);
+		list = entry->next;
+		entry->next = NULL;
+		if (!path) {
+			mb2_digest_entry_list_free(entry);
+			continue;
+		}
+		memcpy(path, to, to_len);
+		memcpy(path + to_len, entry->path + from_len, suffix_len + 1);
+		if (copy) {
+			struct mb2_digest_entry *dup = (struct mb2_digest_entry*)malloc(sizeof(struct mb2_digest_entry));
+			if (dup) {
+				memcpy(dup, entry, sizeof(struct mb2_digest_entry));
+				dup->path = entry->path;
+				dup->next = NULL;
+				mb2_digest_index_insert(index, dup);
+			} else {
+				free(entry->path);
+			}
+			/* copies get a new modification time and might be incomplete */
+			entry->mtime = 0;
+			entry->flags &= ~MB2_ENTRY_COMPLETE;
+		} else {
+			free(entry->path);
+		}
+		entry->path = path;
+		mb2_digest_index_insert(index, entry);
+	}
+	mutex_unlock(&index->mutex);
+}
+
+static int mb2_digest_index_get(struct mb2_digest_index *index, const char *path, unsigned char *sha256)
+{
+	struct mb2_digest_entry *entry;
+	int res = -1;
+
+	mutex_lock(&index->mutex);
+	entry = mb2_digest_index_find(index, path);
+	if (entry && (entry->flags & MB2_ENTRY_DIGEST)) {
+		memcpy(sha256, entry->sha256, MB2_SHA256_LENGTH);
+		res = 0;
+	}
+	mutex_unlock(&index->mutex);
+
+	return res;
+}
+
+/* Returns 1 if both files are known to have the same contents. */
+static int mb2_digest_index_same_contents(struct mb2_digest_index *index, const char *path1, const char *path2)
+{
+	struct mb2_digest_entry *entry1;
+	struct mb2_digest_entry *entry2;
+	int res = 0;
+
+	mutex_lock(&index->mutex);
+	entry1 = mb2_digest_index_find(index, path1);
+	entry2 = mb2_digest_index_find(index, path2);
+	if (entry1 && entry2 && (entry1->flags & entry2->flags & MB2_ENTRY_DIGEST) && (entry1->size == entry2->size)) {
+		res = (memcmp(entry1->sha256, entry2->sha256, MB2_SHA256_LENGTH) == 0);
+	}
+	mutex_unlock(&index->mutex);
+
+	return res;
+}
+
+static void mb2_dirlist_add(plist_t dirlist, const char *name, int is_dir, int is_file, uint64_t size, int64_t mtime)
+{
+	plist_t fdict = plist_new_dict();
+	const char *ftype = "DLFileTypeUnknown";
+	if (is_dir) {
+		ftype = "DLFileTypeDirectory";
+	} else if (is_file) {
+		ftype = "DLFileTypeRegular";
+	}
+	plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
+	plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(size));
+	plist_dict_set_item(fdict, "DLFileModificationDate", plist_new_date(mtime, 0));
+	plist_dict_set_item(dirlist, name, fdict);
+}
+
+/**
+ * Fills a DLContentsOfDirectory response from the index.
+ *
+ * @return 0 on success, -1 if the index does not know all entries of the
+ *   directory.
+ */
+static int mb2_digest_index_list_directory(struct mb2_digest_index *index, const char *backup_dir, const char *path, plist_t dirlist)
+{
+	struct mb2_digest_entry *dir;
+	struct mb2_digest_entry *entry;
+	size_t path_len = strlen(path);
+
+	mutex_lock(&index->mutex);
+	dir = mb2_digest_index_find(index, path);
+	if (!dir || !(dir->flags & MB2_ENTRY_COMPLETE)) {
+		mutex_unlock(&index->mutex);
+		return -1;
+	}
+	for (entry = dir->children; entry; entry = entry->sibling) {
+		if ((entry->flags & (MB2_ENTRY_DIRECTORY | MB2_ENTRY_UNVERIFIED)) || (entry->mtime == 0)) {
+			/* modification time unknown or changing with the contents, or
+			 * the file might have been rewritten since the index was
+			 * saved, ask the file system */
+			char *fullpath = string_build_path(backup_dir, entry->path, NULL);
+			struct stat st;
+			if (stat(fullpath, &st) == 0) {
+				if (!(entry->flags & MB2_ENTRY_DIRECTORY)) {
+					if ((entry->flags & MB2_ENTRY_UNVERIFIED) && (entry->mtime != 0)
+					    && ((entry->size != (uint64_t)st.st_size) || (entry->mtime != st.st_mtime))) {
+						/* changed behind our back, the digests are stale */
+						entry->flags &= ~MB2_ENTRY_DIGEST;
+					}
+					entry->flags &= ~MB2_ENTRY_UNVERIFIED;
+					entry->size = st.st_size;
+					entry->mtime = st.st_mtime;
+				}
+				mb2_dirlist_add(dirlist, entry->path + path_len + 1, S_ISDIR(st.st_mode), S_ISREG(st.st_mode), st.st_size, st.st_mtime);
+			}
+			free(fullpath);
+		} else {
+			mb2_dirlist_add(dirlist, entry->path + path_len + 1, 0, 1, entry->size, entry->mtime);
+		}
+	}
+	mutex_unlock(&index->mutex);
+
+	return 0;
+}
+
+/**
+ * Starts updating the entries of a directory from the file system. Pass
+ * each directory entry to mb2_digest_index_refresh_entry() and finish with
+ * mb2_digest_index_refresh_done().
+ */
+static void mb2_digest_index_refresh_start(struct mb2_digest_index *index)
+{
+	mutex_lock(&index->mutex);
+	index->stamp++;
+	mutex_unlock(&index->mutex);
+}
+
+static void mb2_digest_index_refresh_entry(struct mb2_digest_index *index, const char *path, struct stat *st)
+{
+	struct mb2_digest_entry *entry;
+	int is_dir = S_ISDIR(st->st_mode);
+
+	mutex_lock(&index->mutex);
+	entry = mb2_digest_index_find(index, path);
+	if (entry && (is_dir == !!(entry->flags & MB2_ENTRY_DIRECTORY))
+	    && (is_dir || ((entry->size == (uint64_t)st->st_size) && (entry->mtime == st->st_mtime)))) {
+		/* unchanged, keep the digests */
+		if (is_dir) {
+			entry->size = st->st_size;
+		}
+		entry->flags &= ~MB2_ENTRY_UNVERIFIED;
+		entry->stamp = index->stamp;
+	} else {
+		if (entry) {
+			mb2_digest_entry_list_free(mb2_digest_index_take(index, path));
+		}
+		entry = mb2_digest_entry_new(path, (is_dir) ? MB2_ENTRY_DIRECTORY : 0, st->st_size, st->st_mtime);
+		if (entry) {
+			entry->stamp = index->stamp;
+			mb2_digest_index_insert(index, entry);
+		}
+	}
+	mutex_unlock(&index->mutex);
+}
+
+/* Removes the entries that are gone and marks the directory complete. */
+static void mb2_digest_index_refresh_done(struct mb2_digest_index *index, const char *path, int64_t mtime)
+{
+	struct mb2_digest_entry *gone = NULL;
+	struct mb2_digest_entry *entry;
+
+	mutex_lock(&index->mutex);
+	entry = mb2_digest_index_find(index, path);
+	if (entry) {
+		struct mb2_digest_entry *child = entry->children;
+		while (child) {
+			struct mb2_digest_entry *sibling = child->sibling;
+			if (child->stamp != index->stamp) {
+				gone = mb2_digest_index_take_entry(index, child, gone);
+			}
+			child = sibling;
+		}
+	}
+	mb2_digest_entry_list_free(gone);
+
+	if (!entry || !(entry->flags & MB2_ENTRY_DIRECTORY)) {
+		entry = mb2_digest_entry_new(path, MB2_ENTRY_DIRECTORY, 0, 0);
+		if (entry) {
+			mb2_digest_index_insert(index, entry);
+		}
+	}
+	if (entry) {
+		entry->mtime = mtime;
+		entry->flags |= MB2_ENTRY_COMPLETE;
+	}
+	mutex_unlock(&index->mutex);
+}
+
+/**
+ * Loads an index file. Paths in the file are relative to the directory it
+ * is located in and get prefix prepended. A directory only counts as
+ * complete if it has not been modified since the index was written, and
+ * its modification time is older than the index file, as changes within
+ * the same second would go unnoticed. The entries of files are checked
+ * against the file system when they are listed first.
+ *
+ * The file consists of a header (magic, version, count, size of the path
+ * table), count records of MB2_DIGEST_INDEX_RECORD_SIZE bytes sorted by
+ * path, and the NUL terminated paths. A record holds offset and length of
+ * the path, flags, size, modification time, SHA-1 and SHA-256. Integers
+ * are stored big endian. As the records are sorted, the entry of a
+ * directory is loaded before the entries below it.
+ *
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int mb2_digest_index_load(struct mb2_digest_index *index, const char *backup_dir, const char *filename, const char *prefix)
+{
+	FILE *f = fopen(filename, "rb");
+	unsigned char *data = NULL;
+	uint64_t data_size = 0;
+	uint32_t count = 0;
+	uint32_t strings_size = 0;
+	uint32_t version = 0;
+	uint32_t i;
+	size_t prefix_len = strlen(prefix);
+	struct stat st;
+	int64_t saved;
+	int res = 0;
+
+	if (!f) {
+		return -1;
+	}
+	if ((fstat(fileno(f), &st) < 0) || (st.st_size < MB2_DIGEST_INDEX_HEADER_SIZE)) {
+		fclose(f);
+		printf("Ignoring invalid file index '%s'\n", filename);
+		return -1;
+	}
+	data_size = st.st_size;
+	saved = st.st_mtime;
+	data = (unsigned char*)malloc(data_size);
+	if (!data || (fread(data, 1, data_size, f) != data_size)) {
+		free(data);
+		fclose(f);
+		printf("Could not read file index '%s'\n", filename);
+		return -1;
+	}
+	fclose(f);
+
+	memcpy(&version, data + 4, 4);
+	memcpy(&count, data + 8, 4);
+	memcpy(&strings_size, data + 12, 4);
+	version = be32toh(version);
+	count = be32toh(count);
+	strings_size = be32toh(strings_size);
+	if (memcmp(data, MB2_DIGEST_INDEX_MAGIC, 4) != 0) {
+		printf("Ignoring invalid file index '%s'\n", filename);
+		res = -1;
+	} else if (version != MB2_DIGEST_INDEX_VERSION) {
+		PRINT_VERBOSE(1, "Ignoring file index '%s' with version %d\n", filename, version);
+		res = -1;
+	} else if (data_size != MB2_DIGEST_INDEX_HEADER_SIZE + (uint64_t)count * MB2_DIGEST_INDEX_RECORD_SIZE + strings_size) {
+		printf("Ignoring truncated file index '%s'\n", filename);
+		res = -1;
+	}
+
+	mutex_lock(&index->mutex);
+	for (i = 0; (res == 0) && (i < count); i++) {
+		const unsigned char *record = data + MB2_DIGEST_INDEX_HEADER_SIZE + (uint64_t)i * MB2_DIGEST_INDEX_RECORD_SIZE;
+		const char *strings = (const char*)data + MB2_DIGEST_INDEX_HEADER_SIZE + (uint64_t)count * MB2_DIGEST_INDEX_RECORD_SIZE;
+		struct mb2_digest_entry *entry;
+		uint32_t path_offset;
+		uint16_t path_len;
+		uint16_t flags;
+		uint64_t value;
+
+		memcpy(&path_offset, record, 4);
+		memcpy(&path_len, record + 4, 2);
+		memcpy(&flags, record + 6, 2);
+		path_offset = be32toh(path_offset);
+		path_len = be16toh(path_len);
+		if ((uint64_t)path_offset + path_len >= strings_size) {
+			printf("Ignoring invalid file index '%s'\n", filename);
+			res = -1;
+			break;
+		}
+
+		entry = (struct mb2_digest_entry*)calloc(1, sizeof(struct mb2_digest_entry));
+		if (entry) {
+			entry->path = (char*)malloc(prefix_len + 1 + path_len + 1);
+		}
+		if (!entry || !entry->path) {
+			free(entry);
+			res = -1;
+			break;
+		}
+		/* an empty path stands for the directory of the index itself */
+		memcpy(entry->path, prefix, prefix_len);
+		entry->path[prefix_len] = '\0';
+		if (path_len > 0) {
+			entry->path[prefix_len] = '/';
+			memcpy(entry->path + prefix_len + 1, strings + path_offset, path_len);
+			entry->path[prefix_len + 1 + path_len] = '\0';
+		}
+		entry->flags = be16toh(flags) & MB2_ENTRY_STORED_FLAGS;
+		memcpy(&value, record + 8, 8);
+		entry->size = be64toh(value);
+		memcpy(&value, record + 16, 8);
+		entry->mtime = (int64_t)be64toh(value);
+		memcpy(entry->sha1, record + 24, MB2_SHA1_LENGTH);
+		memcpy(entry->sha256, record + 24 + MB2_SHA1_LENGTH, MB2_SHA256_LENGTH);
+
+		if ((entry->flags & MB2_ENTRY_DIRECTORY) && (entry->mtime != 0) && (entry->mtime < saved)) {
+			char *fullpath = string_build_path(backup_dir, entry->path, NULL);
+			if ((stat(fullpath, &st) == 0) && S_ISDIR(st.st_mode) && (st.st_mtime == entry->mtime)) {
+				entry->flags |= MB2_ENTRY_COMPLETE;
+			}
+			free(fullpath);
+		} else if (!(entry->flags & MB2_ENTRY_DIRECTORY)) {
+			entry->flags |= MB2_ENTRY_UNVERIFIED;
+		}
+		mb2_digest_index_insert(index, entry);
+	}
+	mutex_unlock(&index->mutex);
+
+	free(data);
+
+	return res;
+}
+
+/* Returns the path relative to prefix, or NULL if it is not below prefix. */
+static const char* mb2_path_relative(const char *path, const char *prefix, size_t prefix_len)
+{
+	if (strncmp(path, prefix, prefix_len) != 0) {
+		return NULL;
+	}
+	if (path[prefix_len] == '\0') {
+		return path + prefix_len;
+	}
+	if (path[prefix_len] == '/') {
+		return path + prefix_len + 1;
+	}
+	return NULL;
+}
+
+static int mb2_digest_entry_compare(const void *a, const void *b)
+{
+	return strcmp((*(struct mb2_digest_entry* const*)a)->path, (*(struct mb2_digest_entry* const*)b)->path);
+}
+
+/**
+ * Writes all entries below prefix to an index file, replacing it
+ * atomically. See mb2_digest_index_load() for the format.
+ *
+ * @return 0 on success, -1 if the file could not be written.
+ */
+static int mb2_digest_index_save(struct mb2_digest_index *index, const char *backup_dir, const char *filename, const char *prefix)
+{
+	char *tmpname = string_concat(filename, ".tmp", NULL);
+	struct mb2_digest_entry **entries = NULL;
+	unsigned char header[MB2_DIGEST_INDEX_HEADER_SIZE];
+	size_t prefix_len = strlen(prefix);
+	uint32_t strings_size = 0;
+	uint32_t count = 0;
+	uint32_t value32;
+	uint32_t i;
+	int res = 0;
+	FILE *f = NULL;
+
+	mutex_lock(&index->mutex);
+
+	entries = (struct mb2_digest_entry**)malloc(sizeof(struct mb2_digest_entry*) * (index->count + 1));
+	if (!entries) {
+		res = -1;
+		goto leave;
+	}
+	for (i = 0; i < index->num_buckets; i++) {
+		struct mb2_digest_entry *entry;
+		for (entry = index->buckets[i]; entry; entry = entry->next) {
+			const char *relpath = mb2_path_relative(entry->path, prefix, prefix_len);
+			if (relpath && (strlen(relpath) <= 0xFFFF)) {
+				entries[count++] = entry;
+			}
+		}
+	}
+	qsort(entries, count, sizeof(struct mb2_digest_entry*), mb2_digest_entry_compare);
+
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		printf("Could not open '%s' for writing: %s\n", tmpname, strerror(errno));
+		res = -1;
+		goto leave;
+	}
+
+	for (i = 0; i < count; i++) {
+		strings_size += strlen(mb2_path_relative(entries[i]->path, prefix, prefix_len)) + 1;
+	}
+	memcpy(header, MB2_DIGEST_INDEX_MAGIC, 4);
+	value32 = htobe32(MB2_DIGEST_INDEX_VERSION);
+	memcpy(header + 4, &value32, 4);
+	value32 = htobe32(count);
+	memcpy(header + 8, &value32, 4);
+	value32 = htobe32(strings_size);
+	memcpy(header + 12, &value32, 4);
+	fwrite(header, 1, sizeof(header), f);
+
+	strings_size = 0;
+	for (i = 0; i < count; i++) {
+		struct mb2_digest_entry *entry = entries[i];
+		unsigned char record[MB2_DIGEST_INDEX_RECORD_SIZE];
+		uint16_t path_len = (uint16_t)strlen(mb2_path_relative(entry->path, prefix, prefix_len));
+		uint16_t value16;
+		uint64_t value64;
+
+		memset(record, '\0', sizeof(record));
+		value32 = htobe32(strings_size);
+		memcpy(record, &value32, 4);
+		value16 = htobe16(path_len);
+		memcpy(record + 4, &value16, 2);
+		value16 = htobe16((uint16_t)(entry->flags & MB2_ENTRY_STORED_FLAGS));
+		memcpy(record + 6, &value16, 2);
+		value64 = htobe64(entry->size);
+		memcpy(record + 8, &value64, 8);
+		/* only complete directories may be trusted later, their modification
+		 * time is filled in once the index file is in place */
+		value64 = (entry->flags & MB2_ENTRY_DIRECTORY) ? 0 : htobe64((uint64_t)entry->mtime);
+		memcpy(record + 16, &value64, 8);
+		memcpy(record + 24, entry->sha1, MB2_SHA1_LENGTH);
+		memcpy(record + 24 + MB2_SHA1_LENGTH, entry->sha256, MB2_SHA256_LENGTH);
+		fwrite(record, 1, sizeof(record), f);
+		strings_size += path_len + 1;
+	}
+	for (i = 0; i < count; i++) {
+		const char *path = mb2_path_relative(entries[i]->path, prefix, prefix_len);
+		fwrite(path, 1, strlen(path) + 1, f);
+	}
+
+	if (ferror(f)) {
+		res = -1;
+	}
+	if (fclose(f) != 0) {
+		res = -1;
+	}
+	f = NULL;
+	if (res == 0) {
+		remove(filename);
+		if (rename(tmpname, filename) < 0) {
+			res = -1;
+		}
+	}
+	if (res < 0) {
+		printf("Could not write file index '%s'\n", filename);
+		remove(tmpname);
+		goto leave;
+	}
+
+	/* renaming the index file modified its directory, so the modification
+	 * times of the directories are taken only now */
+	f = fopen(filename, "r+b");
+	for (i = 0; f && (i < count); i++) {
+		struct mb2_digest_entry *entry = entries[i];
+		char *fullpath;
+		struct stat st;
+		uint64_t value64;
+
+		if ((entry->flags & (MB2_ENTRY_DIRECTORY | MB2_ENTRY_COMPLETE)) != (MB2_ENTRY_DIRECTORY | MB2_ENTRY_COMPLETE)) {
+			continue;
+		}
+		fullpath = string_build_path(backup_dir, entry->path, NULL);
+		if (stat(fullpath, &st) == 0) {
+			value64 = htobe64((uint64_t)(int64_t)st.st_mtime);
+			if ((fseek(f, MB2_DIGEST_INDEX_HEADER_SIZE + (long)i * MB2_DIGEST_INDEX_RECORD_SIZE + 16, SEEK_SET) != 0)
+			    || (fwrite(&value64, 1, 8, f) != 8)) {
+				res = -1;
+			}
+		}
+		free(fullpath);
+	}
+	if (f && (fclose(f) != 0)) {
+		res = -1;
+	}
+	f = NULL;
+
+leave:
+	mutex_unlock(&index->mutex);
+	if (f) {
+		fclose(f);
+	}
+	free(entries);
+	free(tmpname);
+
+	return res;
+}
+
+static int mb2_link(const char *oldpath, const char *newpath)
+{
+#ifdef WIN32
+	if (!CreateHardLink(newpath, oldpath, NULL)) {
+		errno = win32err_to_errno(GetLastError());
+		return -1;
+	}
+	return 0;
+#else
+	return link(oldpath, newpath);
+#endif
+}
+
+/* Blobs are stored as STORE/xx/<sha256 in hex> where xx are the first two hex digits */
+static char* mb2_cas_blob_path(const unsigned char *sha256)
+{
+	char hex[MB2_SHA256_LENGTH*2+1];
+	char dir[3];
+	int i;
+
+	for (i = 0; i < MB2_SHA256_LENGTH; i++) {
+		sprintf(hex + i*2, "%02x", sha256[i]);
+	}
+	dir[0] = hex[0];
+	dir[1] = hex[1];
+	dir[2] = '\0';
+
+	return string_build_path(cas_store, dir, hex, NULL);
+}
+
+/**
+ * Replaces a received file by a hard link to the blob with the same
+ * contents in the content store. If the store does not have the blob yet,
+ * the file becomes the blob.
+ */
+static int mb2_cas_store_file(const char *path, const unsigned char *sha256)
+{
+	char *blob = mb2_cas_blob_path(sha256);
+	char *blobdir = (blob) ? strdup(blob) : NULL;
+	char *slash = (blobdir) ? strrchr(blobdir, '/') : NULL;
+	int res = 0;
+
+	if (!slash) {
+		printf("Could not link '%s' to content store: %s\n", path, strerror(ENOMEM));
+		free(blobdir);
+		free(blob);
+		return -1;
+	}
+	*slash = '\0';
+	__mkdir(blobdir, 0755);
+	free(blobdir);
+
+	if (mb2_link(path, blob) < 0) {
+		if (errno == EEXIST) {
+			/* known contents, link the existing blob in place of the file */
+			char *tmppath = string_concat(path, ".cas", NULL);
+			remove(tmppath);
+			res = mb2_link(blob, tmppath);
+			if (res == 0) {
+#ifdef WIN32
+				remove(path);
+#endif
+				res = rename(tmppath, path);
+				if (res < 0) {
+					remove(tmppath);
+				}
+			}
+			free(tmppath);
+		} else {
+			res = -1;
+		}
+	}
+	if (res < 0) {
+		printf("Could not link '%s' to content store: %s\n", path, strerror(errno));
+	}
+	free(blob);
+
+	return res;
+}
+
+/**
+ * Returns the path of the blob holding the contents of a backup file
+ * according to the digest index, or NULL if it is not known.
+ */
+static char* mb2_cas_lookup(struct mb2_digest_index *digests, const char *path)
+{
+	unsigned char sha256[MB2_SHA256_LENGTH];
+	char *blob;
+	struct stat st;
+
+	if (!cas_store || !digests || (mb2_digest_index_get(digests, path, sha256) < 0)) {
+		return NULL;
+	}
+	blob = mb2_cas_blob_path(sha256);
+	if (stat(blob, &st) < 0) {
+		free(blob);
+		return NULL;
+	}
+
+	return blob;
+}
+
+/* number of writer threads storing received files */
+#define MB2_WRITER_THREADS 4
+/* maximum size of a data buffer handed over to a writer thread */
+#define MB2_WRITE_BUFFER_SIZE (1024 * 1024)
+/* maximum amount of received data waiting to be written */
+#define MB2_WRITE_QUEUE_MAX_SIZE (32 * 1024 * 1024)
+
+enum mb2_write_op {
+	MB2_WRITE_OPEN,
+	MB2_WRITE_DATA,
+	MB2_WRITE_CLOSE,
+	/* the file has not been received completely */
+	MB2_WRITE_CLOSE_INCOMPLETE
+};
+
+struct mb2_write_job {
+	enum mb2_write_op op;
+	char *path;
+	char *data;
+	uint32_t length;
+	struct mb2_write_job *next;
+};
+
+struct mb2_write_pipeline;
+
+struct mb2_writer {
+	struct mb2_write_pipeline *pipeline;
+	thread_t thread;
+	cond_t cond;
+	struct mb2_write_job *head;
+	struct mb2_write_job *tail;
+	FILE *f;
+	char *path;
+	uint64_t size;
+	int write_failed;
+	int digest_active;
+	struct mb2_digest_ctx digest;
+};
+
+struct mb2_write_pipeline {
+	mutex_t mutex;
+	cond_t space_cond;
+	uint64_t queued_size;
+	int finished;
+	unsigned int file_count;
+	struct mb2_digest_index *digests;
+	size_t backup_dir_len;
+	unsigned int num_threads;
+	struct mb2_writer writers[MB2_WRITER_THREADS];
+};
+
+static uint64_t mb2_write_job_size(struct mb2_write_job *job)
+{
+	/* account for the job itself so empty files are bounded as well */
+	return sizeof(struct mb2_write_job) + job->length;
+}
+
+static void mb2_write_job_free(struct mb2_write_job *job)
+{
+	free(job->path);
+	free(job->data);
+	free(job);
+}
+
+static void mb2_writer_close(struct mb2_writer *writer, int complete)
+{
+	struct mb2_digest_index *digests = writer->pipeline->digests;
+	const char *relpath = writer->path + writer->pipeline->backup_dir_len;
+	unsigned char sha1[MB2_SHA1_LENGTH];
+	unsigned char sha256[MB2_SHA256_LENGTH];
+	int have_stat = 0;
+	struct stat st;
+
+	/* flush first, so the modification time does not change anymore */
+	if (fflush(writer->f) != 0) {
+		writer->write_failed = 1;
+	}
+	have_stat = (fstat(fileno(writer->f), &st) == 0);
+	if (fclose(writer->f) != 0) {
+		writer->write_failed = 1;
+	}
+	writer->f = NULL;
+
+	if (!complete) {
+		/* a truncated file must neither be kept nor stored */
+		if (writer->digest_active) {
+			mb2_digest_abort(&writer->digest);
+			writer->digest_active = 0;
+		}
+		remove(writer->path);
+		return;
+	}
+	if (!digests) {
+		return;
+	}
+	if (writer->write_failed) {
+		if (writer->digest_active) {
+			mb2_digest_abort(&writer->digest);
+			writer->digest_active = 0;
+		}
+		/* keep track of the file, but without digests */
+		if (have_stat) {
+			mb2_digest_index_set(digests, relpath, st.st_size, st.st_mtime, NULL, NULL);
+		}
+		return;
+	}
+
+	if (writer->digest_active) {
+		writer->digest_active = 0;
+		mb2_digest_final(&writer->digest, sha1, sha256);
+		if (cas_store && (mb2_cas_store_file(writer->path, sha256) == 0)) {
+			/* the file is the blob now, which has its own modification time */
+			have_stat = (stat(writer->path, &st) == 0);
+		}
+		mb2_digest_index_set(digests, relpath, writer->size, (have_stat) ? st.st_mtime : 0, sha1, sha256);
+	} else {
+		mb2_digest_index_set(digests, relpath, writer->size, (have_stat) ? st.st_mtime : 0, NULL, NULL);
+	}
+}
+
+static void mb2_writer_process(struct mb2_writer *writer, struct mb2_write_job *job)
+{
+	struct mb2_digest_index *digests = writer->pipeline->digests;
+
+	switch (job->op) {
+	case MB2_WRITE_OPEN:
+		free(writer->path);
+		writer->path = job->path;
+		job->path = NULL;
+		writer->size = 0;
+		writer->write_failed = 0;
+		remove(writer->path);
+		if (digests) {
+			/* the old digest is stale, a new one is added once the file is complete */
+			mb2_digest_index_remove(digests, writer->path + writer->pipeline->backup_dir_len);
+		}
+		writer->f = fopen(writer->path, "wb");
+		if (!writer->f) {
+			printf("Error opening '%s' for writing: %s\n", writer->path, strerror(errno));
+		} else if (digests) {
+			writer->digest_active = (mb2_digest_init(&writer->digest) == 0);
 		}
-		err = mobilebackup2_send_raw(mobilebackup2, buf, r, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			goto leave_proto_err;
+		break;
+	case MB2_WRITE_DATA:
+		if (!writer->f) {
+			break;
 		}
-		if (bytes != (uint32_t)r) {
-			printf("Error: sent only %d of %d bytes\n", bytes, (int)r);
-			goto leave_proto_err;
+		if (fwrite(job->data, 1, job->length, writer->f) != job->length) {
+			printf("Error writing to '%s': %s\n", writer->path, strerror(errno));
+			writer->write_failed = 1;
 		}
-		sent += r;
-	} while (sent < total);
-	fclose(f);
-	f = NULL;
-	errcode = 0;
-
-leave:
-	if (errcode == 0) {
-		result = 0;
-		nlen = 1;
-		nlen = htobe32(nlen);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_SUCCESS;
-		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
-	} else {
-		if (!*errplist) {
-			*errplist = plist_new_dict();
+		if (writer->digest_active) {
+			mb2_digest_update(&writer->digest, job->data, job->length);
 		}
-		char *errdesc = strerror(errcode);
-		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
-
-		length = strlen(errdesc);
-		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_ERROR_LOCAL;
-		slen = 5;
-		memcpy(buf+slen, errdesc, length);
-		slen += length;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, slen, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			printf("could not send message\n");
+		writer->size += job->length;
+		break;
+	case MB2_WRITE_CLOSE:
+		if (writer->f) {
+			mb2_writer_close(writer, 1);
+			mutex_lock(&writer->pipeline->mutex);
+			writer->pipeline->file_count++;
+			mutex_unlock(&writer->pipeline->mutex);
 		}
-		if (bytes != slen) {
-			printf("could only send %d from %d\n", bytes, slen);
+		break;
+	case MB2_WRITE_CLOSE_INCOMPLETE:
+		if (writer->f) {
+			mb2_writer_close(writer, 0);
 		}
+		break;
+	default:
+		break;
 	}
-
-leave_proto_err:
-	if (f)
-		fclose(f);
-	free(localfile);
-	return result;
 }
 
-static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static void* mb2_writer_thread(void *arg)
 {
-	uint32_t cnt;
-	uint32_t i = 0;
-	uint32_t sent;
-	plist_t errplist = NULL;
+	struct mb2_writer *writer = (struct mb2_writer*)arg;
+	struct mb2_write_pipeline *pipeline = writer->pipeline;
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+	mutex_lock(&pipeline->mutex);
+	while (1) {
+		struct mb2_write_job *job;
+		while (!writer->head && !pipeline->finished) {
+			cond_wait(&writer->cond, &pipeline->mutex);
+		}
+		job = writer->head;
+		if (!job) {
+			break;
+		}
+		writer->head = job->next;
+		if (!writer->head) {
+			writer->tail = NULL;
+		}
+		mutex_unlock(&pipeline->mutex);
 
-	plist_t files = plist_array_get_item(message, 1);
-	cnt = plist_array_get_size(files);
+		mb2_writer_process(writer, job);
 
-	for (i = 0; i < cnt; i++) {
-		plist_t val = plist_array_get_item(files, i);
-		if (plist_get_node_type(val) != PLIST_STRING) {
-			continue;
-		}
-		char *str = NULL;
-		plist_get_string_val(val, &str);
-		if (!str)
-			continue;
+		mutex_lock(&pipeline->mutex);
+		pipeline->queued_size -= mb2_write_job_size(job);
+		cond_signal(&pipeline->space_cond);
+		mb2_write_job_free(job);
+	}
+	mutex_unlock(&pipeline->mutex);
 
-		if (mb2_handle_send_file(mobilebackup2, backup_dir, str, &errplist) < 0) {
-			free(str);
-			//printf("Error when sending file '%s' to device\n", str);
-			// TODO: perhaps we can continue, we've got a multi status response?!
+	return NULL;
+}
+
+/**
+ * Creates a pipeline writing received files below backup_dir. If digests
+ * is not NULL, the SHA-1 and SHA-256 digests of the files are computed
+ * while they are written and stored in it.
+ */
+static struct mb2_write_pipeline* mb2_write_pipeline_new(const char *backup_dir, struct mb2_digest_index *digests)
+{
+	struct mb2_write_pipeline *pipeline = (struct mb2_write_pipeline*)calloc(1, sizeof(struct mb2_write_pipeline));
+	unsigned int i;
+
+	if (!pipeline) {
+		return NULL;
+	}
+	pipeline->digests = digests;
+	/* paths in the digest index are relative to the backup directory,
+	 * string_build_path() joins them with a single slash */
+	pipeline->backup_dir_len = strlen(backup_dir) + 1;
+	mutex_init(&pipeline->mutex);
+	cond_init(&pipeline->space_cond);
+	for (i = 0; i < MB2_WRITER_THREADS; i++) {
+		pipeline->writers[i].pipeline = pipeline;
+		cond_init(&pipeline->writers[i].cond);
+	}
+	for (i = 0; i < MB2_WRITER_THREADS; i++) {
+		if (thread_new(&pipeline->writers[i].thread, mb2_writer_thread, &pipeline->writers[i]) != 0) {
 			break;
 		}
-		free(str);
+		pipeline->num_threads++;
+	}
+	if (pipeline->num_threads == 0) {
+		PRINT_VERBOSE(1, "Could not create writer threads, writing files synchronously.\n");
 	}
 
-	/* send terminating 0 dword */
-	uint32_t zero = 0;
-	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+	return pipeline;
+}
 
-	if (!errplist) {
-		plist_t emptydict = plist_new_dict();
-		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, emptydict);
-		plist_free(emptydict);
-	} else {
-		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
-		plist_free(errplist);
+/**
+ * Selects the writer for a file. Jobs for the same path always end up in
+ * the same queue so that they are written in the order they were received.
+ */
+static unsigned int mb2_write_pipeline_select(struct mb2_write_pipeline *pipeline, const char *path)
+{
+	unsigned int hash = 5381;
+
+	if (pipeline->num_threads == 0) {
+		return 0;
+	}
+	while (*path) {
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
 	}
+	return hash % pipeline->num_threads;
 }
 
-static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+/**
+ * Queues a job for a writer, which takes over path and data.
+ *
+ * @return 0 on success, -1 if the job could not be queued, in which case
+ *   path and data are freed.
+ */
+static int mb2_write_pipeline_push(struct mb2_write_pipeline *pipeline, unsigned int writer_index, enum mb2_write_op op, char *path, char *data, uint32_t length)
 {
-	uint32_t nlen = 0;
-	uint32_t rlen = 0;
+	struct mb2_writer *writer = &pipeline->writers[writer_index];
+	struct mb2_write_job *job = (struct mb2_write_job*)malloc(sizeof(struct mb2_write_job));
+	uint64_t size;
 
-	do {
-		nlen = 0;
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
-		nlen = be32toh(nlen);
+	if (!job) {
+		free(path);
+		free(data);
+		return -1;
+	}
+	job->op = op;
+	job->path = path;
+	job->data = data;
+	job->length = length;
+	job->next = NULL;
 
-		if ((nlen == 0) && (rlen == 4)) {
-			// a zero length means no more files to receive
-			return 0;
-		} else if(rlen == 0) {
-			// device needs more time, waiting...
-			continue;
-		} else if (nlen > 4096) {
-			// filename length is too large
-			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
-			return 0;
-		}
+	if (pipeline->num_threads == 0) {
+		mb2_writer_process(writer, job);
+		mb2_write_job_free(job);
+		return 0;
+	}
 
-		if (*filename != NULL) {
-			free(*filename);
-			*filename = NULL;
-		}
+	size = mb2_write_job_size(job);
+	mutex_lock(&pipeline->mutex);
+	while ((pipeline->queued_size > 0) && (pipeline->queued_size + size > MB2_WRITE_QUEUE_MAX_SIZE)) {
+		cond_wait(&pipeline->space_cond, &pipeline->mutex);
+	}
+	pipeline->queued_size += size;
+	if (writer->tail) {
+		writer->tail->next = job;
+	} else {
+		writer->head = job;
+	}
+	writer->tail = job;
+	cond_signal(&writer->cond);
+	mutex_unlock(&pipeline->mutex);
 
-		*filename = (char*)malloc(nlen+1);
+	return 0;
+}
 
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
-		if (rlen != nlen) {
-			printf("ERROR: %s: could not read filename\n", __func__);
-			return 0;
-		}
+/**
+ * Waits until all queued jobs are written, stops the writer threads and
+ * frees the pipeline.
+ *
+ * @return The number of files that have been written.
+ */
+static unsigned int mb2_write_pipeline_finish(struct mb2_write_pipeline *pipeline)
+{
+	unsigned int file_count;
+	unsigned int i;
 
-		char* p = *filename;
-		p[rlen] = 0;
+	mutex_lock(&pipeline->mutex);
+	pipeline->finished = 1;
+	for (i = 0; i < pipeline->num_threads; i++) {
+		cond_signal(&pipeline->writers[i].cond);
+	}
+	mutex_unlock(&pipeline->mutex);
 
-		break;
-	} while(1 && !quit_flag);
+	for (i = 0; i < MB2_WRITER_THREADS; i++) {
+		struct mb2_writer *writer = &pipeline->writers[i];
+		if (i < pipeline->num_threads) {
+			thread_join(writer->thread);
+			thread_free(writer->thread);
+		}
+		if (writer->f) {
+			/* incomplete file, don't keep it */
+			mb2_writer_close(writer, 0);
+		}
+		free(writer->path);
+		cond_destroy(&writer->cond);
+	}
+	file_count = pipeline->file_count;
+	cond_destroy(&pipeline->space_cond);
+	mutex_destroy(&pipeline->mutex);
+	free(pipeline);
 
-	return nlen;
+	return file_count;
 }
 
-static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, struct mb2_digest_index *digests)
 {
 	uint64_t backup_real_size = 0;
 	uint64_t backup_total_size = 0;
@@ -713,18 +2182,29 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 	uint32_t rlen;
 	uint32_t nlen = 0;
 	uint32_t r;
-	char buf[32768];
+	char *buf = NULL;
+	uint32_t buflen = 0;
+	uint32_t bufsize = 0;
 	char *fname = NULL;
 	char *dname = NULL;
 	char *bname = NULL;
 	char code = 0;
 	char last_code = 0;
 	plist_t node = NULL;
-	FILE *f = NULL;
+	struct mb2_write_pipeline *pipeline = NULL;
+	unsigned int writer_index = 0;
 	unsigned int file_count = 0;
+	int complete = 0;
+	int failed = 0;
 
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
 
+	pipeline = mb2_write_pipeline_new(backup_dir, digests);
+	if (!pipeline) {
+		printf("ERROR: %s: out of memory\n", __func__);
+		return 0;
+	}
+
 	node = plist_array_get_item(message, 3);
 	if (plist_get_node_type(node) == PLIST_UINT) {
 		plist_get_uint_val(node, &backup_total_size);
@@ -782,33 +2262,62 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
 		}
 
-		remove(bname);
-		f = fopen(bname, "wb");
-		while (f && (code == CODE_FILE_DATA)) {
+		/* file creation and writing is done by the writer threads */
+		writer_index = mb2_write_pipeline_select(pipeline, bname);
+		char *path = strdup(bname);
+		if (!path || (mb2_write_pipeline_push(pipeline, writer_index, MB2_WRITE_OPEN, path, NULL, 0) < 0)) {
+			printf("ERROR: %s: out of memory\n", __func__);
+			nlen = 0;
+			break;
+		}
+		complete = 1;
+		while (code == CODE_FILE_DATA) {
 			blocksize = nlen-1;
 			bdone = 0;
 			rlen = 0;
 			while (bdone < blocksize) {
-				if ((blocksize - bdone) < sizeof(buf)) {
+				if (!buf) {
+					bufsize = blocksize - bdone;
+					if (bufsize > MB2_WRITE_BUFFER_SIZE) {
+						bufsize = MB2_WRITE_BUFFER_SIZE;
+					}
+					buf = (char*)malloc(bufsize);
+					if (!buf) {
+						failed = 1;
+						break;
+					}
+					buflen = 0;
+				}
+				rlen = bufsize - buflen;
+				if ((blocksize - bdone) < rlen) {
 					rlen = blocksize - bdone;
-				} else {
-					rlen = sizeof(buf);
 				}
-				mobilebackup2_receive_raw(mobilebackup2, buf, rlen, &r);
+				mobilebackup2_receive_raw(mobilebackup2, buf + buflen, rlen, &r);
 				if ((int)r <= 0) {
 					break;
 				}
-				fwrite(buf, 1, r, f);
+				buflen += r;
 				bdone += r;
+				if (buflen == bufsize) {
+					failed = (mb2_write_pipeline_push(pipeline, writer_index, MB2_WRITE_DATA, NULL, buf, buflen) < 0);
+					buf = NULL;
+					if (failed) {
+						break;
+					}
+				}
 			}
 			if (bdone == blocksize) {
 				backup_real_size += blocksize;
+			} else {
+				complete = 0;
 			}
 			if (backup_total_size > 0) {
 				print_progress(backup_real_size, backup_total_size);
 			}
-			if (quit_flag)
+			if (quit_flag || failed) {
+				complete = 0;
 				break;
+			}
 			nlen = 0;
 			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
 			nlen = be32toh(nlen);
@@ -819,11 +2328,24 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 				break;
 			}
 		}
-		if (f) {
-			fclose(f);
-			file_count++;
-		} else {
-			printf("Error opening '%s' for writing: %s\n", bname, strerror(errno));
+		if (buf) {
+			if (mb2_write_pipeline_push(pipeline, writer_index, MB2_WRITE_DATA, NULL, buf, buflen) < 0) {
+				failed = 1;
+				complete = 0;
+			}
+			buf = NULL;
+		}
+		/* the data ends with a success or, after file data, an error code */
+		if ((nlen == 0) || ((code != CODE_SUCCESS) && !((code == CODE_ERROR_REMOTE) && (last_code == CODE_FILE_DATA)))) {
+			complete = 0;
+		}
+		/* if this can't be queued, finishing the pipeline discards the file */
+		mb2_write_pipeline_push(pipeline, writer_index, (complete) ? MB2_WRITE_CLOSE : MB2_WRITE_CLOSE_INCOMPLETE, NULL, NULL, 0);
+		if (failed) {
+			/* the rest of the data can't be received, give up like on receive errors */
+			printf("ERROR: %s: out of memory\n", __func__);
+			nlen = 0;
+			break;
 		}
 		if (nlen == 0) {
 			break;
@@ -846,6 +2368,9 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 	if (fname != NULL)
 		free(fname);
 
+	/* wait for the writer threads to store all received data */
+	file_count = mb2_write_pipeline_finish(pipeline);
+
 	/* if there are leftovers to read, finish up cleanly */
 	if ((int)nlen-1 > 0) {
 		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
@@ -853,6 +2378,9 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
 		free(fname);
 		remove(bname);
+		if (digests) {
+			mb2_digest_index_remove(digests, bname + strlen(backup_dir) + 1);
+		}
 	}
 
 	/* clean up */
@@ -870,7 +2398,7 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 	return file_count;
 }
 
-static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, struct mb2_digest_index *digests)
 {
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
 
@@ -886,38 +2414,51 @@ static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plis
 	}
 
 	char *path = string_build_path(backup_dir, str, NULL);
-	free(str);
 
 	plist_t dirlist = plist_new_dict();
 
+	/* the index can answer for directories whose entries it all knows */
+	if (digests && (mb2_digest_index_list_directory(digests, backup_dir, str, dirlist) == 0)) {
+		goto leave;
+	}
+
+	struct stat dst;
+	int64_t dir_mtime = (stat(path, &dst) == 0) ? dst.st_mtime : 0;
 	DIR* cur_dir = opendir(path);
 	if (cur_dir) {
 		struct dirent* ep;
+		if (digests) {
+			mb2_digest_index_refresh_start(digests);
+		}
 		while ((ep = readdir(cur_dir))) {
 			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
 				continue;
 			}
+			if (!strncmp(ep->d_name, MB2_DIGEST_INDEX_FILE, strlen(MB2_DIGEST_INDEX_FILE))) {
+				/* our own index, not part of the backup */
+				continue;
+			}
 			char *fpath = string_build_path(path, ep->d_name, NULL);
 			if (fpath) {
-				plist_t fdict = plist_new_dict();
 				struct stat st;
-				stat(fpath, &st);
-				const char *ftype = "DLFileTypeUnknown";
-				if (S_ISDIR(st.st_mode)) {
-					ftype = "DLFileTypeDirectory";
-				} else if (S_ISREG(st.st_mode)) {
-					ftype = "DLFileTypeRegular";
+				if (stat(fpath, &st) < 0) {
+					memset(&st, '\0', sizeof(st));
+				}
+				mb2_dirlist_add(dirlist, ep->d_name, S_ISDIR(st.st_mode), S_ISREG(st.st_mode), st.st_size, st.st_mtime);
+				if (digests && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+					mb2_digest_index_refresh_entry(digests, fpath + strlen(backup_dir) + 1, &st);
 				}
-				plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
-				plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
-				plist_dict_set_item(fdict, "DLFileModificationDate", plist_new_date(st.st_mtime, 0));
-
-				plist_dict_set_item(dirlist, ep->d_name, fdict);
 				free(fpath);
 			}
 		}
 		closedir(cur_dir);
+		if (digests && (dir_mtime != 0)) {
+			mb2_digest_index_refresh_done(digests, str, dir_mtime);
+		}
 	}
+
+leave:
+	free(str);
 	free(path);
 
 	/* TODO error handling */
@@ -928,7 +2469,7 @@ static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plis
 	}
 }
 
-static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, struct mb2_digest_index *digests)
 {
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
 
@@ -939,7 +2480,8 @@ static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plis
 	plist_get_string_val(dir, &str);
 
 	char *newpath = string_build_path(backup_dir, str, NULL);
-	free(str);
+	struct stat st;
+	int existed = (stat(newpath, &st) == 0);
 
 	if (mkdir_with_parents(newpath, 0755) < 0) {
 		errdesc = strerror(errno);
@@ -948,6 +2490,11 @@ static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plis
 		}
 		errcode = errno_to_device_error(errno);
 	}
+	if (digests && (errcode == 0)) {
+		/* a new directory is empty, so the index knows all of its entries */
+		mb2_digest_index_add_directory(digests, str, !existed);
+	}
+	free(str);
 	free(newpath);
 	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
 	if (err != MOBILEBACKUP2_E_SUCCESS) {
@@ -955,27 +2502,42 @@ static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plis
 	}
 }
 
-static void mb2_copy_file_by_path(const char *src, const char *dst)
+/**
+ * Copies the file src to dst.
+ *
+ * @return 0 on success, -1 if the file could not be copied completely.
+ */
+static int mb2_copy_file_by_path(const char *src, const char *dst)
 {
 	FILE *from, *to;
 	char buf[BUFSIZ];
 	size_t length;
+	int res = 0;
 
 	/* open source file */
 	if ((from = fopen(src, "rb")) == NULL) {
 		printf("Cannot open source path '%s'.\n", src);
-		return;
+		return -1;
 	}
 
-	/* open destination file */
+	/* open destination file, as a new file so that a hard link into the
+	 * content store is never written through */
+	remove(dst);
 	if ((to = fopen(dst, "wb")) == NULL) {
 		printf("Cannot open destination file '%s'.\n", dst);
-		return;
+		fclose(from);
+		return -1;
 	}
 
 	/* copy the file */
 	while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
-		fwrite(buf, 1, length, to);
+		if (fwrite(buf, 1, length, to) != length) {
+			res = -1;
+			break;
+		}
+	}
+	if (ferror(from)) {
+		res = -1;
 	}
 
 	if(fclose(from) == EOF) {
@@ -984,10 +2546,48 @@ static void mb2_copy_file_by_path(const char *src, const char *dst)
 
 	if(fclose(to) == EOF) {
 		printf("Error closing destination file.\n");
+		res = -1;
+	}
+
+	if (res < 0) {
+		printf("Error copying '%s' to '%s'.\n", src, dst);
+	}
+
+	return res;
+}
+
+/**
+ * Copies a file and updates its entry in the index. Nothing is copied if
+ * the index knows both files to be identical already.
+ */
+static void mb2_copy_file_indexed(const char *src, const char *dst, struct mb2_digest_index *digests, size_t rel_offset)
+{
+	if (!digests) {
+		mb2_copy_file_by_path(src, dst);
+		return;
+	}
+	if (mb2_digest_index_same_contents(digests, src + rel_offset, dst + rel_offset)) {
+		return;
+	}
+	if (mb2_copy_file_by_path(src, dst) == 0) {
+		mb2_digest_index_relocate(digests, src + rel_offset, dst + rel_offset, 1);
+	} else {
+		/* whatever is left at dst has no known digests */
+		struct stat st;
+		if (stat(dst, &st) == 0) {
+			mb2_digest_index_set(digests, dst + rel_offset, st.st_size, st.st_mtime, NULL, NULL);
+		} else {
+			mb2_digest_index_remove(digests, dst + rel_offset);
+		}
 	}
 }
 
-static void mb2_copy_directory_by_path(const char *src, const char *dst)
+/**
+ * Copies the files in directory src to dst. Files the index knows to be
+ * identical already are skipped; rel_offset is the length of the backup
+ * directory prefix of src and dst.
+ */
+static void mb2_copy_directory_by_path(const char *src, const char *dst, struct mb2_digest_index *digests, size_t rel_offset)
 {
 	if (!src || !dst) {
 		return;
@@ -1022,7 +2622,7 @@ static void mb2_copy_directory_by_path(const char *src, const char *dst)
 			char *dstpath = string_build_path(dst, ep->d_name, NULL);
 			if (srcpath && dstpath) {
 				/* copy file */
-				mb2_copy_file_by_path(srcpath, dstpath);
+				mb2_copy_file_indexed(srcpath, dstpath, digests, rel_offset);
 
 				free(srcpath);
 				free(dstpath);
@@ -1137,6 +2737,8 @@ static void print_usage(int argc, char **argv)
 	printf("  -u, --udid UDID\ttarget specific device by its 40-digit device UDID\n");
 	printf("  -s, --source UDID\tuse backup data from device specified by UDID\n");
 	printf("  -i, --interactive\trequest passwords interactively\n");
+	printf("  --cas-store DIR\tstore each unique file once in DIR and hard link to it,\n");
+	printf("  \t\t\tfiles missing or unreadable in the backup are restored from DIR\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 	printf("Homepage: <http://libimobiledevice.org>\n");
@@ -1161,6 +2763,7 @@ int main(int argc, char *argv[])
 	struct stat st;
 	plist_t node_tmp = NULL;
 	plist_t info_plist = NULL;
+	struct mb2_digest_index *digest_index = NULL;
 	plist_t opts = NULL;
 	mobilebackup2_error_t err;
 
@@ -1172,6 +2775,11 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
+#ifndef HAVE_OPENSSL
+	/* libgcrypt has to be initialized before the file digests use it */
+	gcry_check_version(NULL);
+#endif
+
 	/* parse cmdline args */
 	for (i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
@@ -1200,6 +2808,15 @@ int main(int argc, char *argv[])
 			interactive_mode = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "--cas-store")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			cas_store = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -1356,6 +2973,21 @@ int main(int argc, char *argv[])
 			printf("ERROR: Backup directory \"%s\" does not exist!\n", backup_directory);
 			return -1;
 		}
+
+		if (cas_store) {
+			struct stat cst;
+			if ((stat(cas_store, &cst) != 0) || !S_ISDIR(cst.st_mode)) {
+				printf("ERROR: Content store directory \"%s\" does not exist!\n", cas_store);
+				return -1;
+			}
+#ifndef WIN32
+			/* hard links can't cross file systems */
+			if (cst.st_dev != st.st_dev) {
+				printf("ERROR: Content store directory \"%s\" must be on the same file system as the backup directory!\n", cas_store);
+				return -1;
+			}
+#endif
+		}
 	}
 
 	idevice_t device = NULL;
@@ -1615,10 +3247,23 @@ checkpoint:
 				plist_free(info_plist);
 				info_plist = NULL;
 			}
+			/* digests and metadata of the backup files are kept in a sidecar index */
+			digest_index = mb2_digest_index_new();
+			if (digest_index) {
+				char *digest_path = string_build_path(backup_directory, udid, MB2_DIGEST_INDEX_FILE, NULL);
+				mb2_digest_index_load(digest_index, backup_directory, digest_path, udid);
+				free(digest_path);
+			}
+
 			info_plist = mobilebackup_factory_info_plist_new(udid, lockdown, afc);
 			remove(info_path);
 			plist_write_to_filename(info_plist, info_path, PLIST_FORMAT_XML);
 			free(info_path);
+			if (digest_index) {
+				char *info_relpath = string_build_path(udid, "Info.plist", NULL);
+				mb2_digest_index_set_from_file(digest_index, backup_directory, info_relpath);
+				free(info_relpath);
+			}
 
 			plist_free(info_plist);
 			info_plist = NULL;
@@ -1665,6 +3310,14 @@ checkpoint:
 				break;
 			}
 
+			/* used for directory listings and to find files in the content store */
+			digest_index = mb2_digest_index_new();
+			if (digest_index) {
+				char *digest_path = string_build_path(backup_directory, source_udid, MB2_DIGEST_INDEX_FILE, NULL);
+				mb2_digest_index_load(digest_index, backup_directory, digest_path, source_udid);
+				free(digest_path);
+			}
+
 			PRINT_VERBOSE(1, "Starting Restore...\n");
 
 			opts = plist_new_dict();
@@ -1837,11 +3490,11 @@ checkpoint:
 				if (!strcmp(dlmsg, "DLMessageDownloadFiles")) {
 					/* device wants to download files from the computer */
 					mb2_set_overall_progress_from_message(message, dlmsg);
-					mb2_handle_send_files(mobilebackup2, message, backup_directory);
+					mb2_handle_send_files(mobilebackup2, message, backup_directory, digest_index);
 				} else if (!strcmp(dlmsg, "DLMessageUploadFiles")) {
 					/* device wants to send files to the computer */
 					mb2_set_overall_progress_from_message(message, dlmsg);
-					file_count += mb2_handle_receive_files(mobilebackup2, message, backup_directory);
+					file_count += mb2_handle_receive_files(mobilebackup2, message, backup_directory, digest_index);
 				} else if (!strcmp(dlmsg, "DLMessageGetFreeDiskSpace")) {
 					/* device wants to know how much disk space is available on the computer */
 					uint64_t freespace = 0;
@@ -1863,10 +3516,10 @@ checkpoint:
 					plist_free(freespace_item);
 				} else if (!strcmp(dlmsg, "DLContentsOfDirectory")) {
 					/* list directory contents */
-					mb2_handle_list_directory(mobilebackup2, message, backup_directory);
+					mb2_handle_list_directory(mobilebackup2, message, backup_directory, digest_index);
 				} else if (!strcmp(dlmsg, "DLMessageCreateDirectory")) {
 					/* make a directory */
-					mb2_handle_make_directory(mobilebackup2, message, backup_directory);
+					mb2_handle_make_directory(mobilebackup2, message, backup_directory, digest_index);
 				} else if (!strcmp(dlmsg, "DLMessageMoveFiles") || !strcmp(dlmsg, "DLMessageMoveItems")) {
 					/* perform a series of rename operations */
 					mb2_set_overall_progress_from_message(message, dlmsg);
@@ -1887,7 +3540,6 @@ checkpoint:
 								plist_get_string_val(val, &str);
 								if (str) {
 									char *newpath = string_build_path(backup_directory, str, NULL);
-									free(str);
 									char *oldpath = string_build_path(backup_directory, key, NULL);
 
 #ifdef WIN32
@@ -1902,8 +3554,14 @@ checkpoint:
 										printf("Renameing '%s' to '%s' failed: %s (%d)\n", oldpath, newpath, strerror(errno), errno);
 										errcode = errno_to_device_error(errno);
 										errdesc = strerror(errno);
+										free(str);
 										break;
 									}
+									if (digest_index) {
+										mb2_digest_index_remove(digest_index, str);
+										mb2_digest_index_relocate(digest_index, key, str, 0);
+									}
+									free(str);
 									free(oldpath);
 									free(newpath);
 								}
@@ -1945,7 +3603,7 @@ checkpoint:
 									}
 								}
 								char *newpath = string_build_path(backup_directory, str, NULL);
-								free(str);
+								int removed = 1;
 #ifdef WIN32
 								int res = 0;
 								if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode))
@@ -1958,6 +3616,7 @@ checkpoint:
 										printf("Could not remove '%s': %s (%d)\n", newpath, strerror(e), e);
 									errcode = errno_to_device_error(e);
 									errdesc = strerror(e);
+									removed = (e == ENOENT);
 								}
 #else
 								if (remove(newpath) < 0) {
@@ -1965,8 +3624,14 @@ checkpoint:
 										printf("Could not remove '%s': %s (%d)\n", newpath, strerror(errno), errno);
 									errcode = errno_to_device_error(errno);
 									errdesc = strerror(errno);
+									removed = (errno == ENOENT);
 								}
 #endif
+								if (digest_index && removed) {
+									/* only forget what is gone from the disk */
+									mb2_digest_index_remove(digest_index, str);
+								}
+								free(str);
 								free(newpath);
 							}
 						}
@@ -1995,9 +3660,9 @@ checkpoint:
 
 							/* check that src exists */
 							if ((stat(oldpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-								mb2_copy_directory_by_path(oldpath, newpath);
+								mb2_copy_directory_by_path(oldpath, newpath, digest_index, strlen(backup_directory) + 1);
 							} else if ((stat(oldpath, &st) == 0) && S_ISREG(st.st_mode)) {
-								mb2_copy_file_by_path(oldpath, newpath);
+								mb2_copy_file_indexed(oldpath, newpath, digest_index, strlen(backup_directory) + 1);
 							}
 
 							free(newpath);
@@ -2105,6 +3770,11 @@ files_out:
 				break;
 				case CMD_BACKUP:
 					PRINT_VERBOSE(1, "Received %d files from device.\n", file_count);
+					if (digest_index) {
+						char *digest_path = string_build_path(backup_directory, udid, MB2_DIGEST_INDEX_FILE, NULL);
+						mb2_digest_index_save(digest_index, backup_directory, digest_path, udid);
+						free(digest_path);
+					}
 					if (operation_ok && mb2_status_check_snapshot_state(backup_directory, udid, "finished")) {
 						PRINT_VERBOSE(1, "Backup Successful.\n");
 					} else {
@@ -2216,6 +3886,8 @@ files_out:
 		source_udid = NULL;
 	}
 
+	mb2_digest_index_free(digest_index);
+
 	return result_code;
 }
 
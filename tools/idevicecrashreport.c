@@ -37,6 +37,8 @@
 #define S_IFSOCK S_IFREG
 #endif
 
+#define CRASH_REPORT_COPY_CONNECTIONS 4
+
 const char* target_directory = NULL;
 static int extract_raw_crash_reports = 0;
 static int keep_crash_reports = 0;
@@ -89,200 +91,140 @@ static int extract_raw_crash_report(const char* filename) {
 	return res;
 }
 
-static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char* device_directory, const char* host_directory)
-{
-	afc_error_t afc_error;
-	int k;
-	int res = -1;
-	int crash_report_count = 0;
-	uint64_t handle;
-	char source_filename[512];
-	char target_filename[512];
-
-	if (!afc)
-		return res;
+struct crash_report_copy {
+	/* device paths to remove once the copy is done, in the order the
+	 * entries were reported, i.e. directories after their contents */
+	char **remove_paths;
+	uint32_t num_remove;
+	uint32_t max_remove;
+};
 
-	char** list = NULL;
-	afc_error = afc_read_directory(afc, device_directory, &list);
-	if (afc_error != AFC_E_SUCCESS) {
-		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
-		return res;
+static void crash_report_copy_remove_later(struct crash_report_copy *crc, const char *device_path)
+{
+	char *path = NULL;
+
+	if (crc->num_remove == crc->max_remove) {
+		uint32_t max_remove = (crc->max_remove) ? crc->max_remove * 2 : 64;
+		char **remove_paths = (char**)realloc(crc->remove_paths, max_remove * sizeof(char*));
+		if (!remove_paths) {
+			fprintf(stderr, "ERROR: Out of memory, '%s' is kept on the device\n", device_path);
+			return;
+		}
+		crc->remove_paths = remove_paths;
+		crc->max_remove = max_remove;
 	}
 
-	/* ensure we have a trailing slash */
-	strcpy(source_filename, device_directory);
-	if (source_filename[strlen(source_filename)-1] != '/') {
-		strcat(source_filename, "/");
+	path = strdup(device_path);
+	if (!path) {
+		fprintf(stderr, "ERROR: Out of memory, '%s' is kept on the device\n", device_path);
+		return;
 	}
-	int device_directory_length = strlen(source_filename);
+	crc->remove_paths[crc->num_remove++] = path;
+}
+
+static int crash_report_copy_cb(const afc_tree_entry_t *entry, void *user_data)
+{
+	struct crash_report_copy *crc = (struct crash_report_copy*)user_data;
+	char* target_filename = strdup(entry->local_path);
 
-	/* ensure we have a trailing slash */
-	strcpy(target_filename, host_directory);
-	if (target_filename[strlen(target_filename)-1] != '/') {
-		strcat(target_filename, "/");
+	/* make sure to strip ".synced" extension as seen on iOS 5 */
+	char* p = strrchr(target_filename, '.');
+	if (p != NULL && !strcmp(p, ".synced")) {
+		*p = '\0';
 	}
-	int host_directory_length = strlen(target_filename);
 
-	/* loop over file entries */
-	for (k = 0; list[k]; k++) {
-		if (!strcmp(list[k], ".") || !strcmp(list[k], "..")) {
-			continue;
+	if (entry->error != AFC_E_SUCCESS) {
+		if (entry->type == AFC_TREE_ENTRY_DIRECTORY) {
+			fprintf(stderr, "ERROR: Could not read device directory '%s'\n", entry->device_path);
+		} else if (entry->type == AFC_TREE_ENTRY_UNKNOWN) {
+			printf("Failed to read information for '%s'. Skipping...\n", entry->device_path);
+		} else if (entry->error != AFC_E_OBJECT_NOT_FOUND) {
+			fprintf(stderr, "Unable to copy device file '%s' (%d). Skipping...\n", entry->device_path, entry->error);
 		}
+		free(target_filename);
+		return 0;
+	}
 
-		char **fileinfo = NULL;
-		struct stat stbuf;
-		stbuf.st_size = 0;
+	if (entry->type == AFC_TREE_ENTRY_LINK && entry->link_target) {
+		/* report latest crash report filename */
+		printf("Link: %s\n", target_filename + strlen(target_directory));
 
-		/* assemble absolute source filename */
-		strcpy(((char*)source_filename) + device_directory_length, list[k]);
+		/* remove any previous symlink */
+		if (file_exists(target_filename)) {
+			remove(target_filename);
+		}
 
-		/* assemble absolute target filename */
-		char* p = strrchr(list[k], '.');
-		if (p != NULL && !strncmp(p, ".synced", 7)) {
-			/* make sure to strip ".synced" extension as seen on iOS 5 */
-			strncpy(((char*)target_filename) + host_directory_length, list[k], strlen(list[k]) - 7);
+#ifndef WIN32
+		/* use relative filename */
+		const char* b = strrchr(entry->link_target, '/');
+		if (b == NULL) {
+			b = entry->link_target;
 		} else {
-			strcpy(((char*)target_filename) + host_directory_length, list[k]);
+			b++;
 		}
 
-		/* get file information */
-		afc_get_file_info(afc, source_filename, &fileinfo);
-		if (!fileinfo) {
-			printf("Failed to read information for '%s'. Skipping...\n", source_filename);
-			continue;
+		/* create a symlink pointing to latest log */
+		if (symlink(b, target_filename) < 0) {
+			fprintf(stderr, "Can't create symlink to %s\n", b);
 		}
-
-		/* parse file information */
-		int i;
-		for (i = 0; fileinfo[i]; i+=2) {
-			if (!strcmp(fileinfo[i], "st_size")) {
-				stbuf.st_size = atoll(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_ifmt")) {
-				if (!strcmp(fileinfo[i+1], "S_IFREG")) {
-					stbuf.st_mode = S_IFREG;
-				} else if (!strcmp(fileinfo[i+1], "S_IFDIR")) {
-					stbuf.st_mode = S_IFDIR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFLNK")) {
-					stbuf.st_mode = S_IFLNK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFBLK")) {
-					stbuf.st_mode = S_IFBLK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFCHR")) {
-					stbuf.st_mode = S_IFCHR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFIFO")) {
-					stbuf.st_mode = S_IFIFO;
-				} else if (!strcmp(fileinfo[i+1], "S_IFSOCK")) {
-					stbuf.st_mode = S_IFSOCK;
-				}
-			} else if (!strcmp(fileinfo[i], "st_nlink")) {
-				stbuf.st_nlink = atoi(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_mtime")) {
-				stbuf.st_mtime = (time_t)(atoll(fileinfo[i+1]) / 1000000000);
-			} else if (!strcmp(fileinfo[i], "LinkTarget")) {
-				/* report latest crash report filename */
-				printf("Link: %s\n", (char*)target_filename + strlen(target_directory));
-
-				/* remove any previous symlink */
-				if (file_exists(target_filename)) {
-					remove(target_filename);
-				}
-
-#ifndef WIN32
-				/* use relative filename */
-				char* b = strrchr(fileinfo[i+1], '/');
-				if (b == NULL) {
-					b = fileinfo[i+1];
-				} else {
-					b++;
-				}
-
-				/* create a symlink pointing to latest log */
-				if (symlink(b, target_filename) < 0) {
-					fprintf(stderr, "Can't create symlink to %s\n", b);
-				}
 #endif
 
-				if (!keep_crash_reports)
-					afc_remove_path(afc, source_filename);
-
-				res = 0;
-			}
+		if (!keep_crash_reports)
+			crash_report_copy_remove_later(crc, entry->device_path);
+	} else if (entry->type == AFC_TREE_ENTRY_DIRECTORY) {
+		/* remove directory from device, all of its contents are done */
+		if (!keep_crash_reports)
+			crash_report_copy_remove_later(crc, entry->device_path);
+	} else if (entry->type == AFC_TREE_ENTRY_FILE) {
+		if (strcmp(target_filename, entry->local_path) != 0) {
+			rename(entry->local_path, target_filename);
 		}
 
-		/* free file information */
-		afc_dictionary_free(fileinfo);
-
-		/* recurse into child directories */
-		if (S_ISDIR(stbuf.st_mode)) {
-#ifdef WIN32
-			mkdir(target_filename);
-#else
-			mkdir(target_filename, 0755);
-#endif
-			res = afc_client_copy_and_remove_crash_reports(afc, source_filename, target_filename);
-
-			/* remove directory from device */
-			if (!keep_crash_reports)
-				afc_remove_path(afc, source_filename);
-		} else if (S_ISREG(stbuf.st_mode)) {
-			/* copy file to host */
-			afc_error = afc_file_open(afc, source_filename, AFC_FOPEN_RDONLY, &handle);
-			if(afc_error != AFC_E_SUCCESS) {
-				if (afc_error == AFC_E_OBJECT_NOT_FOUND) {
-					continue;
-				}
-				fprintf(stderr, "Unable to open device file '%s' (%d). Skipping...\n", source_filename, afc_error);
-				continue;
-			}
+		printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move") , target_filename + strlen(target_directory));
 
-			FILE* output = fopen(target_filename, "wb");
-			if(output == NULL) {
-				fprintf(stderr, "Unable to open local file '%s'. Skipping...\n", target_filename);
-				afc_file_close(afc, handle);
-				continue;
-			}
+		/* remove file from device */
+		if (!keep_crash_reports) {
+			crash_report_copy_remove_later(crc, entry->device_path);
+		}
 
-			printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move") , (char*)target_filename + strlen(target_directory));
+		/* extract raw crash information into separate '.crash' file */
+		if (extract_raw_crash_reports) {
+			extract_raw_crash_report(target_filename);
+		}
+	}
 
-			uint32_t bytes_read = 0;
-			uint32_t bytes_total = 0;
-			unsigned char data[0x1000];
+	free(target_filename);
 
-			afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			while(afc_error == AFC_E_SUCCESS && bytes_read > 0) {
-				fwrite(data, 1, bytes_read, output);
-				bytes_total += bytes_read;
-				afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			}
-			afc_file_close(afc, handle);
-			fclose(output);
+	return 0;
+}
 
-			if ((uint32_t)stbuf.st_size != bytes_total) {
-				fprintf(stderr, "File size mismatch. Skipping...\n");
-				continue;
-			}
+static int afc_client_copy_and_remove_crash_reports(afc_client_t *afc, uint32_t num_afc, const char* device_directory, const char* host_directory)
+{
+	struct crash_report_copy crc;
+	afc_error_t afc_error;
+	uint32_t i;
 
-			/* remove file from device */
-			if (!keep_crash_reports) {
-				afc_remove_path(afc, source_filename);
-			}
+	if (!afc || num_afc == 0)
+		return -1;
 
-			/* extract raw crash information into separate '.crash' file */
-			if (extract_raw_crash_reports) {
-				extract_raw_crash_report(target_filename);
-			}
+	memset(&crc, '\0', sizeof(crc));
 
-			crash_report_count++;
+	afc_error = afc_tree_copy(afc, num_afc, device_directory, host_directory, crash_report_copy_cb, &crc);
 
-			res = 0;
-		}
+	/* the workers use all connections until the copy returns, so the copied
+	 * entries are only removed from the device now */
+	for (i = 0; i < crc.num_remove; i++) {
+		afc_remove_path(afc[0], crc.remove_paths[i]);
+		free(crc.remove_paths[i]);
 	}
-	afc_dictionary_free(list);
+	free(crc.remove_paths);
 
-	/* no reports, no error */
-	if (crash_report_count == 0)
-		res = 0;
+	if (afc_error != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
+		return -1;
+	}
 
-	return res;
+	return 0;
 }
 
 static void print_usage(int argc, char **argv)
@@ -304,7 +246,8 @@ static void print_usage(int argc, char **argv)
 int main(int argc, char* argv[]) {
 	idevice_t device = NULL;
 	lockdownd_client_t lockdownd = NULL;
-	afc_client_t afc = NULL;
+	afc_client_t afc[CRASH_REPORT_COPY_CONNECTIONS];
+	uint32_t num_afc = 0;
 
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	lockdownd_error_t lockdownd_error = LOCKDOWN_E_SUCCESS;
@@ -427,38 +370,41 @@ int main(int argc, char* argv[]) {
 		return -1;
 	}
 
-	lockdownd_error = lockdownd_start_service(lockdownd, "com.apple.crashreportcopymobile", &service);
-	if (lockdownd_error != LOCKDOWN_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
-		idevice_free(device);
-		return -1;
+	/* use several connections to copy the crash reports in parallel */
+	for (num_afc = 0; num_afc < CRASH_REPORT_COPY_CONNECTIONS; num_afc++) {
+		lockdownd_error = lockdownd_start_service(lockdownd, "com.apple.crashreportcopymobile", &service);
+		if (lockdownd_error != LOCKDOWN_E_SUCCESS) {
+			break;
+		}
+		afc_error = afc_client_new(device, service, &afc[num_afc]);
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
+		if (afc_error != AFC_E_SUCCESS) {
+			break;
+		}
 	}
 	lockdownd_client_free(lockdownd);
 
-	afc = NULL;
-	afc_error = afc_client_new(device, service, &afc);
-	if(afc_error != AFC_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
+	if (num_afc == 0) {
 		idevice_free(device);
 		return -1;
 	}
 
-	if (service) {
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
-	}
-
 	/* recursively copy crash reports from the device to a local directory */
-	if (afc_client_copy_and_remove_crash_reports(afc, ".", target_directory) < 0) {
+	if (afc_client_copy_and_remove_crash_reports(afc, num_afc, ".", target_directory) < 0) {
 		fprintf(stderr, "ERROR: Failed to get crash reports from device.\n");
-		afc_client_free(afc);
+		for (i = 0; i < (int)num_afc; i++) {
+			afc_client_free(afc[i]);
+		}
 		idevice_free(device);
 		return -1;
 	}
 
 	printf("Done.\n");
 
-	afc_client_free(afc);
+	for (i = 0; i < (int)num_afc; i++) {
+		afc_client_free(afc[i]);
+	}
 	idevice_free(device);
 
 	return 0;
@@ -19,20 +19,29 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
 
 #ifdef WIN32
 #include <windows.h>
 #define sleep(x) Sleep(x*1000)
+#define usleep(x) Sleep(x/1000)
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/syslog_relay.h>
+#include "common/thread.h"
 
 static int quit_flag = 0;
 
@@ -43,12 +52,644 @@ static char* udid = NULL;
 static idevice_t device = NULL;
 static syslog_relay_client_t syslog = NULL;
 
-static void syslog_callback(char c, void *user_data)
+/* messages are matched against the filter before they are formatted */
+struct log_filter {
+	char **processes;
+	int num_processes;
+	int *pids;
+	int num_pids;
+	syslog_relay_level_t min_level;
+#ifdef HAVE_REGEX_H
+	int use_regex;
+	regex_t regex;
+#endif
+	int active;
+};
+
+/* filter state kept per syslog stream */
+struct line_state {
+	/* lines not starting with a syslog header belong to the previous message */
+	int last_line_matched;
+	char *msgbuf;
+	uint32_t msgbuf_size;
+};
+
+typedef void (*line_emit_cb_t)(const char *line, uint32_t length, const syslog_relay_record_t *record, int parsed, void *user_data);
+
+static struct log_filter filter;
+static struct line_state stdout_state = { 1, NULL, 0 };
+static int json_output = 0;
+static int json_record_open = 0;
+/* set while no syslog data arrived since the last check of the main loop */
+static int json_idle = 0;
+/* protects the JSON record state against the main loop */
+static mutex_t json_mutex;
+
+static int filter_add_process(const char *process)
+{
+	char **new_processes = (char**)realloc(filter.processes, sizeof(char*) * (filter.num_processes + 1));
+	if (!new_processes)
+		return -1;
+	filter.processes = new_processes;
+	filter.processes[filter.num_processes++] = strdup(process);
+	filter.active = 1;
+	return 0;
+}
+
+static int filter_add_pid(const char *pid)
+{
+	char *end = NULL;
+	long value = strtol(pid, &end, 10);
+	if (!end || *end != '\0' || value < 0)
+		return -1;
+	int *new_pids = (int*)realloc(filter.pids, sizeof(int) * (filter.num_pids + 1));
+	if (!new_pids)
+		return -1;
+	filter.pids = new_pids;
+	filter.pids[filter.num_pids++] = (int)value;
+	filter.active = 1;
+	return 0;
+}
+
+static void filter_free(void)
+{
+	int i;
+	for (i = 0; i < filter.num_processes; i++) {
+		free(filter.processes[i]);
+	}
+	free(filter.processes);
+	free(filter.pids);
+#ifdef HAVE_REGEX_H
+	if (filter.use_regex) {
+		regfree(&filter.regex);
+	}
+#endif
+	memset(&filter, '\0', sizeof(filter));
+}
+
+static int filter_match(const syslog_relay_record_t *record, struct line_state *state)
+{
+	int i;
+
+	if (!filter.active)
+		return 1;
+
+	if (filter.min_level != SYSLOG_RELAY_LEVEL_UNKNOWN && record->level != SYSLOG_RELAY_LEVEL_UNKNOWN && record->level < filter.min_level)
+		return 0;
+
+	if (filter.num_pids > 0) {
+		for (i = 0; i < filter.num_pids; i++) {
+			if (filter.pids[i] == record->pid)
+				break;
+		}
+		if (i == filter.num_pids)
+			return 0;
+	}
+
+	if (filter.num_processes > 0) {
+		for (i = 0; i < filter.num_processes; i++) {
+			if (strlen(filter.processes[i]) == record->process.length && !strncmp(filter.processes[i], record->process.data, record->process.length))
+				break;
+		}
+		if (i == filter.num_processes)
+			return 0;
+	}
+
+#ifdef HAVE_REGEX_H
+	if (filter.use_regex) {
+		/* regexec needs a terminated string, only copy for the last check */
+		if (record->message.length >= state->msgbuf_size) {
+			char *newbuf = (char*)realloc(state->msgbuf, record->message.length + 1);
+			if (!newbuf)
+				return 0;
+			state->msgbuf = newbuf;
+			state->msgbuf_size = record->message.length + 1;
+		}
+		memcpy(state->msgbuf, record->message.data, record->message.length);
+		state->msgbuf[record->message.length] = '\0';
+		if (regexec(&filter.regex, state->msgbuf, 0, NULL, 0) != 0)
+			return 0;
+	}
+#endif
+
+	return 1;
+}
+
+static void print_json_escaped(const syslog_relay_field_t *field)
+{
+	uint32_t i;
+	const char *start = field->data;
+
+	for (i = 0; i < field->length; i++) {
+		unsigned char c = (unsigned char)field->data[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		fwrite(start, 1, field->data + i - start, stdout);
+		start = field->data + i + 1;
+		switch (c) {
+			case '"':
+				fputs("\\\"", stdout);
+				break;
+			case '\\':
+				fputs("\\\\", stdout);
+				break;
+			case '\t':
+				fputs("\\t", stdout);
+				break;
+			case '\r':
+				fputs("\\r", stdout);
+				break;
+			case '\n':
+				fputs("\\n", stdout);
+				break;
+			default:
+				printf("\\u%04x", c);
+				break;
+		}
+	}
+	fwrite(start, 1, field->data + field->length - start, stdout);
+}
+
+static void print_json_string(const char *key, const syslog_relay_field_t *field, int first)
+{
+	printf("%s\"%s\":\"", (first) ? "" : ",", key);
+	print_json_escaped(field);
+	putchar('"');
+}
+
+/**
+ * Terminates the JSON object of the last message. It is kept open until
+ * the next message starts or no more data arrived for a moment, as more
+ * lines of it might follow.
+ */
+static void print_json_record_end(void)
+{
+	if (json_record_open) {
+		fputs("\"}\n", stdout);
+		json_record_open = 0;
+	}
+}
+
+static void print_json_record(const syslog_relay_record_t *record, int parsed)
+{
+	if (!parsed && json_record_open) {
+		/* continuation of a multi-line message */
+		fputs("\\n", stdout);
+		print_json_escaped(&record->message);
+		return;
+	}
+
+	print_json_record_end();
+	putchar('{');
+	if (parsed) {
+		print_json_string("timestamp", &record->timestamp, 1);
+		print_json_string("device", &record->device_name, 0);
+		print_json_string("process", &record->process, 0);
+		if (record->image.length > 0) {
+			print_json_string("image", &record->image, 0);
+		}
+		if (record->pid >= 0) {
+			printf(",\"pid\":%d", record->pid);
+		}
+		printf(",\"level\":\"%s\",", syslog_relay_level_to_string(record->level));
+	}
+	fputs("\"message\":\"", stdout);
+	print_json_escaped(&record->message);
+	json_record_open = 1;
+}
+
+/**
+ * Splits a block of syslog data into lines and passes the lines that match
+ * the filter to the given function.
+ */
+static void filter_lines(const char *data, uint32_t length, struct line_state *state, line_emit_cb_t emit, void *user_data)
+{
+	const char *end = data + length;
+	const char *line = data;
+
+	while (line < end) {
+		syslog_relay_record_t record;
+		const char *eol = (const char*)memchr(line, '\n', end - line);
+		const char *next = (eol) ? eol + 1 : end;
+		int parsed = (syslog_relay_parse_line(line, next - line, &record) == SYSLOG_RELAY_E_SUCCESS);
+
+		if (parsed) {
+			state->last_line_matched = filter_match(&record, state);
+		}
+		if (state->last_line_matched) {
+			emit(line, next - line, &record, parsed, user_data);
+		}
+		line = next;
+	}
+}
+
+static void stdout_emit(const char *line, uint32_t length, const syslog_relay_record_t *record, int parsed, void *user_data)
+{
+	if (json_output) {
+		print_json_record(record, parsed);
+	} else {
+		fwrite(line, 1, length, stdout);
+	}
+}
+
+static void syslog_callback(const char *data, uint32_t length, void *user_data)
+{
+	mutex_lock(&json_mutex);
+	if (!filter.active && !json_output) {
+		fwrite(data, 1, length, stdout);
+	} else {
+		filter_lines(data, length, &stdout_state, stdout_emit, NULL);
+	}
+	json_idle = 0;
+	fflush(stdout);
+	mutex_unlock(&json_mutex);
+}
+
+/* aggregator mode: one relay per device, written to rotating files */
+
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_FILE_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+#define LOG_FILE_DEFAULT_MAX_FILES 5
+/* limits for --max-size (in MB) and --max-files */
+#define LOG_FILE_MAX_SIZE_LIMIT (1024 * 1024)
+#define LOG_FILE_MAX_FILES_LIMIT 1000
+
+/* single producer, single consumer ring buffer. head is only written by
+ * the relay thread of the device, tail only by the writer thread. */
+struct log_ring {
+	char *data;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+};
+
+struct device_log {
+	char *udid;
+	idevice_t device;
+	syslog_relay_client_t client;
+	struct log_ring ring;
+	struct line_state state;
+	FILE *file;
+	uint64_t file_size;
+	uint32_t reported_dropped;
+	int detached;
+	struct device_log *next;
+};
+
+static char *output_dir = NULL;
+static uint64_t max_file_size = LOG_FILE_DEFAULT_MAX_SIZE;
+static int max_files = LOG_FILE_DEFAULT_MAX_FILES;
+static struct device_log *device_logs = NULL;
+static mutex_t device_logs_mutex;
+static thread_t writer_thread;
+static int writer_quit = 0;
+
+/**
+ * Copies data into the ring without ever blocking. Data that does not fit
+ * is dropped and accounted for.
+ */
+static void ring_write(struct log_ring *ring, const char *data, uint32_t length)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t pos = head & (ring->size - 1);
+	uint32_t first;
+
+	if (length > ring->size - (head - tail)) {
+		__atomic_fetch_add(&ring->dropped, length, __ATOMIC_RELAXED);
+		return;
+	}
+
+	first = ring->size - pos;
+	if (first > length)
+		first = length;
+	memcpy(ring->data + pos, data, first);
+	memcpy(ring->data, data + first, length - first);
+
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+static void ring_emit(const char *line, uint32_t length, const syslog_relay_record_t *record, int parsed, void *user_data)
+{
+	ring_write((struct log_ring*)user_data, line, length);
+}
+
+static void device_log_callback(const char *data, uint32_t length, void *user_data)
+{
+	struct device_log *dl = (struct device_log*)user_data;
+
+	if (!filter.active) {
+		ring_write(&dl->ring, data, length);
+	} else {
+		filter_lines(data, length, &dl->state, ring_emit, &dl->ring);
+	}
+}
+
+static char *device_log_path(struct device_log *dl, int index)
+{
+	size_t len = strlen(output_dir) + strlen(dl->udid) + 32;
+	char *path = (char*)malloc(len);
+	if (!path)
+		return NULL;
+	if (index > 0) {
+		snprintf(path, len, "%s/%s.log.%d", output_dir, dl->udid, index);
+	} else {
+		snprintf(path, len, "%s/%s.log", output_dir, dl->udid);
+	}
+	return path;
+}
+
+static int device_log_open(struct device_log *dl)
+{
+	char *path = device_log_path(dl, 0);
+	if (!path)
+		return -1;
+	dl->file = fopen(path, "ab");
+	if (!dl->file) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+	fseek(dl->file, 0, SEEK_END);
+	dl->file_size = ftell(dl->file);
+	return 0;
+}
+
+static void device_log_rotate(struct device_log *dl)
+{
+	int i;
+
+	fclose(dl->file);
+	dl->file = NULL;
+
+	if (max_files == 0) {
+		/* no rotated files are kept, start over with an empty file */
+		char *path = device_log_path(dl, 0);
+		if (path) {
+			remove(path);
+		}
+		free(path);
+	}
+
+	for (i = max_files; i > 0; i--) {
+		char *from = device_log_path(dl, i - 1);
+		char *to = device_log_path(dl, i);
+		if (from && to) {
+			if (i == max_files) {
+				remove(to);
+			}
+			rename(from, to);
+		}
+		free(from);
+		free(to);
+	}
+
+	device_log_open(dl);
+}
+
+/**
+ * Writes everything buffered in the ring of a device to its log file.
+ *
+ * @return 1 if data was written, 0 otherwise.
+ */
+static int device_log_flush(struct device_log *dl)
+{
+	uint32_t head = __atomic_load_n(&dl->ring.head, __ATOMIC_ACQUIRE);
+	uint32_t dropped = __atomic_load_n(&dl->ring.dropped, __ATOMIC_RELAXED);
+	uint32_t tail = dl->ring.tail;
+	uint32_t avail = head - tail;
+
+	if (avail == 0 && dropped == dl->reported_dropped)
+		return 0;
+
+	if (!dl->file && device_log_open(dl) < 0) {
+		/* nowhere to write to, discard to keep the relay going */
+		dl->reported_dropped = dropped;
+		__atomic_store_n(&dl->ring.tail, head, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	if (dropped != dl->reported_dropped) {
+		int len = fprintf(dl->file, "[idevicesyslog: %u bytes dropped]\n", dropped - dl->reported_dropped);
+		if (len > 0)
+			dl->file_size += len;
+		dl->reported_dropped = dropped;
+	}
+
+	while (avail > 0) {
+		uint32_t pos = tail & (dl->ring.size - 1);
+		uint32_t chunk = dl->ring.size - pos;
+		if (chunk > avail)
+			chunk = avail;
+		fwrite(dl->ring.data + pos, 1, chunk, dl->file);
+		dl->file_size += chunk;
+		tail += chunk;
+		avail -= chunk;
+	}
+	__atomic_store_n(&dl->ring.tail, tail, __ATOMIC_RELEASE);
+	fflush(dl->file);
+
+	if (dl->file_size >= max_file_size) {
+		device_log_rotate(dl);
+	}
+
+	return 1;
+}
+
+static void device_log_free(struct device_log *dl)
+{
+	if (dl->file) {
+		fclose(dl->file);
+	}
+	free(dl->state.msgbuf);
+	free(dl->ring.data);
+	free(dl->udid);
+	free(dl);
+}
+
+/**
+ * Drains the rings of all devices to disk. Devices that have been detached
+ * are freed once their ring is empty.
+ */
+static void *writer_thread_func(void *arg)
+{
+	while (1) {
+		struct device_log *dl = NULL;
+		int busy = 0;
+
+		mutex_lock(&device_logs_mutex);
+		dl = device_logs;
+		mutex_unlock(&device_logs_mutex);
+
+		/* new devices are only ever added at the head of the list and only
+		 * this thread removes them, so the list can be walked without
+		 * holding the lock */
+		while (dl) {
+			struct device_log *next = dl->next;
+			int detached = __atomic_load_n(&dl->detached, __ATOMIC_ACQUIRE);
+			busy |= device_log_flush(dl);
+			if (detached && dl->ring.tail == dl->ring.head) {
+				struct device_log **prev;
+				mutex_lock(&device_logs_mutex);
+				for (prev = &device_logs; *prev; prev = &(*prev)->next) {
+					if (*prev == dl) {
+						*prev = dl->next;
+						break;
+					}
+				}
+				mutex_unlock(&device_logs_mutex);
+				device_log_free(dl);
+			}
+			dl = next;
+		}
+
+		if (!busy) {
+			mutex_lock(&device_logs_mutex);
+			int done = writer_quit && !device_logs;
+			mutex_unlock(&device_logs_mutex);
+			if (done)
+				break;
+			usleep(50000);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the device log of an attached device. Must be called with
+ * device_logs_mutex held.
+ */
+static struct device_log *device_log_find(const char *device_udid)
 {
-	putchar(c);
-	if (c == '\n') {
-		fflush(stdout);
+	struct device_log *dl;
+	for (dl = device_logs; dl; dl = dl->next) {
+		if (!dl->detached && !strcmp(dl->udid, device_udid))
+			return dl;
 	}
+	return NULL;
+}
+
+static void device_log_attach(const char *device_udid)
+{
+	struct device_log *dl = (struct device_log*)calloc(1, sizeof(struct device_log));
+	if (!dl)
+		return;
+	dl->udid = strdup(device_udid);
+	dl->state.last_line_matched = 1;
+	dl->ring.size = LOG_RING_SIZE;
+	dl->ring.data = (char*)malloc(dl->ring.size);
+	if (!dl->udid || !dl->ring.data) {
+		device_log_free(dl);
+		return;
+	}
+
+	if (idevice_new(&dl->device, device_udid) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Device with udid %s not found!?\n", device_udid);
+		device_log_free(dl);
+		return;
+	}
+	if (syslog_relay_client_start_service(dl->device, &dl->client, "idevicesyslog") != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not start service com.apple.syslog_relay for %s.\n", device_udid);
+		idevice_free(dl->device);
+		device_log_free(dl);
+		return;
+	}
+
+	/* publish before the relay starts writing to the ring */
+	mutex_lock(&device_logs_mutex);
+	dl->next = device_logs;
+	device_logs = dl;
+	mutex_unlock(&device_logs_mutex);
+
+	if (syslog_relay_start_capture_raw(dl->client, device_log_callback, dl) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to start capturing syslog of %s.\n", device_udid);
+		syslog_relay_client_free(dl->client);
+		dl->client = NULL;
+		idevice_free(dl->device);
+		dl->device = NULL;
+		__atomic_store_n(&dl->detached, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	fprintf(stdout, "[connected %s]\n", device_udid);
+	fflush(stdout);
+}
+
+static void device_log_detach(struct device_log *dl)
+{
+	/* joins the relay thread, nothing writes to the ring afterwards */
+	syslog_relay_client_free(dl->client);
+	dl->client = NULL;
+	idevice_free(dl->device);
+	dl->device = NULL;
+	__atomic_store_n(&dl->detached, 1, __ATOMIC_RELEASE);
+
+	fprintf(stdout, "[disconnected %s]\n", dl->udid);
+	fflush(stdout);
+}
+
+static void aggregator_event_cb(const idevice_event_t* event, void* userdata)
+{
+	struct device_log *dl;
+
+	if (udid && strcmp(udid, event->udid) != 0)
+		return;
+
+	mutex_lock(&device_logs_mutex);
+	dl = device_log_find(event->udid);
+	mutex_unlock(&device_logs_mutex);
+
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		if (!dl) {
+			device_log_attach(event->udid);
+		}
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		if (dl) {
+			device_log_detach(dl);
+		}
+	}
+}
+
+static int run_aggregator(void)
+{
+	struct device_log *dl;
+	int res = 0;
+
+	mutex_init(&device_logs_mutex);
+	if (thread_new(&writer_thread, writer_thread_func, NULL) != 0) {
+		fprintf(stderr, "ERROR: Could not start writer thread.\n");
+		mutex_destroy(&device_logs_mutex);
+		return -1;
+	}
+
+	if (idevice_event_subscribe(aggregator_event_cb, NULL) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not subscribe to device events.\n");
+		res = -1;
+	} else {
+		while (!quit_flag) {
+			sleep(1);
+		}
+		idevice_event_unsubscribe();
+	}
+
+	/* holding the lock keeps the writer thread from freeing any device
+	 * while the remaining ones are detached */
+	mutex_lock(&device_logs_mutex);
+	for (dl = device_logs; dl; dl = dl->next) {
+		if (!dl->detached) {
+			device_log_detach(dl);
+		}
+	}
+	writer_quit = 1;
+	mutex_unlock(&device_logs_mutex);
+	thread_join(writer_thread);
+	thread_free(writer_thread);
+	mutex_destroy(&device_logs_mutex);
+
+	return res;
 }
 
 static int start_logging(void)
@@ -70,7 +711,7 @@ static int start_logging(void)
 	}
 
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture(syslog, syslog_callback, NULL);
+	serr = syslog_relay_start_capture_raw(syslog, syslog_callback, NULL);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
 		syslog_relay_client_free(syslog);
@@ -95,6 +736,11 @@ static void stop_logging(void)
 		syslog = NULL;
 	}
 
+	mutex_lock(&json_mutex);
+	print_json_record_end();
+	fflush(stdout);
+	mutex_unlock(&json_mutex);
+
 	if (device) {
 		idevice_free(device);
 		device = NULL;
@@ -122,6 +768,24 @@ static void device_event_cb(const idevice_event_t* event, void* userdata)
 	}
 }
 
+/**
+ * Parses a decimal number that has to be within the given range.
+ *
+ * @return 0 on success, -1 if str is not a number or out of range.
+ */
+static int parse_number(const char *str, long min, long max, long *value)
+{
+	char *end = NULL;
+	long result;
+
+	errno = 0;
+	result = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || result < min || result > max)
+		return -1;
+	*value = result;
+	return 0;
+}
+
 /**
  * signal handler function for cleaning up properly
  */
@@ -157,6 +821,86 @@ int main(int argc, char *argv[])
 			udid = strdup(argv[i]);
 			continue;
 		}
+		else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--process")) {
+			i++;
+			if (!argv[i] || filter_add_process(argv[i]) < 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "--pid")) {
+			i++;
+			if (!argv[i] || filter_add_pid(argv[i]) < 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--level")) {
+			i++;
+			if (!argv[i] || (filter.min_level = syslog_relay_level_from_string(argv[i])) == SYSLOG_RELAY_LEVEL_UNKNOWN) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			filter.active = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--match")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+#ifdef HAVE_REGEX_H
+			if (filter.use_regex) {
+				regfree(&filter.regex);
+			}
+			if (regcomp(&filter.regex, argv[i], REG_EXTENDED | REG_NOSUB) != 0) {
+				fprintf(stderr, "ERROR: Invalid regular expression '%s'\n", argv[i]);
+				return -1;
+			}
+			filter.use_regex = 1;
+			filter.active = 1;
+#else
+			fprintf(stderr, "ERROR: Regular expressions are not supported on this platform\n");
+			return -1;
+#endif
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--json")) {
+			json_output = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output-dir")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			output_dir = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--max-size")) {
+			long value = 0;
+			i++;
+			if (!argv[i] || parse_number(argv[i], 1, LOG_FILE_MAX_SIZE_LIMIT, &value) < 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			max_file_size = (uint64_t)value * 1024 * 1024;
+			continue;
+		}
+		else if (!strcmp(argv[i], "--max-files")) {
+			long value = 0;
+			i++;
+			if (!argv[i] || parse_number(argv[i], 0, LOG_FILE_MAX_FILES_LIMIT, &value) < 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			max_files = (int)value;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -167,6 +911,19 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (output_dir) {
+		if (json_output) {
+			fprintf(stderr, "ERROR: --json can't be used together with --output-dir.\n");
+			return -1;
+		}
+		i = run_aggregator();
+		filter_free();
+		if (udid) {
+			free(udid);
+		}
+		return i;
+	}
+
 	int num = 0;
 	char **devices = NULL;
 	idevice_get_device_list(&devices, &num);
@@ -180,13 +937,32 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	mutex_init(&json_mutex);
+
 	idevice_event_subscribe(device_event_cb, NULL);
 
 	while (!quit_flag) {
-		sleep(1);
+		if (!json_output) {
+			sleep(1);
+			continue;
+		}
+		usleep(100000);
+		/* the last message is complete once the relay has been quiet for
+		 * a while, don't hold it back until the next one arrives */
+		mutex_lock(&json_mutex);
+		if (json_idle && json_record_open) {
+			print_json_record_end();
+			fflush(stdout);
+		}
+		json_idle = 1;
+		mutex_unlock(&json_mutex);
 	}
 	idevice_event_unsubscribe();
 	stop_logging();
+	mutex_destroy(&json_mutex);
+
+	filter_free();
+	free(stdout_state.msgbuf);
 
 	if (udid) {
 		free(udid);
@@ -204,6 +980,16 @@ void print_usage(int argc, char **argv)
 	printf("Relay syslog of a connected device.\n\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -u, --udid UDID\ttarget specific device by its 40-digit device UDID\n");
+	printf("  -p, --process NAME\tonly show messages of processes with this name\n");
+	printf("  --pid PID\t\tonly show messages of processes with this pid\n");
+	printf("  -l, --level LEVEL\tonly show messages with at least this level, e.g. warning\n");
+	printf("  -m, --match REGEX\tonly show messages matching this regular expression\n");
+	printf("  -j, --json\t\toutput one JSON object per message\n");
+	printf("  -o, --output-dir DIR\twrite the syslog of every connected device (or the\n");
+	printf("  \t\t\tone given with -u) to rotating files DIR/UDID.log\n");
+	printf("  --max-size MB\t\trotate log files when they reach this size (default: 16)\n");
+	printf("  --max-files N\t\tnumber of rotated log files to keep, 0 truncates the\n");
+	printf("  \t\t\tlog file instead (default: 5)\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 	printf("Homepage: <http://libimobiledevice.org>\n");